@@ -1,61 +1,343 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include "errors.h"
 
-#define BUFSIZE 4096
+#define DEFAULT_BLOCK_SIZE (128 * 1024)
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define BUF_ALIGNMENT 4096
+    // Satisfies O_DIRECT on the usual block devices
+#define FAST_CHUNK (1 << 30)
+    // Upper limit for bytes moved by one copy_file_range/sendfile/splice
+#define PREFETCH_BYTES (1 << 20)
+    // How much of the beginning of an upcoming file is read ahead
+#define MAX_READAHEAD_CNT 1024
+    // Every file read ahead holds a descriptor open
 
-void cat(FILE *);
+/*
+ * A file opened ahead of time. If opening failed, fd is -1 and the error is
+ * reported only when it's the file's turn, so that the output up to that
+ * point is the same as without read-ahead. is_direct tells whether the file
+ * really was opened with O_DIRECT.
+ */
+struct prefetch_slot {
+    int fd;
+    int open_errno;
+    int is_direct;
+};
+
+struct prefetch_slot open_prefetched(const char *, int, int);
+void cat(int, char *, size_t);
+void write_all(const char *, size_t);
+int cat_fast(int);
+ssize_t copy_chunk(int, int, mode_t);
+int is_unsupported(int);
+size_t parse_size(const char *);
+double now_sec(void);
+
+// Number of bytes written to stdout so far, for the throughput report
+off_t bytes_written = 0;
 
 /*
  * Reads characters from files or stdin if no file is specified at the command
- * line and prints them to stdout.
+ * line and prints them to stdout. Options:
+ *     -r count  open and read ahead the next count files while the current
+ *               one is being written
+ *     -b size   copy in blocks of size bytes (suffixes K and M allowed)
+ *     -d        read with O_DIRECT and always use the read/write loop
+ *     -v        report the throughput on stderr at the end
  */
 int main(int argc, char *argv[])
 {
-    // If no command line arguments are specified, read from stdin
-    if (argc == 1) {
-        cat(stdin);
-        return 0;
+    // Parse options
+    int readahead_cnt = 0;
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+    int direct        = 0;
+    int verbose       = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:dv")) != -1) {
+        switch (opt) {
+        case 'r': {
+            char *end;
+            long cnt = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || cnt < 0
+                    || cnt > MAX_READAHEAD_CNT) {
+                errx(ARG_ERROR, "Invalid read-ahead count: %s", optarg);
+            }
+            readahead_cnt = cnt;
+            break;
+        }
+        case 'b':
+            block_size = parse_size(optarg);
+            break;
+        case 'd':
+            direct = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            errx(ARG_ERROR, "Usage: cat [-dv] [-r count] [-b size] [file...]");
+        }
+    }
+    int file_cnt = argc - optind;
+    char **files = argv + optind;
+
+    // Allocate the buffer for the read/write loop once
+    char *buffer;
+    errno = posix_memalign((void **) &buffer, BUF_ALIGNMENT, block_size);
+    if (errno != 0) {
+        err(INPUT_ERROR, "Cannot allocate buffer of %zu bytes", block_size);
+    }
+    double start_sec = now_sec();
+
+    // If no files are specified, read from stdin
+    if (file_cnt == 0) {
+        if (direct || !cat_fast(STDIN_FILENO)) {
+            cat(STDIN_FILENO, buffer, block_size);
+        }
     }
 
-    // Otherwise walk through all specified files
-    for (int file_nr = 1; file_nr < argc; ++file_nr) {
-        // Open the file
-        FILE *stream = fopen(argv[file_nr], "r");
-        if (stream == NULL) {
-            err(ARG_ERROR, "Can't open %s for reading", argv[file_nr]);
+    // Otherwise walk through all specified files, keeping a ring of the
+    // current file and the ones opened ahead of it
+    int window_size = readahead_cnt + 1;
+    struct prefetch_slot *window
+        = malloc(window_size * sizeof(struct prefetch_slot));
+    if (window == NULL) {
+        err(INPUT_ERROR, "Cannot allocate read-ahead window");
+    }
+    int opened_cnt = 0;
+    int direct_cnt = 0;
+
+    for (int file_nr = 0; file_nr < file_cnt; ++file_nr) {
+        // Open the file and the ones after it that are not open yet
+        while (opened_cnt < file_cnt && opened_cnt < file_nr + window_size) {
+            window[opened_cnt % window_size] = open_prefetched(
+                                                   files[opened_cnt],
+                                                   readahead_cnt > 0,
+                                                   direct
+                                               );
+            ++opened_cnt;
+        }
+
+        // Report an error in opening only now, in order
+        int fd = window[file_nr % window_size].fd;
+        if (fd == -1) {
+            errno = window[file_nr % window_size].open_errno;
+            err(ARG_ERROR, "Can't open %s for reading", files[file_nr]);
         }
+        direct_cnt += window[file_nr % window_size].is_direct;
 
-        // Write its contents to stdout
-        cat(stream);
+        // Write its contents to stdout, letting the kernel copy if it can
+        if (direct || !cat_fast(fd)) {
+            cat(fd, buffer, block_size);
+        }
 
         // Close the file
-        if (fclose(stream) == EOF) {
-            err(INPUT_ERROR, "Error in closing file %s", argv[file_nr]);
+        if (close(fd) == -1) {
+            err(INPUT_ERROR, "Error in closing file %s", files[file_nr]);
+        }
+    }
+
+    // Report the throughput. Stdin is never opened with O_DIRECT, and files
+    // on filesystems without it are read through the page cache after all.
+    if (verbose) {
+        double elapsed = now_sec() - start_sec;
+        fprintf(stderr, "cat: %lld bytes in %.3f s (%.1f MB/s, %zu byte blocks",
+                (long long) bytes_written, elapsed,
+                elapsed > 0 ? bytes_written / elapsed / 1e6 : 0.0,
+                block_size);
+        int input_cnt = file_cnt > 0 ? file_cnt : 1;
+        if (direct && direct_cnt == input_cnt) {
+            fprintf(stderr, ", O_DIRECT");
         }
+        else if (direct) {
+            fprintf(stderr, ", O_DIRECT for %d of %d inputs", direct_cnt,
+                    input_cnt);
+        }
+        fprintf(stderr, ")\n");
     }
 
+    free(window);
+    free(buffer);
     return 0;
 }
 
 /*
- * Reads characters from *stream and prints them to stdout until EOF is
- * encountered.
+ * Opens the file at path for reading, with O_DIRECT if direct is set and the
+ * filesystem supports it. If prefetch is set, asks the kernel to start reading the beginning of the file
+ * into the page cache in the background.
  */
-void cat(FILE *stream)
+struct prefetch_slot open_prefetched(const char *path, int prefetch,
+                                     int direct)
 {
-    char buffer[BUFSIZE];
+    struct prefetch_slot slot;
+    slot.fd        = open(path, O_RDONLY | (direct ? O_DIRECT : 0));
+    slot.is_direct = direct && slot.fd != -1;
+
+    // Not every filesystem supports O_DIRECT (tmpfs doesn't)
+    if (slot.fd == -1 && direct && errno == EINVAL) {
+        slot.fd = open(path, O_RDONLY);
+    }
+    slot.open_errno = errno;
+
+    // The advice is only a hint, so failure doesn't matter
+    if (slot.fd != -1 && prefetch && !direct) {
+        posix_fadvise(slot.fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    }
 
-    // Read characters until an error or the end of the file occurs
-    while (fgets(buffer, BUFSIZE, stream) != NULL) {
+    return slot;
+}
+
+/*
+ * Reads blocks of at most block_size bytes from in_fd into buffer and writes
+ * them to stdout until EOF is encountered. Works for any data, including NUL
+ * bytes and lines longer than the buffer.
+ */
+void cat(int in_fd, char *buffer, size_t block_size)
+{
+    // Read blocks until an error or the end of the file occurs
+    ssize_t read_cnt;
+    while ((read_cnt = read(in_fd, buffer, block_size)) > 0) {
         // Print them to stdout
-        if (fputs(buffer, stdout) == EOF) {
-            err(OUTPUT_ERROR, "Error in writing to stdout");
-        }
+        write_all(buffer, read_cnt);
     }
 
     // Detect errors in reading
-    if (ferror(stream)) {
+    if (read_cnt == -1) {
         err(INPUT_ERROR, "Error while reading");
     }
 }
+
+// Write all of the length bytes at data to stdout
+void write_all(const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written == -1) {
+            err(OUTPUT_ERROR, "Error in writing to stdout");
+        }
+
+        data          += written;
+        length        -= written;
+        bytes_written += written;
+    }
+}
+
+/*
+ * Copies the regular file behind in_fd to stdout without passing the data
+ * through user space. Returns 1 if the whole file was copied and 0 if the
+ * caller has to copy (the rest of) it with cat().
+ */
+int cat_fast(int in_fd)
+{
+    /*
+     * Which system call does the copying depends on what stdout is:
+     *     regular file -> copy_file_range
+     *     socket       -> sendfile
+     *     pipe         -> splice
+     * All of them advance the file offset of in_fd. If the kernel refuses to
+     * copy somewhere in the middle, cat() just carries on from the offset the
+     * kernel left behind.
+     */
+    int out_fd = STDOUT_FILENO;
+
+    // Only regular files are guaranteed to work as source for all three calls
+    struct stat in_stat, out_stat;
+    if (fstat(in_fd, &in_stat) == -1 || !S_ISREG(in_stat.st_mode)) {
+        return 0;
+    }
+    if (fstat(out_fd, &out_stat) == -1) {
+        return 0;
+    }
+    if (!S_ISREG(out_stat.st_mode) && !S_ISSOCK(out_stat.st_mode)
+            && !S_ISFIFO(out_stat.st_mode)) {
+        return 0;
+    }
+
+    // Copy until the end of the file
+    ssize_t copied;
+    do {
+        copied = copy_chunk(in_fd, out_fd, out_stat.st_mode);
+        if (copied > 0) {
+            bytes_written += copied;
+        }
+    } while (copied > 0);
+    if (copied == -1) {
+        if (is_unsupported(errno)) {
+            return 0;
+        }
+        err(OUTPUT_ERROR, "Error in writing to stdout");
+    }
+
+    return 1;
+}
+
+// Let the kernel copy the next chunk from in_fd to out_fd, which is of type
+// out_mode. Return the number of bytes copied, 0 at EOF and -1 on error.
+ssize_t copy_chunk(int in_fd, int out_fd, mode_t out_mode)
+{
+    if (S_ISREG(out_mode)) {
+        return copy_file_range(in_fd, NULL, out_fd, NULL, FAST_CHUNK, 0);
+    }
+    else if (S_ISSOCK(out_mode)) {
+        return sendfile(out_fd, in_fd, NULL, FAST_CHUNK);
+    }
+    else {
+        return splice(in_fd, NULL, out_fd, NULL, FAST_CHUNK, SPLICE_F_MOVE);
+    }
+}
+
+// Return 1 if the error number says that the kernel can't copy between the
+// two descriptors (as opposed to a real I/O error) and 0 otherwise
+int is_unsupported(int errnum)
+{
+    switch (errnum) {
+    case EINVAL:        // e.g. splice to a pipe opened with O_DIRECT
+    case EXDEV:         // copy_file_range across filesystems on old kernels
+    case ENOSYS:        // System call not available at all
+    case EOPNOTSUPP:    // Filesystem doesn't implement it
+    case EBADF:         // copy_file_range onto a file opened with O_APPEND
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Convert a size like 4096, 256K or 1M to bytes, rounded up to a multiple of
+// the buffer alignment
+size_t parse_size(const char *str)
+{
+    char *end;
+    long long size = strtoll(str, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        ++end;
+    }
+    else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        ++end;
+    }
+
+    if (end == str || *end != '\0' || size <= 0 || size > MAX_BLOCK_SIZE) {
+        errx(ARG_ERROR, "Invalid block size: %s", str);
+    }
+
+    return (size + BUF_ALIGNMENT - 1) / BUF_ALIGNMENT * BUF_ALIGNMENT;
+}
+
+// Return the time of the monotonic clock in seconds
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
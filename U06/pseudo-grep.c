@@ -1,124 +1,3554 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <err.h>
 #include "errors.h"
 
-void pseudo_grep(const char *, int, FILE *);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
-int main(int argc, const char *argv[])
+#define BUFSIZE (256 * 1024)
+#define SHORT_NEEDLE_MAX 16
+    // Up to this length, Horspool's worst case is still linear enough
+#define CANDIDATE_SLACK 4096
+    // False candidates the prefilter may verify before it has to pay for
+    // them with scanned bytes
+#define DENSE_STATES 64
+    // States of the Aho-Corasick automaton with a full transition table,
+    // 1 KiB each
+#define NO_STATE UINT32_MAX
+#define DFA_CACHE_STATES 1024
+    // DFA states kept before the cache is flushed, a bit over 2 KiB each
+#define DFA_CACHE_BUCKETS (2 * DFA_CACHE_STATES)
+#define MAX_JOBS 256
+#define INDEX_MAGIC "PGTRIDX1"
+#define TRIGRAM_CNT (1 << 24)
+
+/*
+ * How common each byte value is, from 0 (rarest) to 255 (most common).
+ * Derived from byte frequencies in a mix of English text, C headers and
+ * system logs. The prefilter looks for the pattern's rarest bytes, so that as
+ * few positions as possible need to be verified.
+ */
+static const unsigned char byte_rank[256] = {
+      0,   1,   2,   3,   4,   5,   6,   7,   8, 203, 241,   9, 160, 190,  10,  11,
+     12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,
+    255, 162, 187, 198, 153, 168, 169, 176, 212, 214, 224, 194, 227, 238, 242, 229,
+    231, 239, 233, 210, 225, 204, 221, 200, 196, 184, 226, 192, 182, 177, 181, 159,
+    173, 217, 189, 211, 202, 222, 197, 195, 193, 218, 163, 180, 215, 199, 213, 208,
+    206, 167, 216, 220, 219, 201, 185, 186, 183, 188, 170, 166, 172, 165, 151, 232,
+    161, 251, 235, 244, 246, 254, 234, 230, 237, 252, 179, 209, 245, 240, 250, 249,
+    236, 178, 247, 248, 253, 243, 223, 207, 205, 228, 191, 174, 164, 175, 171,  28,
+    149, 128, 127, 109, 110, 111, 157, 142, 114,  29,  30,  31, 105, 106, 120,  32,
+    124, 131, 156, 146, 118,  33,  34,  35,  36, 148,  37,  38, 137, 139, 115, 129,
+    122,  39,  40,  41, 145, 126,  42,  43, 141, 155,  44, 144, 102, 130, 103, 104,
+    140, 116,  45,  46, 147, 107, 150, 112, 143, 121, 123, 135, 132,  47,  48,  49,
+     50,  51, 154, 152, 117,  52,  53,  54, 113,  55,  56,  57,  58,  59, 133,  60,
+    138, 134,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,  72,  73,  74,
+     75, 125, 158,  76, 136, 108,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,
+    119,  87,  88,  89,  90,  91,  92,  93,  94,  95,  96,  97,  98,  99, 100, 101,
+};
+
+/*
+ * Aho-Corasick automaton for a set of patterns. The states are numbered in
+ * breadth-first order, so state 0 is the root and the states close to it,
+ * where the search spends most of its time, come first.
+ *     The first dense_cnt states have a complete transition table in dense,
+ * 256 entries per state. The others only store the edges of the trie, in a
+ * double array: the edge for byte c from state s leads to target[base[s] + c]
+ * if check[base[s] + c] == s. If there is no such edge, the search follows
+ * fail[s] and tries again, which ends in a dense state at the latest.
+ *     accepting[s] is set if a pattern ends in state s or in a state along
+ * its failure links.
+ */
+struct automaton {
+    uint32_t      *dense;
+    uint32_t      dense_cnt;
+    uint32_t      state_cnt;
+    uint32_t      *base;
+    uint32_t      *fail;
+    uint32_t      *check;
+    uint32_t      *target;
+    unsigned char *accepting;
+};
+
+// A node of the trie the automaton is built from
+struct trie_node {
+    uint32_t      first_child;
+    uint32_t      next_sibling;
+    uint32_t      fail;
+    unsigned char byte;
+    unsigned char accepting;
+};
+
+/*
+ * Free slots of the double array while it is built. next_free[slot] is slot
+ * if the slot is free and otherwise leads to a later slot that is free or
+ * closer to one. Slots from slot_cnt on don't exist yet and are all free.
+ */
+struct slot_allocator {
+    size_t slot_cnt;
+    size_t *next_free;
+};
+
+// Kinds of NFA states. NFA_NONE stands for no assertion.
+enum {
+    NFA_NONE,
+    NFA_BYTES,      // Consumes one byte of a set
+    NFA_SPLIT,      // Goes on to both out and out1
+    NFA_EMPTY,      // Goes on to out
+    NFA_BOL,        // Asserts the beginning of the line
+    NFA_EOL,        // Asserts the end of the line
+    NFA_MATCH
+};
+
+struct nfa_state {
+    int      kind;
+    uint32_t out;
+    uint32_t out1;
+    uint64_t bytes[4];
+};
+
+/*
+ * A compiled regular expression: a Thompson NFA, whose states refer to each
+ * other by number. match_start is where the expression itself begins, start
+ * adds a loop over the bytes of the line before it. On an empty line, the
+ * beginning and the end of the line are at the same place, so whether it
+ * matches is worked out in advance in empty_line_match. If all matches begin
+ * with the same bytes, prefix finds them. A regex is never changed after it has
+ * been built, so threads can share it.
+ */
+struct regex {
+    struct nfa_state *states;
+    uint32_t         state_cnt;
+    uint32_t         capacity;
+    uint32_t         start;
+    uint32_t         match_start;
+    int              empty_line_match;
+    struct matcher   *prefix;
+};
+
+struct regex_parser {
+    const unsigned char *pattern;
+    size_t              length;
+    size_t              pos;
+    struct regex        *regex;
+};
+
+// A piece of NFA under construction, with a list of successors still open
+struct fragment {
+    uint32_t start;
+    uint32_t holes;
+};
+
+// Buffers for computing sets of NFA states. A state belongs to the current
+// set if its mark equals generation.
+struct nfa_workspace {
+    uint32_t *stack;
+    uint32_t *marks;
+    uint32_t generation;
+    uint32_t state_cnt;
+};
+
+/*
+ * A state of the lazy DFA: a set of NFA states, sorted. next holds the
+ * transitions computed so far. eol_match is -1 until it's known whether the
+ * expression matches when the line ends in this state.
+ */
+struct dfa_state {
+    struct dfa_state *next[256];
+    struct dfa_state *hash_next;
+    uint32_t         hash;
+    int              is_match;
+    int              eol_match;
+    uint32_t         nfa_cnt;
+    uint32_t         nfa_states[];
+};
+
+/*
+ * The DFA states built for a regex so far, found by their NFA sets through
+ * the hash table buckets. When DFA_CACHE_STATES are reached, all of them are
+ * thrown away. set and result hold NFA sets being computed.
+ */
+struct dfa_cache {
+    const struct regex   *regex;
+    struct dfa_state     **states;
+    size_t               state_cnt;
+    struct dfa_state     **buckets;
+    struct dfa_state     *line_start;
+    uint32_t             *set;
+    uint32_t             *result;
+    struct nfa_workspace workspace;
+};
+
+typedef size_t (*newline_counter)(const unsigned char *, size_t);
+
+/*
+ * What to print about the lines found: with line_numbers, every line is
+ * preceded by its number; with count_only, only the number of matching lines
+ * is printed. before and after are the numbers of lines of context around
+ * matches; if either was given, separate_groups is set and groups of lines
+ * that don't follow each other are separated by "--".
+ */
+struct grep_options {
+    int             line_numbers;
+    int             count_only;
+    int             separate_groups;
+    uint64_t        before;
+    uint64_t        after;
+    newline_counter count_newlines;
+};
+
+/*
+ * The progress of the search through a stream. line_nr is the number of
+ * newlines before the part of the buffer being searched. next_unprinted is
+ * the number of the line after the last one printed, after_left how many
+ * lines of after context are still to come.
+ */
+struct grep_state {
+    const struct matcher      *matcher;
+    const struct grep_options *options;
+    FILE                      *out;
+    const char                *name;
+    uint64_t                  line_nr;
+    uint64_t                  match_cnt;
+    uint64_t                  next_unprinted;
+    uint64_t                  after_left;
+    int                       printed_any;
+};
+
+/*
+ * A file or directory to search. The nodes form a tree in which the children
+ * of a directory are sorted by name, so walking it depth first gives a fixed
+ * order. The worker that handles a node stores the lines found in a file in
+ * output, or the entries of a directory in children. If something fails, the
+ * message format and errno are kept in failed and error, so the error can be
+ * reported in its place, and status is what the program should exit with.
+ * done is set under the pool lock once the node is complete.
+ */
+struct search_node {
+    char               *path;
+    int                is_operand;
+    struct search_node **children;
+    size_t             child_cnt;
+    char               *output;
+    size_t             output_size;
+    const char         *failed;
+    int                error;
+    int                status;
+    int                done;
+};
+
+/*
+ * The tasks of one worker, a growing ring buffer. The worker itself takes
+ * from the back, so it goes deep into the tree first, while other workers
+ * steal from the front, where the larger subtrees are.
+ */
+struct task_deque {
+    struct search_node **tasks;
+    size_t             head;
+    size_t             tail;
+    size_t             capacity;
+    pthread_mutex_t    lock;
+};
+
+/*
+ * What the worker threads share. queued counts the tasks in all deques,
+ * unfinished those that are queued or running; when it reaches zero, the
+ * whole tree has been searched. printed_any is only used by the thread that
+ * writes the output.
+ */
+struct search_pool {
+    const struct matcher      *matcher;
+    const struct grep_options *options;
+    struct task_deque    *deques;
+    int                  worker_cnt;
+    size_t               queued;
+    size_t               unfinished;
+    int                  printed_any;
+    pthread_mutex_t      lock;
+    pthread_cond_t       work_available;
+    pthread_cond_t       node_done;
+};
+
+// What a worker thread gets to know at its start
+struct search_worker {
+    struct search_pool *pool;
+    int                nr;
+    pthread_t          thread;
+};
+
+/*
+ * The trigram index is a single file that is mapped into memory and used in
+ * place. It consists of
+ *     the header,
+ *     the file table: one index_file per indexed file, in walk order,
+ *     the trigram table: one index_trigram per trigram that occurs anywhere,
+ *         sorted by trigram,
+ *     the postings: for every trigram, the numbers of the files it occurs
+ *         in, ascending, as differences to the previous number, each in a
+ *         varint (7 bits per byte, low bits first, high bit set on all bytes
+ *         but the last),
+ *     the names of the files, each terminated by a NUL byte.
+ * Offsets are from the start of the file. Numbers are stored in the byte
+ * order of the machine that built the index.
+ */
+struct index_header {
+    char     magic[8];
+    uint32_t file_cnt;
+    uint32_t trigram_cnt;
+    uint64_t files_offset;
+    uint64_t trigrams_offset;
+    uint64_t postings_offset;
+    uint64_t names_offset;
+    uint64_t size;
+};
+
+// A file as it was when it was indexed
+struct index_file {
+    uint64_t name_offset;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+};
+
+// A trigram (three bytes, the first one highest) and where its postings are
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t file_cnt;
+    uint64_t postings_offset;
+};
+
+// The postings of a trigram while the index is built
+struct posting_list {
+    uint32_t      trigram;
+    uint32_t      file_cnt;
+    uint32_t      last_file;
+    size_t        length;
+    size_t        capacity;
+    unsigned char *bytes;
+};
+
+/*
+ * Everything needed while the index is built. The posting lists are kept in
+ * a hash table with open addressing, keyed by trigram. seen marks the
+ * trigrams of the current file, which are also listed in file_trigrams.
+ */
+struct index_builder {
+    struct posting_list *lists;
+    size_t              list_cnt;
+    size_t              capacity;
+    uint64_t            *seen;
+    uint32_t            *file_trigrams;
+    size_t              file_trigram_cnt;
+    struct index_file   *files;
+    size_t              file_cnt;
+    size_t              file_capacity;
+    char                *names;
+    size_t              names_length;
+    size_t              names_capacity;
+    unsigned char       *buffer;
+};
+
+/*
+ * A compiled pattern. find returns a pointer to the first occurrence of the
+ * pattern in the length bytes at haystack or NULL.
+ *     Horspool uses shift, the bad character table. Two-Way uses the
+ * critical factorisation pattern[0..crit_pos] pattern[crit_pos+1..] and the
+ * period of the pattern; is_periodic tells which variant of the search
+ * applies. The SIMD prefilter looks for positions where the bytes at offsets
+ * rare_pos[0] and rare_pos[1] of the pattern occur at the right distance.
+ * For a set of patterns, automaton is used instead and find returns a pointer
+ * to the last byte of the first occurrence of any of them. A regular
+ * expression uses regex with the DFA states in cache, and find returns a
+ * pointer into the first matching line.
+ */
+struct matcher {
+    const unsigned char *pattern;
+    size_t              length;
+    const unsigned char *(*find)(const struct matcher *,
+                                 const unsigned char *, size_t);
+    size_t              shift[256];
+    long                crit_pos;
+    long                period;
+    int                 is_periodic;
+    size_t              rare_pos[2];
+    struct automaton    *automaton;
+    const struct regex  *regex;
+    struct dfa_cache    *cache;
+};
+
+int pseudo_grep(const struct matcher *, const struct grep_options *, FILE *,
+                FILE *, const char *);
+void grep_lines(struct grep_state *, const unsigned char *,
+                const unsigned char *, const unsigned char *);
+void print_line(struct grep_state *, const unsigned char *,
+                const unsigned char *, uint64_t, char);
+const unsigned char *lines_back(const unsigned char *, const unsigned char *,
+                                uint64_t);
+newline_counter select_newline_counter(void);
+size_t count_newlines_scalar(const unsigned char *, size_t);
+#ifdef HAVE_X86_KERNELS
+size_t count_newlines_sse2(const unsigned char *, size_t);
+size_t count_newlines_avx2(const unsigned char *, size_t);
+#endif
+uint64_t parse_line_count(const char *);
+int search_tree(const struct matcher *, const struct grep_options *, char **,
+                const char *, int, int);
+void *search_worker(void *);
+struct search_node *take_task(struct search_pool *, int);
+void push_task(struct search_pool *, int, struct search_node *);
+void finish_task(struct search_pool *, struct search_node *);
+void process_node(struct search_pool *, int, const struct matcher *,
+                  struct search_node *);
+void list_directory(struct search_pool *, int, struct search_node *);
+void search_file(const struct matcher *, const struct grep_options *,
+                 struct search_node *);
+int emit_node(struct search_pool *, struct search_node *);
+struct search_node *new_node(char *, int);
+char *join_path(const char *, const char *);
+int compare_names(const void *, const void *);
+struct matcher clone_matcher(const struct matcher *);
+void build_index(const char *, char **, int);
+void index_tree(struct index_builder *, const char *, int);
+void index_file(struct index_builder *, const char *, const struct stat *);
+void add_trigram(struct index_builder *, uint32_t);
+struct posting_list *find_posting_list(struct index_builder *, uint32_t);
+size_t posting_slot(const struct index_builder *, uint32_t);
+void append_varint(struct posting_list *, uint32_t);
+int compare_lists(const void *, const void *);
+void write_index(struct index_builder *, const char *);
+void write_all(FILE *, const void *, size_t, const char *);
+int search_index(const struct matcher *, const struct grep_options *,
+                 const char *, int);
+const struct index_trigram *find_trigram(const struct index_trigram *,
+                                         uint32_t, uint32_t);
+size_t decode_postings(const unsigned char *, const unsigned char *, uint32_t,
+                       uint32_t *);
+size_t intersect(uint32_t *, size_t, const uint32_t *, size_t);
+const unsigned char *required_literal(const struct matcher *, size_t *);
+void free_dfa_cache(struct dfa_cache *);
+struct matcher new_matcher(const char *, size_t);
+struct matcher read_patterns(const char *, int);
+struct matcher new_multi_matcher(char **, size_t *, size_t);
+struct automaton *build_automaton(char **, size_t *, size_t);
+uint32_t trie_child(const struct trie_node *, uint32_t, unsigned char);
+void place_edges(struct automaton *, struct slot_allocator *,
+                 const struct trie_node *, const uint32_t *, uint32_t);
+size_t find_free_slot(struct slot_allocator *, size_t);
+void *alloc_array(size_t, size_t);
+const unsigned char *find_empty(const struct matcher *,
+                                const unsigned char *, size_t);
+const unsigned char *find_byte(const struct matcher *,
+                               const unsigned char *, size_t);
+const unsigned char *find_horspool(const struct matcher *,
+                                   const unsigned char *, size_t);
+const unsigned char *find_two_way(const struct matcher *,
+                                  const unsigned char *, size_t);
+void prepare_horspool(struct matcher *);
+void prepare_two_way(struct matcher *);
+void choose_rare_bytes(struct matcher *);
+long maximal_suffix(const unsigned char *, long, long *, int);
+const unsigned char *verify_tail(const struct matcher *,
+                                 const unsigned char *, size_t, size_t);
+#ifdef HAVE_X86_KERNELS
+const unsigned char *find_prefilter_sse2(const struct matcher *,
+                                         const unsigned char *, size_t);
+const unsigned char *find_prefilter_avx2(const struct matcher *,
+                                         const unsigned char *, size_t);
+#endif
+const unsigned char *find_automaton(const struct matcher *,
+                                    const unsigned char *, size_t);
+struct matcher new_regex_matcher(const char *, size_t);
+struct fragment parse_alternation(struct regex_parser *);
+struct fragment parse_concatenation(struct regex_parser *);
+struct fragment parse_repetition(struct regex_parser *);
+struct fragment parse_atom(struct regex_parser *);
+void parse_set(struct regex_parser *, struct nfa_state *);
+void add_named_class(struct nfa_state *, const char *, size_t);
+void parse_escape(unsigned char, struct nfa_state *);
+uint32_t add_nfa_state(struct regex *, int, uint32_t, uint32_t);
+void fill_byte_set(struct nfa_state *, int, int);
+void remove_byte(struct nfa_state *, int);
+int has_byte(const struct nfa_state *, int);
+uint32_t hole(uint32_t, int);
+uint32_t *hole_field(struct regex *, uint32_t);
+void patch(struct regex *, uint32_t, uint32_t);
+uint32_t append_holes(struct regex *, uint32_t, uint32_t);
+int matches_empty_line(const struct regex *);
+size_t extract_prefix(const struct regex *, unsigned char **, int *);
+int byte_count(const struct nfa_state *);
+struct nfa_workspace new_workspace(const struct regex *);
+void next_generation(struct nfa_workspace *);
+uint32_t closure(const struct regex *, struct nfa_workspace *, uint32_t, int,
+                 uint32_t *, uint32_t);
+struct dfa_cache *new_dfa_cache(const struct regex *);
+const unsigned char *find_regex(const struct matcher *,
+                                const unsigned char *, size_t);
+const unsigned char *scan_dfa(struct dfa_cache *, const unsigned char *,
+                              const unsigned char *);
+struct dfa_state *line_start_state(struct dfa_cache *);
+int eol_matches(struct dfa_cache *, struct dfa_state *);
+struct dfa_state *compute_next(struct dfa_cache *, struct dfa_state *,
+                               unsigned char);
+uint32_t step_set(struct dfa_cache *, const uint32_t *, uint32_t, int,
+                  unsigned char);
+int compare_states(const void *, const void *);
+uint32_t hash_set(const uint32_t *, uint32_t);
+struct dfa_state *find_state(const struct dfa_cache *, const uint32_t *,
+                             uint32_t, uint32_t);
+struct dfa_state *intern_state(struct dfa_cache *, const uint32_t *,
+                               uint32_t);
+void flush_cache(struct dfa_cache *);
+
+/*
+ * Prints the lines of the given files or stdin that contain a pattern.
+ * Directories are searched recursively by a pool of threads (one per core
+ * unless -j jobs is given); then, and with several files, every line is
+ * preceded by the name of its file. The output is in argument order, and
+ * within directories in the order of the names. Options:
+ *     -f file  search for all patterns listed in file, one per line, at once
+ *     -E       take the patterns as extended regular expressions
+ *     -j jobs  search with this many threads
+ *     -M index build a trigram index of the files and directories given
+ *              instead of searching
+ *     -I index search the files in the index, reading only those that can
+ *              contain a match or that have changed since it was built
+ *     -n       print the number of each line
+ *     -c       print only the number of matching lines
+ *     -A num   print num lines of context after each match
+ *     -B num   print num lines of context before each match
+ */
+int main(int argc, char *argv[])
 {
-    // Check command line arguments
-    if (argc == 1) {
-        errx(ARG_ERROR, "There must be at least two command line arguments");
+    // Parse options
+    const char *pattern_file = NULL;
+    const char *build_path   = NULL;
+    const char *index_name   = NULL;
+    int extended = 0;
+    struct grep_options options = {
+        0, 0, 0, 0, 0, select_newline_counter()
+    };
+    long job_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    if (job_cnt < 1 || job_cnt > MAX_JOBS) {
+        job_cnt = job_cnt < 1 ? 1 : MAX_JOBS;
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "f:Ej:M:I:ncA:B:")) != -1) {
+        switch (opt) {
+        case 'n':
+            options.line_numbers = 1;
+            break;
+        case 'c':
+            options.count_only = 1;
+            break;
+        case 'A':
+            options.after = parse_line_count(optarg);
+            options.separate_groups = 1;
+            break;
+        case 'B':
+            options.before = parse_line_count(optarg);
+            options.separate_groups = 1;
+            break;
+        case 'M':
+            build_path = optarg;
+            break;
+        case 'I':
+            index_name = optarg;
+            break;
+        case 'f':
+            pattern_file = optarg;
+            break;
+        case 'E':
+            extended = 1;
+            break;
+        case 'j':
+            job_cnt = atoi(optarg);
+            if (job_cnt < 1 || job_cnt > MAX_JOBS) {
+                errx(ARG_ERROR, "Invalid number of jobs: %s", optarg);
+            }
+            break;
+        default:
+            errx(ARG_ERROR, "Usage: pseudo-grep [-Enc] [-A num] [-B num] "
+                            "[-j jobs] [-I index] [-f file | pattern] "
+                            "[file...]\n"
+                            "       pseudo-grep -M index file...");
+        }
     }
 
-    const char *pattern  = argv[1];
-    int pat_length       = strlen(pattern);
-        // Not quite from stdio.h, but not part of the task
+    // Counting leaves no room for context
+    if (options.count_only) {
+        options.before = options.after = 0;
+        options.separate_groups = 0;
+    }
 
-    // If we have just the pattern as argument
-    if (argc == 2) {
-        // Search stdin
-        pseudo_grep(pattern, pat_length, stdin);
+    // Building an index needs no pattern
+    if (build_path != NULL) {
+        build_index(build_path, argv + optind, argc - optind);
+        return 0;
     }
 
-    // Otherwise open the given file (further arguments are ignored)
-    FILE *stream = fopen(argv[2], "r");
-    if (stream == NULL) {
-        err(ARG_ERROR, "Cannot open %s for reading", argv[2]);
+    // Compile the pattern or patterns
+    struct matcher matcher;
+    if (pattern_file != NULL) {
+        matcher = read_patterns(pattern_file, extended);
+    }
+    else {
+        if (optind == argc) {
+            errx(ARG_ERROR, "There must be at least two command line "
+                            "arguments");
+        }
+        const char *pattern = argv[optind++];
+        matcher = extended ? new_regex_matcher(pattern, strlen(pattern))
+                           : new_matcher(pattern, strlen(pattern));
     }
 
-    // Search
-    pseudo_grep(pattern, pat_length, stream);
+    // Search the files in the index
+    if (index_name != NULL) {
+        if (optind != argc) {
+            errx(ARG_ERROR, "No files can be given with -I");
+        }
+        return search_index(&matcher, &options, index_name, job_cnt);
+    }
 
-    // Close the file
-    if (fclose(stream) == EOF) {
-        err(INPUT_ERROR, "Error closing file");
+    // If we have just the pattern as argument, search stdin
+    if (optind == argc) {
+        errno = pseudo_grep(&matcher, &options, stdin, stdout, NULL);
+        if (errno != 0) {
+            err(INPUT_ERROR, "Error in reading");
+        }
+        return 0;
     }
 
-    return 0;
+    // A single file is searched right away, without names or threads
+    struct stat file_stat;
+    if (argc - optind == 1
+            && (stat(argv[optind], &file_stat) == -1
+                || !S_ISDIR(file_stat.st_mode))) {
+        FILE *stream = fopen(argv[optind], "r");
+        if (stream == NULL) {
+            err(ARG_ERROR, "Cannot open %s for reading", argv[optind]);
+        }
+
+        errno = pseudo_grep(&matcher, &options, stream, stdout, NULL);
+        if (errno != 0) {
+            err(INPUT_ERROR, "Error in reading %s", argv[optind]);
+        }
+
+        if (fclose(stream) == EOF) {
+            err(INPUT_ERROR, "Error closing file");
+        }
+        return 0;
+    }
+
+    // Otherwise search everything given in parallel
+    return search_tree(&matcher, &options, argv + optind, NULL,
+                       argc - optind, job_cnt);
+}
+
+// Convert the argument of -A or -B to a number of lines
+uint64_t parse_line_count(const char *str)
+{
+    char *end;
+    errno = 0;
+    unsigned long long count = strtoull(str, &end, 10);
+    if (end == str || *end != '\0' || *str == '-' || errno != 0
+            || count > UINT32_MAX) {
+        errx(ARG_ERROR, "Invalid number of context lines: %s", str);
+    }
+
+    return count;
 }
 
 /*
- * Prints every line of *stream containing pattern to stdout.
+ * Prints every line of *stream containing the pattern to *out, as options
+ * say, after name unless it is NULL. Returns 0, or errno if reading failed.
  */
-void pseudo_grep(const char pattern[], int length, FILE *stream)
+int pseudo_grep(const struct matcher *matcher,
+                const struct grep_options *options, FILE *stream, FILE *out,
+                const char *name)
 {
     /*
-     * The stream is read character by character (byte by byte to be precise)
-     * and compared to the first character of pattern. If the two characters
-     * match, the next character read is compared to the pattern's second
-     * character and so on.
-     *     If there are length successive matches, the input
-     * is wound back to the last newline and printed until the next newline.
-     *     If there are less than length successive matches before a mismatch,
-     * we start looking for pattern's first character again after the position
-     * of the first match.
+     * The stream is read into a large buffer. Only the part of the buffer up
+     * to the last newline is searched, since the line after it may continue
+     * in the next read. That unfinished line is moved to the front of the
+     * buffer and more is read behind it; if a single line doesn't fit, the
+     * buffer grows. Thus we never have to seek and pipes work as well as
+     * files.
+     *     For before context, the last lines of the searched part stay in
+     * the buffer as well, in front of the unfinished line. Context lines are
+     * printed from there, so no line is ever copied aside.
      *
      * The behaviour for patterns containing \n is undefined.
      */
-    long from_linestart = 0;
-    int matched_chars   = 0;
-
-    // Read the stream character by character
-    int cur_char;
-    while ((cur_char = fgetc(stream)) != EOF) {
-        // Increment number of characters read since last \n
-        ++from_linestart;
-
-        // Reset that number if we're at the end of a line
-        if (cur_char == '\n') {
-            from_linestart = 0;
-        }
-
-        // If the current character matches the next character from pattern
-        if (cur_char == pattern[matched_chars]) {
-            // Increment the number of characters matched so far
-            ++matched_chars;
-
-            // If we have the whole pattern matched
-            if (matched_chars == length) {
-                // Go back to the beginning of the line
-                if (fseek(stream, -from_linestart, SEEK_CUR) == -1) {
-                    printf("%d", (int) from_linestart);
-                    err(INPUT_ERROR, "Cannot go back to last newline");
-                }
+    size_t capacity = BUFSIZE;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        err(INPUT_ERROR, "Cannot allocate buffer");
+    }
+    size_t filled     = 0;
+    size_t scan_start = 0;
+    int at_eof        = 0;
 
-                // Read characters
-                int line_char;
-                while ((line_char = fgetc(stream)) != EOF) {
-                    // Print the to standard output
-                    if (fputc(line_char, stdout) == EOF) {
-                        err(OUTPUT_ERROR, "Error writing to stdout");
-                    }
-
-                    // Abort printing on the end of the line
-                    if (line_char == '\n') {
-                        break;
-                    }
-                }
-                if (ferror(stream)) {
-                    err(INPUT_ERROR, "Error in reading");
-                }
+    struct grep_state state = {
+        matcher, options, out, name, 0, 0, 1, 0, 0
+    };
+
+    while (!at_eof) {
+        // Make room for a line that doesn't fit into the buffer
+        if (filled == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+            if (buffer == NULL) {
+                err(INPUT_ERROR, "Cannot grow buffer to %zu bytes", capacity);
+            }
+        }
 
-                // Reset the pattern pointer and the position in the line
-                matched_chars  = 0;
-                from_linestart = 0;
+        // Read behind what is left over from the last round
+        size_t read_cnt = fread(buffer + filled, 1, capacity - filled, stream);
+        if (read_cnt == 0) {
+            if (ferror(stream)) {
+                int read_errno = errno;
+                free(buffer);
+                return read_errno;
             }
+            at_eof = 1;
         }
-        // If we have a mismatch after some characters of pattern matched
-        else if (cur_char != pattern[matched_chars] && matched_chars > 0) {
-            // Rewind to the position after the first matching character
-            if (fseek(stream, -matched_chars, SEEK_CUR) == -1) {
-                err(INPUT_ERROR, "Cannot go back in input stream");
+
+        // Find the end of the last complete line. The leftover part has no
+        // newline, so only the new data needs to be looked at.
+        const unsigned char *search_end = buffer + filled + read_cnt;
+        if (!at_eof) {
+            const unsigned char *last_nl = memrchr(buffer + filled, '\n',
+                                                   read_cnt);
+            filled += read_cnt;
+            if (last_nl == NULL) {
+                continue;
             }
+            search_end = last_nl + 1;
+        }
+
+        // Search the complete lines
+        grep_lines(&state, buffer, buffer + scan_start, search_end);
 
-            // Reset number of characters matched and line offset
-            from_linestart -= matched_chars;
-            matched_chars   = 0;
+        // Keep the lines needed as context and the unfinished line
+        const unsigned char *keep = lines_back(buffer, search_end,
+                                               options->before);
+        size_t rest = buffer + filled - keep;
+        memmove(buffer, keep, rest);
+        filled     = rest;
+        scan_start = search_end - keep;
+    }
+    free(buffer);
+
+    // With -c, only the count is printed
+    if (options->count_only) {
+        if (name != NULL && fprintf(out, "%s:", name) < 0) {
+            err(OUTPUT_ERROR, "Error writing output");
+        }
+        if (fprintf(out, "%" PRIu64 "\n", state.match_cnt) < 0) {
+            err(OUTPUT_ERROR, "Error writing output");
         }
     }
-    if (ferror(stream)) {
-        err(INPUT_ERROR, "Error in reading");
+
+    return 0;
+}
+
+/*
+ * Prints every line between start and end that contains the pattern, with
+ * context as requested, and advances *state to end. start must be the
+ * beginning of a line and the lines between floor and start must be the
+ * ones before it in the stream, as far as they are needed as context.
+ */
+void grep_lines(struct grep_state *state, const unsigned char *floor,
+                const unsigned char *start, const unsigned char *end)
+{
+    const struct matcher *matcher      = state->matcher;
+    const struct grep_options *options = state->options;
+    int needs_numbers = options->line_numbers || options->separate_groups;
+
+    // Lines are numbered by counting the newlines between counted and the
+    // lines printed, lazily
+    const unsigned char *counted = start;
+    const unsigned char *pos     = start;
+    while (pos < end) {
+        // Lines after a match are printed until a match is found again
+        if (state->after_left > 0 && !options->count_only) {
+            const unsigned char *line_end = memchr(pos, '\n', end - pos);
+            line_end = line_end == NULL ? end : line_end + 1;
+
+            state->line_nr += options->count_newlines(counted, pos - counted);
+            counted = pos;
+
+            int is_match = matcher->find(matcher, pos, line_end - pos) != NULL;
+            print_line(state, pos, line_end, state->line_nr + 1,
+                       is_match ? ':' : '-');
+            state->after_left = is_match ? options->after
+                                         : state->after_left - 1;
+            pos = line_end;
+            continue;
+        }
+
+        // Find the next occurrence
+        const unsigned char *match = matcher->find(matcher, pos, end - pos);
+        if (match == NULL) {
+            break;
+        }
+
+        // Find the line around it
+        const unsigned char *line_start = memrchr(pos, '\n', match - pos);
+        line_start = line_start == NULL ? pos : line_start + 1;
+        const unsigned char *line_end = memchr(match, '\n', end - match);
+        line_end = line_end == NULL ? end : line_end + 1;
+        pos = line_end;
+
+        if (options->count_only) {
+            ++state->match_cnt;
+            continue;
+        }
+
+        uint64_t line_nr = 0;
+        if (needs_numbers) {
+            state->line_nr += options->count_newlines(counted,
+                                                      line_start - counted);
+            counted = line_start;
+            line_nr = state->line_nr + 1;
+        }
+
+        // Print the lines before it that haven't been printed yet
+        uint64_t first_nr = line_nr > options->before
+                            ? line_nr - options->before : 1;
+        if (first_nr < state->next_unprinted) {
+            first_nr = state->next_unprinted;
+        }
+        uint64_t context_cnt = needs_numbers ? line_nr - first_nr : 0;
+        const unsigned char *context = lines_back(floor, line_start,
+                                                  context_cnt);
+        for (uint64_t nr = line_nr - context_cnt; context < line_start;
+                ++nr) {
+            const unsigned char *context_end = memchr(context, '\n',
+                                                      line_start - context);
+            print_line(state, context, context_end + 1, nr, '-');
+            context = context_end + 1;
+        }
+
+        print_line(state, line_start, line_end, line_nr, ':');
+        state->after_left = options->after;
+    }
+
+    if (needs_numbers) {
+        state->line_nr += options->count_newlines(counted, end - counted);
+    }
+}
+
+/*
+ * Print the line from line_start to line_end with number line_nr, preceded by
+ * the file name and number as far as they are wanted, each followed by
+ * separator. Context lines have the separator '-', matching lines ':'.
+ */
+void print_line(struct grep_state *state, const unsigned char *line_start,
+                const unsigned char *line_end, uint64_t line_nr,
+                char separator)
+{
+    const struct grep_options *options = state->options;
+    FILE *out = state->out;
+
+    if (options->separate_groups && state->printed_any
+            && line_nr > state->next_unprinted) {
+        if (fputs("--\n", out) == EOF) {
+            err(OUTPUT_ERROR, "Error writing output");
+        }
     }
+    state->printed_any    = 1;
+    state->next_unprinted = line_nr + 1;
+
+    if (state->name != NULL
+            && fprintf(out, "%s%c", state->name, separator) < 0) {
+        err(OUTPUT_ERROR, "Error writing output");
+    }
+    if (options->line_numbers
+            && fprintf(out, "%" PRIu64 "%c", line_nr, separator) < 0) {
+        err(OUTPUT_ERROR, "Error writing output");
+    }
+
+    // Among the lines of several files, a missing newline at the end is
+    // added
+    if (fwrite(line_start, 1, line_end - line_start, out)
+            != (size_t) (line_end - line_start)) {
+        err(OUTPUT_ERROR, "Error writing output");
+    }
+    if (state->name != NULL && line_end[-1] != '\n'
+            && putc('\n', out) == EOF) {
+        err(OUTPUT_ERROR, "Error writing output");
+    }
+}
+
+// Return the start of the line count lines before the one starting at
+// line_start, or floor if there are fewer lines between them
+const unsigned char *lines_back(const unsigned char *floor,
+                                const unsigned char *line_start,
+                                uint64_t count)
+{
+    const unsigned char *pos = line_start;
+    for (uint64_t i = 0; i < count && pos > floor; ++i) {
+        const unsigned char *newline = memrchr(floor, '\n', pos - 1 - floor);
+        pos = newline == NULL ? floor : newline + 1;
+    }
+
+    return pos;
+}
+
+// Choose the fastest newline counter the CPU supports
+newline_counter select_newline_counter(void)
+{
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return count_newlines_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return count_newlines_sse2;
+    }
+#endif
+    return count_newlines_scalar;
+}
+
+// Return the number of newlines in the length bytes at data
+size_t count_newlines_scalar(const unsigned char *data, size_t length)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < length; ++i) {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+
+#ifdef HAVE_X86_KERNELS
+// Count newlines 16 bytes at a time with SSE2
+__attribute__((target("sse2")))
+size_t count_newlines_sse2(const unsigned char *data, size_t length)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        count += __builtin_popcount(
+                     _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline))
+                 );
+    }
+
+    return count + count_newlines_scalar(data + i, length - i);
+}
+
+// Count newlines 32 bytes at a time with AVX2
+__attribute__((target("avx2,popcnt")))
+size_t count_newlines_avx2(const unsigned char *data, size_t length)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        count += __builtin_popcount(
+                     _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline))
+                 );
+    }
+
+    return count + count_newlines_scalar(data + i, length - i);
+}
+#endif
+
+/*
+ * Searches the files and directories named in the operand_cnt operands with
+ * job_cnt threads and prints the lines found, each after the name of its
+ * file. If pruned isn't NULL, the operands i with pruned[i] set are files
+ * known not to match; they aren't read, but with count_only their count of
+ * 0 is printed like that of any other file. Returns the exit status.
+ */
+int search_tree(const struct matcher *matcher,
+                const struct grep_options *options, char **operands,
+                const char *pruned, int operand_cnt, int job_cnt)
+{
+    /*
+     * Every file or directory is a task. Handling a directory creates a task
+     * for each of its entries, which the worker puts into its own deque;
+     * idle workers steal from the others. Meanwhile, this thread walks the
+     * tree of nodes in order, waiting for each one to be done and writing
+     * out what was found, so the output never depends on timing.
+     */
+    struct search_pool pool;
+    pool.matcher     = matcher;
+    pool.options     = options;
+    pool.worker_cnt  = job_cnt;
+    pool.queued      = 0;
+    pool.unfinished  = 0;
+    pool.printed_any = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_available, NULL);
+    pthread_cond_init(&pool.node_done, NULL);
+
+    pool.deques = alloc_array(job_cnt, sizeof(struct task_deque));
+    for (int i = 0; i < job_cnt; ++i) {
+        pool.deques[i].capacity = 64;
+        pool.deques[i].tasks    = alloc_array(64, sizeof(struct search_node *));
+        pool.deques[i].head     = 0;
+        pool.deques[i].tail     = 0;
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    // Deal the operands out to the workers
+    struct search_node **roots = alloc_array(operand_cnt,
+                                             sizeof(struct search_node *));
+    for (int i = 0; i < operand_cnt; ++i) {
+        char *path = strdup(operands[i]);
+        if (path == NULL) {
+            err(INPUT_ERROR, "Cannot allocate memory for file list");
+        }
+        roots[i] = new_node(path, 1);
+
+        // No worker has started yet, so a pruned file can be done right away
+        if (pruned != NULL && pruned[i]) {
+            if (options->count_only
+                    && asprintf(&roots[i]->output, "%s:0\n", path) == -1) {
+                err(INPUT_ERROR, "Cannot allocate output buffer");
+            }
+            if (roots[i]->output != NULL) {
+                roots[i]->output_size = strlen(roots[i]->output);
+            }
+            roots[i]->done = 1;
+            continue;
+        }
+        push_task(&pool, i % job_cnt, roots[i]);
+    }
+
+    // Start the workers
+    struct search_worker *workers = alloc_array(job_cnt,
+                                                sizeof(struct search_worker));
+    for (int i = 0; i < job_cnt; ++i) {
+        workers[i].pool = &pool;
+        workers[i].nr   = i;
+        errno = pthread_create(&workers[i].thread, NULL, search_worker,
+                               &workers[i]);
+        if (errno != 0) {
+            err(INPUT_ERROR, "Cannot start worker thread");
+        }
+    }
+
+    // Print the results in order as they become available
+    int status = 0;
+    for (int i = 0; i < operand_cnt; ++i) {
+        int node_status = emit_node(&pool, roots[i]);
+        if (status == 0) {
+            status = node_status;
+        }
+    }
+
+    // Clean up. Other workers may still try to steal from a deque until
+    // they have all been joined.
+    for (int i = 0; i < job_cnt; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < job_cnt; ++i) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool.node_done);
+    pthread_cond_destroy(&pool.work_available);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(roots);
+    free(pool.deques);
+
+    return status;
+}
+
+// Handle tasks with a matcher of its own until the tree has been searched
+void *search_worker(void *arg)
+{
+    struct search_worker *worker = arg;
+    struct matcher matcher = clone_matcher(worker->pool->matcher);
+
+    struct search_node *node;
+    while ((node = take_task(worker->pool, worker->nr)) != NULL) {
+        process_node(worker->pool, worker->nr, &matcher, node);
+        finish_task(worker->pool, node);
+    }
+
+    if (matcher.cache != NULL) {
+        free_dfa_cache(matcher.cache);
+    }
+    return NULL;
+}
+
+// Take the next task of worker nr, or steal one. Returns NULL when all work
+// is done.
+struct search_node *take_task(struct search_pool *pool, int nr)
+{
+    while (1) {
+        // Own tasks from the back
+        struct task_deque *own = &pool->deques[nr];
+        struct search_node *node = NULL;
+        pthread_mutex_lock(&own->lock);
+        if (own->tail > own->head) {
+            node = own->tasks[--own->tail % own->capacity];
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        // Others' tasks from the front
+        for (int i = 1; node == NULL && i < pool->worker_cnt; ++i) {
+            struct task_deque *other
+                = &pool->deques[(nr + i) % pool->worker_cnt];
+            pthread_mutex_lock(&other->lock);
+            if (other->tail > other->head) {
+                node = other->tasks[other->head++ % other->capacity];
+            }
+            pthread_mutex_unlock(&other->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (node != NULL) {
+            --pool->queued;
+            pthread_mutex_unlock(&pool->lock);
+            return node;
+        }
+
+        // Wait until someone has work to steal or everything is done
+        while (pool->queued == 0 && pool->unfinished > 0) {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+        int all_done = pool->unfinished == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (all_done) {
+            return NULL;
+        }
+    }
+}
+
+// Put node at the back of the deque of worker nr
+void push_task(struct search_pool *pool, int nr, struct search_node *node)
+{
+    // Count the task before anyone can take it. Otherwise a thief could
+    // decrement queued below zero, or finish it and bring unfinished to zero
+    // while the other workers still have to wait for it.
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    ++pool->unfinished;
+    pthread_mutex_unlock(&pool->lock);
+
+    struct task_deque *deque = &pool->deques[nr];
+    pthread_mutex_lock(&deque->lock);
+
+    // Grow the ring, moving its contents to the same positions modulo the
+    // new capacity
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t new_capacity = 2 * deque->capacity;
+        struct search_node **tasks
+            = alloc_array(new_capacity, sizeof(struct search_node *));
+        for (size_t i = deque->head; i < deque->tail; ++i) {
+            tasks[i % new_capacity] = deque->tasks[i % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks    = tasks;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[deque->tail++ % deque->capacity] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Mark node as done and wake whoever waits for it
+void finish_task(struct search_pool *pool, struct search_node *node)
+{
+    pthread_mutex_lock(&pool->lock);
+    node->done = 1;
+    if (--pool->unfinished == 0) {
+        pthread_cond_broadcast(&pool->work_available);
+    }
+    pthread_cond_broadcast(&pool->node_done);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Search the file or list the directory at node. Operands are followed if
+ * they are symbolic links and searched whatever type of file they are. In
+ * directories, only regular files and subdirectories are searched, so that
+ * links can't lead into cycles.
+ */
+void process_node(struct search_pool *pool, int nr,
+                  const struct matcher *matcher, struct search_node *node)
+{
+    struct stat node_stat;
+    int result = node->is_operand ? stat(node->path, &node_stat)
+                                  : lstat(node->path, &node_stat);
+    if (result == -1) {
+        node->failed = "Cannot open %s for reading";
+        node->error  = errno;
+        node->status = ARG_ERROR;
+        return;
+    }
+
+    if (S_ISDIR(node_stat.st_mode)) {
+        list_directory(pool, nr, node);
+    }
+    else if (S_ISREG(node_stat.st_mode) || node->is_operand) {
+        search_file(matcher, pool->options, node);
+    }
+}
+
+// Create the children of the directory at node, sorted by name, and put
+// them into the deque of worker nr
+void list_directory(struct search_pool *pool, int nr, struct search_node *node)
+{
+    DIR *dir = opendir(node->path);
+    if (dir == NULL) {
+        node->failed = "Cannot open directory %s";
+        node->error  = errno;
+        node->status = ARG_ERROR;
+        return;
+    }
+
+    // Collect the names
+    char **names    = NULL;
+    size_t capacity = 0;
+    struct dirent *entry;
+    errno = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+                || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (node->child_cnt == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            names = realloc(names, capacity * sizeof(char *));
+            if (names == NULL) {
+                err(INPUT_ERROR, "Cannot allocate memory for file list");
+            }
+        }
+        names[node->child_cnt++] = join_path(node->path, entry->d_name);
+        errno = 0;
+    }
+    if (errno != 0) {
+        node->failed = "Error in reading directory %s";
+        node->error  = errno;
+        node->status = INPUT_ERROR;
+    }
+    closedir(dir);
+
+    qsort(names, node->child_cnt, sizeof(char *), compare_names);
+    node->children = alloc_array(node->child_cnt,
+                                 sizeof(struct search_node *));
+    for (size_t i = 0; i < node->child_cnt; ++i) {
+        node->children[i] = new_node(names[i], 0);
+    }
+    free(names);
+
+    // Pushed backwards, the worker continues with the first entry
+    for (size_t i = node->child_cnt; i > 0; --i) {
+        push_task(pool, nr, node->children[i - 1]);
+    }
+}
+
+// Search the file at node, collecting the output in the node
+void search_file(const struct matcher *matcher,
+                 const struct grep_options *options, struct search_node *node)
+{
+    FILE *stream = fopen(node->path, "r");
+    if (stream == NULL) {
+        node->failed = "Cannot open %s for reading";
+        node->error  = errno;
+        node->status = ARG_ERROR;
+        return;
+    }
+
+    FILE *out = open_memstream(&node->output, &node->output_size);
+    if (out == NULL) {
+        err(INPUT_ERROR, "Cannot allocate output buffer");
+    }
+
+    int read_errno = pseudo_grep(matcher, options, stream, out, node->path);
+    if (read_errno != 0) {
+        node->failed = "Error in reading %s";
+        node->error  = read_errno;
+        node->status = INPUT_ERROR;
+    }
+
+    if (fclose(out) == EOF) {
+        err(OUTPUT_ERROR, "Error writing output");
+    }
+    fclose(stream);
+}
+
+/*
+ * Wait until node is done, then print its output or error, followed by
+ * those of its children, and free it. Returns the first non-zero status
+ * found, or 0.
+ */
+int emit_node(struct search_pool *pool, struct search_node *node)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!node->done) {
+        pthread_cond_wait(&pool->node_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Groups of context lines from different files are separated as well
+    if (node->output_size > 0) {
+        if (pool->options->separate_groups && pool->printed_any
+                && fputs("--\n", stdout) == EOF) {
+            err(OUTPUT_ERROR, "Error writing to stdout");
+        }
+        if (fwrite(node->output, 1, node->output_size, stdout)
+                != node->output_size) {
+            err(OUTPUT_ERROR, "Error writing to stdout");
+        }
+        pool->printed_any = 1;
+    }
+    free(node->output);
+
+    int status = node->status;
+    if (node->failed != NULL) {
+        fflush(stdout);
+        errno = node->error;
+        warn(node->failed, node->path);
+    }
+
+    for (size_t i = 0; i < node->child_cnt; ++i) {
+        int child_status = emit_node(pool, node->children[i]);
+        if (status == 0) {
+            status = child_status;
+        }
+    }
+
+    free(node->children);
+    free(node->path);
+    free(node);
+    return status;
+}
+
+// Create a node for the file at path, which it takes over
+struct search_node *new_node(char *path, int is_operand)
+{
+    struct search_node *node = alloc_array(1, sizeof(struct search_node));
+    node->path        = path;
+    node->is_operand  = is_operand;
+    node->children    = NULL;
+    node->child_cnt   = 0;
+    node->output      = NULL;
+    node->output_size = 0;
+    node->failed      = NULL;
+    node->error       = 0;
+    node->status      = 0;
+    node->done        = 0;
+
+    return node;
+}
+
+// Return a new string with name appended to the directory path dir
+char *join_path(const char *dir, const char *name)
+{
+    size_t dir_length = strlen(dir);
+    int needs_slash   = dir_length > 0 && dir[dir_length - 1] != '/';
+
+    char *path = alloc_array(dir_length + needs_slash + strlen(name) + 1, 1);
+    strcpy(path, dir);
+    if (needs_slash) {
+        path[dir_length] = '/';
+    }
+    strcpy(path + dir_length + needs_slash, name);
+
+    return path;
+}
+
+// Order file names for qsort
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Prepare searching for the length bytes at pattern
+struct matcher new_matcher(const char *pattern, size_t length)
+{
+    struct matcher matcher;
+    matcher.pattern   = (const unsigned char *) pattern;
+    matcher.length    = length;
+    matcher.automaton = NULL;
+    matcher.regex     = NULL;
+    matcher.cache     = NULL;
+
+    // Trivial patterns
+    if (length == 0) {
+        matcher.find = find_empty;
+        return matcher;
+    }
+    if (length == 1) {
+        matcher.find = find_byte;
+        return matcher;
+    }
+
+    // Two-Way is needed in any case as fallback for the prefilter
+    prepare_two_way(&matcher);
+    choose_rare_bytes(&matcher);
+
+    // Use the widest vectors the CPU supports to find candidates
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        matcher.find = find_prefilter_avx2;
+        return matcher;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        matcher.find = find_prefilter_sse2;
+        return matcher;
+    }
+#endif
+
+    // Without vectors, Horspool is fastest for short patterns
+    if (length <= SHORT_NEEDLE_MAX) {
+        prepare_horspool(&matcher);
+        matcher.find = find_horspool;
+    }
+    else {
+        matcher.find = find_two_way;
+    }
+
+    return matcher;
+}
+
+// Fill in the bad character table: how far the window may move if its last
+// byte is c
+void prepare_horspool(struct matcher *matcher)
+{
+    for (int c = 0; c < 256; ++c) {
+        matcher->shift[c] = matcher->length;
+    }
+    for (size_t i = 0; i < matcher->length - 1; ++i) {
+        matcher->shift[matcher->pattern[i]] = matcher->length - 1 - i;
+    }
+}
+
+// Find the critical factorisation and the period of the pattern
+void prepare_two_way(struct matcher *matcher)
+{
+    // The critical factorisation is the later of the two maximal suffixes
+    // for opposite orderings of the alphabet
+    long period, rev_period;
+    long suffix     = maximal_suffix(matcher->pattern, matcher->length,
+                                     &period, 0);
+    long rev_suffix = maximal_suffix(matcher->pattern, matcher->length,
+                                     &rev_period, 1);
+    if (suffix > rev_suffix) {
+        matcher->crit_pos = suffix;
+        matcher->period   = period;
+    }
+    else {
+        matcher->crit_pos = rev_suffix;
+        matcher->period   = rev_period;
+    }
+
+    // The pattern is periodic if the left part repeats with that period
+    matcher->is_periodic = memcmp(matcher->pattern,
+                                  matcher->pattern + matcher->period,
+                                  matcher->crit_pos + 1) == 0;
+    if (!matcher->is_periodic) {
+        long left  = matcher->crit_pos + 1;
+        long right = matcher->length - matcher->crit_pos - 1;
+        matcher->period = (left > right ? left : right) + 1;
+    }
+}
+
+// Pick the two positions in the pattern whose bytes are rarest, preferring
+// two different byte values
+void choose_rare_bytes(struct matcher *matcher)
+{
+    const unsigned char *pattern = matcher->pattern;
+
+    size_t first = 0;
+    for (size_t i = 1; i < matcher->length; ++i) {
+        if (byte_rank[pattern[i]] < byte_rank[pattern[first]]) {
+            first = i;
+        }
+    }
+
+    size_t second = first == 0 ? 1 : 0;
+    for (size_t i = 0; i < matcher->length; ++i) {
+        if (i == first) {
+            continue;
+        }
+
+        int cur_differs  = pattern[i] != pattern[first];
+        int best_differs = pattern[second] != pattern[first];
+        if (cur_differs > best_differs
+                || (cur_differs == best_differs
+                    && byte_rank[pattern[i]] < byte_rank[pattern[second]])) {
+            second = i;
+        }
+    }
+
+    matcher->rare_pos[0] = first;
+    matcher->rare_pos[1] = second;
+}
+
+// The empty pattern is found everywhere
+const unsigned char *find_empty(const struct matcher *matcher,
+                                const unsigned char *haystack, size_t length)
+{
+    return haystack;
+}
+
+// A single byte is best left to the C library
+const unsigned char *find_byte(const struct matcher *matcher,
+                               const unsigned char *haystack, size_t length)
+{
+    return memchr(haystack, matcher->pattern[0], length);
+}
+
+// Boyer-Moore-Horspool search
+const unsigned char *find_horspool(const struct matcher *matcher,
+                                   const unsigned char *haystack,
+                                   size_t length)
+{
+    size_t m = matcher->length;
+    const unsigned char *pattern = matcher->pattern;
+    unsigned char last = pattern[m - 1];
+
+    size_t pos = 0;
+    while (pos + m <= length) {
+        unsigned char c = haystack[pos + m - 1];
+        if (c == last && memcmp(pattern, haystack + pos, m - 1) == 0) {
+            return haystack + pos;
+        }
+        pos += matcher->shift[c];
+    }
+
+    return NULL;
+}
+
+/*
+ * Crochemore-Perrin Two-Way search. The right part of the pattern is compared
+ * from left to right, then the left part from right to left. In the periodic
+ * case, memory remembers how much of the pattern is known to match already
+ * after a shift by the period, which keeps the search linear.
+ */
+const unsigned char *find_two_way(const struct matcher *matcher,
+                                  const unsigned char *haystack,
+                                  size_t length)
+{
+    const unsigned char *x = matcher->pattern;
+    long m      = matcher->length;
+    long n      = length;
+    long ell    = matcher->crit_pos;
+    long per    = matcher->period;
+    long memory = -1;
+
+    long j = 0;
+    while (j <= n - m) {
+        // Compare the right part
+        long i = ell + 1;
+        if (matcher->is_periodic && memory > ell) {
+            i = memory + 1;
+        }
+        while (i < m && x[i] == haystack[i + j]) {
+            ++i;
+        }
+        if (i < m) {
+            j     += i - ell;
+            memory = -1;
+            continue;
+        }
+
+        // Compare the left part
+        long left_end = matcher->is_periodic ? memory : -1;
+        i = ell;
+        while (i > left_end && x[i] == haystack[i + j]) {
+            --i;
+        }
+        if (i <= left_end) {
+            return haystack + j;
+        }
+
+        j += per;
+        if (matcher->is_periodic) {
+            memory = m - per - 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the start of the maximal suffix of the m bytes at x minus one, with
+ * bytes ordered normally or, if reverse is set, reversely. Its period is
+ * stored in *period.
+ */
+long maximal_suffix(const unsigned char *x, long m, long *period, int reverse)
+{
+    long ms = -1;
+    long j  = 0;
+    long k  = 1;
+    long p  = 1;
+
+    while (j + k < m) {
+        unsigned char a = x[j + k];
+        unsigned char b = x[ms + k];
+        if (reverse ? a > b : a < b) {
+            j += k;
+            k  = 1;
+            p  = j - ms;
+        }
+        else if (a == b) {
+            if (k != p) {
+                ++k;
+            }
+            else {
+                j += p;
+                k  = 1;
+            }
+        }
+        else {
+            ms = j;
+            j  = ms + 1;
+            k  = p = 1;
+        }
+    }
+
+    *period = p;
+    return ms;
+}
+
+/*
+ * Check every start position from pos on that leaves room for the pattern,
+ * the slow way. Used for the end of the haystack, where a full vector would
+ * reach beyond it.
+ */
+const unsigned char *verify_tail(const struct matcher *matcher,
+                                 const unsigned char *haystack, size_t length,
+                                 size_t pos)
+{
+    const unsigned char *pattern = matcher->pattern;
+    size_t m = matcher->length;
+    size_t p0 = matcher->rare_pos[0];
+    size_t p1 = matcher->rare_pos[1];
+
+    for (; pos + m <= length; ++pos) {
+        if (haystack[pos + p0] == pattern[p0]
+                && haystack[pos + p1] == pattern[p1]
+                && memcmp(haystack + pos, pattern, m) == 0) {
+            return haystack + pos;
+        }
+    }
+
+    return NULL;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * The prefilters compare a whole vector of start positions at once: the
+ * vector loaded at offset rare_pos[0] is compared with the first rare byte,
+ * the one at offset rare_pos[1] with the second. Only where both match is the
+ * whole pattern compared.
+ *     Input made to produce many false candidates would make this quadratic.
+ * Therefore, once the comparisons of false candidates exceed the bytes
+ * scanned by CANDIDATE_SLACK, the rest is left to Two-Way.
+ */
+
+// Prefilter with 16-byte SSE2 vectors
+__attribute__((target("sse2")))
+const unsigned char *find_prefilter_sse2(const struct matcher *matcher,
+                                         const unsigned char *haystack,
+                                         size_t length)
+{
+    size_t m = matcher->length;
+    if (length < m) {
+        return NULL;
+    }
+
+    const unsigned char *first  = haystack + matcher->rare_pos[0];
+    const unsigned char *second = haystack + matcher->rare_pos[1];
+    const __m128i first_byte  = _mm_set1_epi8(
+                                    matcher->pattern[matcher->rare_pos[0]]);
+    const __m128i second_byte = _mm_set1_epi8(
+                                    matcher->pattern[matcher->rare_pos[1]]);
+
+    size_t candidate_cost = 0;
+    size_t pos = 0;
+    for (; pos + 16 <= length - m + 1; pos += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (first + pos));
+        __m128i b = _mm_loadu_si128((const __m128i *) (second + pos));
+        unsigned mask = _mm_movemask_epi8(
+                            _mm_and_si128(_mm_cmpeq_epi8(a, first_byte),
+                                          _mm_cmpeq_epi8(b, second_byte))
+                        );
+
+        while (mask != 0) {
+            size_t start = pos + __builtin_ctz(mask);
+            if (memcmp(haystack + start, matcher->pattern, m) == 0) {
+                return haystack + start;
+            }
+
+            candidate_cost += m;
+            if (candidate_cost > pos + CANDIDATE_SLACK) {
+                return find_two_way(matcher, haystack + start + 1,
+                                    length - start - 1);
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return verify_tail(matcher, haystack, length, pos);
+}
+
+// Prefilter with 32-byte AVX2 vectors
+__attribute__((target("avx2,bmi")))
+const unsigned char *find_prefilter_avx2(const struct matcher *matcher,
+                                         const unsigned char *haystack,
+                                         size_t length)
+{
+    size_t m = matcher->length;
+    if (length < m) {
+        return NULL;
+    }
+
+    const unsigned char *first  = haystack + matcher->rare_pos[0];
+    const unsigned char *second = haystack + matcher->rare_pos[1];
+    const __m256i first_byte  = _mm256_set1_epi8(
+                                    matcher->pattern[matcher->rare_pos[0]]);
+    const __m256i second_byte = _mm256_set1_epi8(
+                                    matcher->pattern[matcher->rare_pos[1]]);
+
+    size_t candidate_cost = 0;
+    size_t pos = 0;
+    for (; pos + 32 <= length - m + 1; pos += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (first + pos));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (second + pos));
+        unsigned mask = _mm256_movemask_epi8(
+                            _mm256_and_si256(
+                                _mm256_cmpeq_epi8(a, first_byte),
+                                _mm256_cmpeq_epi8(b, second_byte)
+                            )
+                        );
+
+        while (mask != 0) {
+            size_t start = pos + __builtin_ctz(mask);
+            if (memcmp(haystack + start, matcher->pattern, m) == 0) {
+                return haystack + start;
+            }
+
+            candidate_cost += m;
+            if (candidate_cost > pos + CANDIDATE_SLACK) {
+                return find_two_way(matcher, haystack + start + 1,
+                                    length - start - 1);
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return verify_tail(matcher, haystack, length, pos);
+}
+#endif
+
+/*
+ * Reads the patterns listed one per line in the file at path and compiles
+ * them, as regular expressions if extended is set. An empty line matches
+ * every line, an empty file none.
+ */
+struct matcher read_patterns(const char *path, int extended)
+{
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        err(ARG_ERROR, "Cannot open %s for reading", path);
+    }
+
+    // Read the lines, without their newlines
+    char **patterns = NULL;
+    size_t *lengths = NULL;
+    size_t count    = 0;
+    size_t capacity = 0;
+    char *line      = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, stream)) != -1) {
+        if (line_length > 0 && line[line_length - 1] == '\n') {
+            line[--line_length] = '\0';
+        }
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            patterns = realloc(patterns, capacity * sizeof(char *));
+            lengths  = realloc(lengths, capacity * sizeof(size_t));
+            if (patterns == NULL || lengths == NULL) {
+                err(INPUT_ERROR, "Cannot allocate pattern list");
+            }
+        }
+        patterns[count] = line;
+        lengths[count]  = line_length;
+        ++count;
+
+        line          = NULL;
+        line_capacity = 0;
+    }
+    if (ferror(stream)) {
+        err(INPUT_ERROR, "Error in reading %s", path);
+    }
+    free(line);
+    if (fclose(stream) == EOF) {
+        err(INPUT_ERROR, "Error closing file");
+    }
+
+    // Regular expressions are combined into one alternation
+    if (extended && count > 0) {
+        size_t length = 0;
+        for (size_t i = 0; i < count; ++i) {
+            length += lengths[i] + 3;
+        }
+        char *combined = alloc_array(length, 1);
+        char *end = combined;
+        for (size_t i = 0; i < count; ++i) {
+            if (i > 0) {
+                *end++ = '|';
+            }
+            *end++ = '(';
+            memcpy(end, patterns[i], lengths[i]);
+            end += lengths[i];
+            *end++ = ')';
+            free(patterns[i]);
+        }
+        free(patterns);
+        free(lengths);
+        return new_regex_matcher(combined, end - combined);
+    }
+
+    // A single pattern is found faster on its own. Its memory stays with the
+    // matcher.
+    if (count == 1) {
+        struct matcher matcher = new_matcher(patterns[0], lengths[0]);
+        free(patterns);
+        free(lengths);
+        return matcher;
+    }
+
+    struct matcher matcher = new_multi_matcher(patterns, lengths, count);
+    for (size_t i = 0; i < count; ++i) {
+        free(patterns[i]);
+    }
+    free(patterns);
+    free(lengths);
+    return matcher;
+}
+
+// Compile the count patterns in patterns with lengths lengths into a matcher
+// that finds any of them
+struct matcher new_multi_matcher(char **patterns, size_t *lengths,
+                                 size_t count)
+{
+    struct matcher matcher;
+    matcher.pattern   = NULL;
+    matcher.length    = 0;
+    matcher.find      = find_automaton;
+    matcher.automaton = build_automaton(patterns, lengths, count);
+    matcher.regex     = NULL;
+    matcher.cache     = NULL;
+
+    return matcher;
+}
+
+/*
+ * Builds the Aho-Corasick automaton for the count patterns. First the trie of
+ * the patterns is built with child and sibling links, then the failure links
+ * are computed breadth first. Finally, the states are renumbered in that
+ * order and stored in the dense table or the double array.
+ */
+struct automaton *build_automaton(char **patterns, size_t *lengths,
+                                  size_t count)
+{
+    // Build the trie
+    size_t max_nodes = 1;
+    for (size_t i = 0; i < count; ++i) {
+        max_nodes += lengths[i];
+    }
+    if (max_nodes >= NO_STATE) {
+        errx(ARG_ERROR, "Too many patterns");
+    }
+    struct trie_node *trie = alloc_array(max_nodes, sizeof(struct trie_node));
+    trie[0] = (struct trie_node) { NO_STATE, NO_STATE, 0, 0, 0 };
+    uint32_t node_cnt = 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char *pattern = (const unsigned char *) patterns[i];
+        uint32_t node = 0;
+        for (size_t j = 0; j < lengths[i]; ++j) {
+            uint32_t child = trie_child(trie, node, pattern[j]);
+            if (child == NO_STATE) {
+                child = node_cnt++;
+                trie[child] = (struct trie_node) {
+                    NO_STATE, trie[node].first_child, 0, pattern[j], 0
+                };
+                trie[node].first_child = child;
+            }
+            node = child;
+        }
+        trie[node].accepting = 1;
+    }
+
+    // Compute the failure links breadth first. The failure link of a node is
+    // the node for the longest proper suffix of its string in the trie, which
+    // is shallower and therefore already done.
+    uint32_t *order = alloc_array(node_cnt, sizeof(uint32_t));
+    uint32_t *rank  = alloc_array(node_cnt, sizeof(uint32_t));
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        uint32_t node = order[head++];
+        for (uint32_t child = trie[node].first_child; child != NO_STATE;
+                child = trie[child].next_sibling) {
+            uint32_t fail = NO_STATE;
+            if (node != 0) {
+                uint32_t f = trie[node].fail;
+                while ((fail = trie_child(trie, f, trie[child].byte))
+                        == NO_STATE && f != 0) {
+                    f = trie[f].fail;
+                }
+            }
+            trie[child].fail       = fail == NO_STATE ? 0 : fail;
+            trie[child].accepting |= trie[trie[child].fail].accepting;
+            order[tail++] = child;
+        }
+    }
+    for (uint32_t i = 0; i < node_cnt; ++i) {
+        rank[order[i]] = i;
+    }
+
+    struct automaton *automaton = alloc_array(1, sizeof(struct automaton));
+    automaton->state_cnt = node_cnt;
+    automaton->dense_cnt = node_cnt < DENSE_STATES ? node_cnt : DENSE_STATES;
+    automaton->dense     = alloc_array((size_t) automaton->dense_cnt * 256,
+                                       sizeof(uint32_t));
+    automaton->base      = alloc_array(node_cnt, sizeof(uint32_t));
+    automaton->fail      = alloc_array(node_cnt, sizeof(uint32_t));
+    automaton->accepting = alloc_array(node_cnt, 1);
+    for (uint32_t i = 0; i < node_cnt; ++i) {
+        automaton->fail[i]      = rank[trie[order[i]].fail];
+        automaton->accepting[i] = trie[order[i]].accepting;
+    }
+
+    // The transitions of a dense state are those of its failure state,
+    // except for its own edges. The root stays at the root by default.
+    for (uint32_t state = 0; state < automaton->dense_cnt; ++state) {
+        uint32_t *row = automaton->dense + (size_t) state * 256;
+        if (state == 0) {
+            memset(row, 0, 256 * sizeof(uint32_t));
+        }
+        else {
+            memcpy(row, automaton->dense + (size_t) automaton->fail[state]
+                                           * 256,
+                   256 * sizeof(uint32_t));
+        }
+
+        uint32_t node = order[state];
+        for (uint32_t child = trie[node].first_child; child != NO_STATE;
+                child = trie[child].next_sibling) {
+            row[trie[child].byte] = rank[child];
+        }
+    }
+
+    // Put the edges of all other states into the double array
+    struct slot_allocator slots = { 0, NULL };
+    automaton->check  = NULL;
+    automaton->target = NULL;
+    for (uint32_t state = automaton->dense_cnt; state < node_cnt; ++state) {
+        place_edges(automaton, &slots, trie, rank, order[state]);
+    }
+    free(slots.next_free);
+    if (slots.slot_cnt == 0) {
+        // No state uses the double array, but keep the lookups well-defined
+        automaton->check  = alloc_array(1, sizeof(uint32_t));
+        automaton->target = alloc_array(1, sizeof(uint32_t));
+    }
+
+    free(trie);
+    free(order);
+    free(rank);
+    return automaton;
+}
+
+// Return the child of node in the trie for byte c or NO_STATE
+uint32_t trie_child(const struct trie_node *trie, uint32_t node,
+                    unsigned char c)
+{
+    for (uint32_t child = trie[node].first_child; child != NO_STATE;
+            child = trie[child].next_sibling) {
+        if (trie[child].byte == c) {
+            return child;
+        }
+    }
+
+    return NO_STATE;
+}
+
+/*
+ * Finds a low base for the state of trie node node, such that all of its
+ * edges land on free slots of the double array, and stores the edges there.
+ * The double array grows as needed; it always has 256 slots more than the
+ * highest base, so that lookups of any byte stay in bounds.
+ */
+void place_edges(struct automaton *automaton, struct slot_allocator *slots,
+                 const struct trie_node *trie, const uint32_t *rank,
+                 uint32_t node)
+{
+    uint32_t state = rank[node];
+
+    // The edge with the lowest byte decides which free slots are tried
+    unsigned char min_byte = UCHAR_MAX;
+    for (uint32_t child = trie[node].first_child; child != NO_STATE;
+            child = trie[child].next_sibling) {
+        if (trie[child].byte < min_byte) {
+            min_byte = trie[child].byte;
+        }
+    }
+
+    // Find a base where all edges fit
+    size_t base;
+    size_t free_slot = find_free_slot(slots, min_byte);
+    for (;;) {
+        base = free_slot - min_byte;
+        int fits = 1;
+        for (uint32_t child = trie[node].first_child; child != NO_STATE;
+                child = trie[child].next_sibling) {
+            size_t slot = base + trie[child].byte;
+            if (slot < slots->slot_cnt
+                    && automaton->check[slot] != NO_STATE) {
+                fits = 0;
+                break;
+            }
+        }
+        if (fits) {
+            break;
+        }
+        free_slot = find_free_slot(slots, free_slot + 1);
+    }
+
+    // Grow the double array
+    if (base + 256 > slots->slot_cnt) {
+        size_t new_cnt = slots->slot_cnt == 0 ? 1024 : slots->slot_cnt;
+        while (new_cnt < base + 256) {
+            new_cnt *= 2;
+        }
+        automaton->check  = realloc(automaton->check,
+                                    new_cnt * sizeof(uint32_t));
+        automaton->target = realloc(automaton->target,
+                                    new_cnt * sizeof(uint32_t));
+        slots->next_free  = realloc(slots->next_free,
+                                    new_cnt * sizeof(size_t));
+        if (automaton->check == NULL || automaton->target == NULL
+                || slots->next_free == NULL) {
+            err(INPUT_ERROR, "Cannot grow automaton to %zu slots", new_cnt);
+        }
+        for (size_t slot = slots->slot_cnt; slot < new_cnt; ++slot) {
+            automaton->check[slot] = NO_STATE;
+            slots->next_free[slot] = slot;
+        }
+        slots->slot_cnt = new_cnt;
+    }
+
+    // Store the edges
+    automaton->base[state] = base;
+    for (uint32_t child = trie[node].first_child; child != NO_STATE;
+            child = trie[child].next_sibling) {
+        size_t slot = base + trie[child].byte;
+        automaton->check[slot]  = state;
+        automaton->target[slot] = rank[child];
+        slots->next_free[slot]  = slot + 1;
+    }
+}
+
+/*
+ * Return the first free slot of the double array at or after slot. Taken
+ * slots point further on; the pointers on the way are shortened, so that
+ * runs of taken slots are only skipped once.
+ */
+size_t find_free_slot(struct slot_allocator *slots, size_t slot)
+{
+    size_t free_slot = slot;
+    while (free_slot < slots->slot_cnt
+            && slots->next_free[free_slot] != free_slot) {
+        free_slot = slots->next_free[free_slot];
+    }
+
+    while (slot < slots->slot_cnt && slot != free_slot) {
+        size_t next = slots->next_free[slot];
+        slots->next_free[slot] = free_slot;
+        slot = next;
+    }
+
+    return free_slot;
+}
+
+// Allocate an array of count elements of size bytes or exit
+void *alloc_array(size_t count, size_t size)
+{
+    void *array = malloc(count * size);
+    if (array == NULL) {
+        err(INPUT_ERROR, "Cannot allocate %zu bytes", count * size);
+    }
+
+    return array;
+}
+
+/*
+ * Runs the Aho-Corasick automaton over the haystack from the root. None of the
+ * patterns can contain a newline, so the automaton is back at the root after
+ * every newline and each line is matched on its own, all in one pass.
+ */
+const unsigned char *find_automaton(const struct matcher *matcher,
+                                    const unsigned char *haystack,
+                                    size_t length)
+{
+    const struct automaton *automaton = matcher->automaton;
+
+    // The empty pattern is found everywhere
+    if (automaton->accepting[0]) {
+        return haystack;
+    }
+
+    uint32_t state = 0;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = haystack[i];
+
+        // Fall back along the failure links until an edge or a dense state
+        // is found
+        while (state >= automaton->dense_cnt) {
+            size_t slot = automaton->base[state] + c;
+            if (automaton->check[slot] == state) {
+                break;
+            }
+            state = automaton->fail[state];
+        }
+        if (state < automaton->dense_cnt) {
+            state = automaton->dense[(size_t) state * 256 + c];
+        }
+        else {
+            state = automaton->target[automaton->base[state] + c];
+        }
+
+        if (automaton->accepting[state]) {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Compiles the regular expression of length bytes at pattern into a matcher.
+ * If the expression turns out to be a plain string, the literal matcher is
+ * used instead. The syntax is that of extended regular expressions without
+ * intervals and back references:
+ *     .  [set]  [^set]  ^  $  ( )  |  *  +  ?
+ *     \d \w \s \D \W \S \t \n and \ before any other character
+ * Sets may contain ranges and the classes [:alpha:], [:digit:], [:alnum:],
+ * [:upper:], [:lower:], [:space:], [:punct:] and [:xdigit:].
+ */
+struct matcher new_regex_matcher(const char *pattern, size_t length)
+{
+    struct regex *regex = alloc_array(1, sizeof(struct regex));
+    regex->states    = NULL;
+    regex->state_cnt = 0;
+    regex->capacity  = 0;
+
+    // Build the NFA and append the match state
+    struct regex_parser parser = {
+        (const unsigned char *) pattern, length, 0, regex
+    };
+    struct fragment fragment = parse_alternation(&parser);
+    if (parser.pos < length) {
+        errx(ARG_ERROR, "Unmatched ) in regular expression");
+    }
+    uint32_t match = add_nfa_state(regex, NFA_MATCH, NO_STATE, NO_STATE);
+    patch(regex, fragment.holes, match);
+    regex->match_start = fragment.start;
+
+    // For an unanchored search, any bytes of the line may come before the
+    // match: start with a loop over them
+    uint32_t loop  = add_nfa_state(regex, NFA_BYTES, NO_STATE, NO_STATE);
+    uint32_t start = add_nfa_state(regex, NFA_SPLIT, fragment.start, loop);
+    fill_byte_set(&regex->states[loop], 0, 255);
+    remove_byte(&regex->states[loop], '\n');
+    regex->states[loop].out = start;
+    regex->start = start;
+    regex->empty_line_match = matches_empty_line(regex);
+
+    // Every match starts with the literal prefix, so candidate lines can be
+    // found with the literal matcher
+    int is_literal;
+    unsigned char *prefix;
+    size_t prefix_length = extract_prefix(regex, &prefix, &is_literal);
+    if (is_literal) {
+        return new_matcher((const char *) prefix, prefix_length);
+    }
+    regex->prefix = NULL;
+    if (prefix_length > 0) {
+        regex->prefix  = alloc_array(1, sizeof(struct matcher));
+        *regex->prefix = new_matcher((const char *) prefix, prefix_length);
+    }
+    else {
+        free(prefix);
+    }
+
+    struct matcher matcher;
+    matcher.pattern   = NULL;
+    matcher.length    = 0;
+    matcher.find      = find_regex;
+    matcher.automaton = NULL;
+    matcher.regex     = regex;
+    matcher.cache     = new_dfa_cache(regex);
+
+    return matcher;
+}
+
+// alternation = concatenation ("|" concatenation)*
+struct fragment parse_alternation(struct regex_parser *parser)
+{
+    struct fragment fragment = parse_concatenation(parser);
+    while (parser->pos < parser->length
+            && parser->pattern[parser->pos] == '|') {
+        ++parser->pos;
+        struct fragment other = parse_concatenation(parser);
+        uint32_t split = add_nfa_state(parser->regex, NFA_SPLIT,
+                                       fragment.start, other.start);
+        fragment.start = split;
+        fragment.holes = append_holes(parser->regex, fragment.holes,
+                                      other.holes);
+    }
+
+    return fragment;
+}
+
+// concatenation = repetition*
+struct fragment parse_concatenation(struct regex_parser *parser)
+{
+    // Start with a state that matches the empty string
+    uint32_t empty = add_nfa_state(parser->regex, NFA_EMPTY, NO_STATE,
+                                   NO_STATE);
+    struct fragment fragment = { empty, hole(empty, 0) };
+
+    while (parser->pos < parser->length
+            && parser->pattern[parser->pos] != '|'
+            && parser->pattern[parser->pos] != ')') {
+        struct fragment next = parse_repetition(parser);
+        patch(parser->regex, fragment.holes, next.start);
+        fragment.holes = next.holes;
+    }
+
+    return fragment;
+}
+
+// repetition = atom ("*" | "+" | "?")*
+struct fragment parse_repetition(struct regex_parser *parser)
+{
+    struct regex *regex = parser->regex;
+    struct fragment fragment = parse_atom(parser);
+
+    while (parser->pos < parser->length) {
+        unsigned char c = parser->pattern[parser->pos];
+        if (c != '*' && c != '+' && c != '?') {
+            break;
+        }
+        ++parser->pos;
+
+        uint32_t split = add_nfa_state(regex, NFA_SPLIT, fragment.start,
+                                       NO_STATE);
+        if (c == '*') {
+            patch(regex, fragment.holes, split);
+            fragment.start = split;
+            fragment.holes = hole(split, 1);
+        }
+        else if (c == '+') {
+            patch(regex, fragment.holes, split);
+            fragment.holes = hole(split, 1);
+        }
+        else {
+            fragment.start = split;
+            fragment.holes = append_holes(regex, fragment.holes,
+                                          hole(split, 1));
+        }
+    }
+
+    return fragment;
+}
+
+// atom = "(" alternation ")" | "." | "[" set "]" | "^" | "$" | "\" c | c
+struct fragment parse_atom(struct regex_parser *parser)
+{
+    struct regex *regex = parser->regex;
+    unsigned char c = parser->pattern[parser->pos++];
+    uint32_t state;
+
+    switch (c) {
+    case '(': {
+        struct fragment fragment = parse_alternation(parser);
+        if (parser->pos == parser->length
+                || parser->pattern[parser->pos] != ')') {
+            errx(ARG_ERROR, "Unmatched ( in regular expression");
+        }
+        ++parser->pos;
+        return fragment;
+    }
+    case '*':
+    case '+':
+    case '?':
+        errx(ARG_ERROR, "Nothing to repeat before %c in regular expression",
+             c);
+    case '^':
+        state = add_nfa_state(regex, NFA_BOL, NO_STATE, NO_STATE);
+        break;
+    case '$':
+        state = add_nfa_state(regex, NFA_EOL, NO_STATE, NO_STATE);
+        break;
+    case '.':
+        state = add_nfa_state(regex, NFA_BYTES, NO_STATE, NO_STATE);
+        fill_byte_set(&regex->states[state], 0, 255);
+        remove_byte(&regex->states[state], '\n');
+        break;
+    case '[':
+        state = add_nfa_state(regex, NFA_BYTES, NO_STATE, NO_STATE);
+        parse_set(parser, &regex->states[state]);
+        break;
+    case '\\':
+        if (parser->pos == parser->length) {
+            errx(ARG_ERROR, "Trailing \\ in regular expression");
+        }
+        state = add_nfa_state(regex, NFA_BYTES, NO_STATE, NO_STATE);
+        parse_escape(parser->pattern[parser->pos++], &regex->states[state]);
+        break;
+    default:
+        state = add_nfa_state(regex, NFA_BYTES, NO_STATE, NO_STATE);
+        fill_byte_set(&regex->states[state], c, c);
+        break;
+    }
+
+    struct fragment fragment = { state, hole(state, 0) };
+    return fragment;
+}
+
+// Parse a bracket expression after the [ into the byte set of state
+void parse_set(struct regex_parser *parser, struct nfa_state *state)
+{
+    const unsigned char *pattern = parser->pattern;
+    size_t length = parser->length;
+
+    int negate = parser->pos < length && pattern[parser->pos] == '^';
+    if (negate) {
+        ++parser->pos;
+    }
+
+    // A ] right at the start is taken literally
+    int first = 1;
+    while (parser->pos < length && (first || pattern[parser->pos] != ']')) {
+        first = 0;
+
+        // Named classes
+        if (pattern[parser->pos] == '['
+                && parser->pos + 1 < length
+                && pattern[parser->pos + 1] == ':') {
+            const unsigned char *name = pattern + parser->pos + 2;
+            const unsigned char *name_end = memchr(name, ':',
+                                                   pattern + length - name);
+            if (name_end == NULL || name_end + 1 >= pattern + length
+                    || name_end[1] != ']') {
+                errx(ARG_ERROR, "Unterminated character class in regular "
+                                "expression");
+            }
+            add_named_class(state, (const char *) name, name_end - name);
+            parser->pos = name_end + 2 - pattern;
+            continue;
+        }
+
+        // Single bytes and ranges
+        unsigned char low = pattern[parser->pos++];
+        unsigned char high = low;
+        if (parser->pos + 1 < length && pattern[parser->pos] == '-'
+                && pattern[parser->pos + 1] != ']') {
+            high = pattern[parser->pos + 1];
+            parser->pos += 2;
+            if (high < low) {
+                errx(ARG_ERROR, "Invalid range %c-%c in regular expression",
+                     low, high);
+            }
+        }
+        fill_byte_set(state, low, high);
+    }
+    if (parser->pos == length) {
+        errx(ARG_ERROR, "Unmatched [ in regular expression");
+    }
+    ++parser->pos;
+
+    if (negate) {
+        for (int i = 0; i < 4; ++i) {
+            state->bytes[i] = ~state->bytes[i];
+        }
+    }
+
+    // Lines never contain newlines
+    remove_byte(state, '\n');
+}
+
+// Add the bytes of the class [:name:] with name of length length to state
+void add_named_class(struct nfa_state *state, const char *name,
+                     size_t length)
+{
+    static const struct {
+        const char *name;
+        int        (*is_member)(int);
+    } classes[] = {
+        { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+        { "upper", isupper }, { "lower", islower }, { "space", isspace },
+        { "punct", ispunct }, { "xdigit", isxdigit },
+    };
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        if (strlen(classes[i].name) == length
+                && memcmp(classes[i].name, name, length) == 0) {
+            for (int c = 0; c < 128; ++c) {
+                if (classes[i].is_member(c)) {
+                    fill_byte_set(state, c, c);
+                }
+            }
+            return;
+        }
+    }
+
+    errx(ARG_ERROR, "Unknown character class [:%.*s:] in regular expression",
+         (int) length, name);
+}
+
+// Fill the byte set of state for the escape sequence \c
+void parse_escape(unsigned char c, struct nfa_state *state)
+{
+    switch (c) {
+    case 'd':
+    case 'D':
+        fill_byte_set(state, '0', '9');
+        break;
+    case 'w':
+    case 'W':
+        fill_byte_set(state, 'a', 'z');
+        fill_byte_set(state, 'A', 'Z');
+        fill_byte_set(state, '0', '9');
+        fill_byte_set(state, '_', '_');
+        break;
+    case 's':
+    case 'S':
+        add_named_class(state, "space", 5);
+        break;
+    case 't':
+        fill_byte_set(state, '\t', '\t');
+        break;
+    case 'n':
+        fill_byte_set(state, '\n', '\n');
+        break;
+    default:
+        fill_byte_set(state, c, c);
+        break;
+    }
+
+    // Upper case classes are the complements
+    if (c == 'D' || c == 'W' || c == 'S') {
+        for (int i = 0; i < 4; ++i) {
+            state->bytes[i] = ~state->bytes[i];
+        }
+        remove_byte(state, '\n');
+    }
+}
+
+// Add a state of the given kind and successors to the NFA, returning its
+// number
+uint32_t add_nfa_state(struct regex *regex, int kind, uint32_t out,
+                       uint32_t out1)
+{
+    if (regex->state_cnt == regex->capacity) {
+        regex->capacity = regex->capacity == 0 ? 64 : 2 * regex->capacity;
+        regex->states   = realloc(regex->states,
+                                  regex->capacity * sizeof(struct nfa_state));
+        if (regex->states == NULL) {
+            err(INPUT_ERROR, "Cannot allocate regular expression");
+        }
+    }
+
+    struct nfa_state *state = &regex->states[regex->state_cnt];
+    state->kind = kind;
+    state->out  = out;
+    state->out1 = out1;
+    memset(state->bytes, 0, sizeof(state->bytes));
+
+    return regex->state_cnt++;
+}
+
+// Add the bytes from low to high to the byte set of state
+void fill_byte_set(struct nfa_state *state, int low, int high)
+{
+    for (int c = low; c <= high; ++c) {
+        state->bytes[c / 64] |= (uint64_t) 1 << (c % 64);
+    }
+}
+
+// Remove byte c from the byte set of state
+void remove_byte(struct nfa_state *state, int c)
+{
+    state->bytes[c / 64] &= ~((uint64_t) 1 << (c % 64));
+}
+
+// Return whether byte c is in the byte set of state
+int has_byte(const struct nfa_state *state, int c)
+{
+    return (state->bytes[c / 64] >> (c % 64)) & 1;
+}
+
+/*
+ * Holes are the unconnected successor fields of a fragment: out (which = 0)
+ * or out1 (which = 1) of a state. They are encoded as 2 * state + which and
+ * kept in a list that is threaded through the empty fields themselves.
+ */
+uint32_t hole(uint32_t state, int which)
+{
+    return 2 * state + which;
+}
+
+// Return a pointer to the field of the hole
+uint32_t *hole_field(struct regex *regex, uint32_t hole)
+{
+    struct nfa_state *state = &regex->states[hole / 2];
+    return hole % 2 == 0 ? &state->out : &state->out1;
+}
+
+// Connect all holes in the list to target
+void patch(struct regex *regex, uint32_t holes, uint32_t target)
+{
+    while (holes != NO_STATE) {
+        uint32_t *field = hole_field(regex, holes);
+        holes  = *field;
+        *field = target;
+    }
+}
+
+// Concatenate two lists of holes
+uint32_t append_holes(struct regex *regex, uint32_t first, uint32_t second)
+{
+    if (first == NO_STATE) {
+        return second;
+    }
+
+    uint32_t last = first;
+    while (*hole_field(regex, last) != NO_STATE) {
+        last = *hole_field(regex, last);
+    }
+    *hole_field(regex, last) = second;
+
+    return first;
+}
+
+// Return whether regex matches an empty line, where both assertions hold
+int matches_empty_line(const struct regex *regex)
+{
+    struct nfa_workspace workspace = new_workspace(regex);
+    uint32_t *set = alloc_array(regex->state_cnt, sizeof(uint32_t));
+
+    next_generation(&workspace);
+    uint32_t count = closure(regex, &workspace, regex->match_start,
+                             1 << NFA_BOL | 1 << NFA_EOL, set, 0);
+    int match = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (regex->states[set[i]].kind == NFA_MATCH) {
+            match = 1;
+        }
+    }
+
+    free(set);
+    free(workspace.stack);
+    free(workspace.marks);
+    return match;
+}
+
+/*
+ * Collects the bytes every match has to start with into a new array at
+ * *prefix and returns how many there are. They are found by following the
+ * NFA from the start as long as only a single byte can come next. If the
+ * NFA consists of nothing else, *is_literal is set.
+ */
+size_t extract_prefix(const struct regex *regex, unsigned char **prefix,
+                      int *is_literal)
+{
+    *prefix = alloc_array(regex->state_cnt + 1, 1);
+    size_t length = 0;
+    int anchored  = 0;
+
+    struct nfa_workspace workspace = new_workspace(regex);
+    uint32_t *set = alloc_array(regex->state_cnt, sizeof(uint32_t));
+
+    next_generation(&workspace);
+    uint32_t count = closure(regex, &workspace, regex->match_start, 0, set,
+                             0);
+    while (count == 1) {
+        const struct nfa_state *state = &regex->states[set[0]];
+        if (state->kind == NFA_BOL) {
+            anchored = 1;
+        }
+        else if (state->kind == NFA_BYTES && byte_count(state) == 1) {
+            int c = 0;
+            while (!has_byte(state, c)) {
+                ++c;
+            }
+            (*prefix)[length++] = c;
+        }
+        else {
+            break;
+        }
+
+        next_generation(&workspace);
+        count = closure(regex, &workspace, state->out, 0, set, 0);
+    }
+
+    *is_literal = !anchored && count == 1
+                  && regex->states[set[0]].kind == NFA_MATCH;
+
+    free(set);
+    free(workspace.stack);
+    free(workspace.marks);
+    return length;
+}
+
+// Return the number of bytes in the byte set of state
+int byte_count(const struct nfa_state *state)
+{
+    int count = 0;
+    for (int i = 0; i < 4; ++i) {
+        count += __builtin_popcountll(state->bytes[i]);
+    }
+
+    return count;
+}
+
+// Allocate the buffers for walking the NFA of regex
+struct nfa_workspace new_workspace(const struct regex *regex)
+{
+    struct nfa_workspace workspace;
+    workspace.stack      = alloc_array(2 * regex->state_cnt + 1,
+                                       sizeof(uint32_t));
+    workspace.marks      = calloc(regex->state_cnt, sizeof(uint32_t));
+    workspace.generation = 0;
+    workspace.state_cnt  = regex->state_cnt;
+    if (workspace.marks == NULL) {
+        err(INPUT_ERROR, "Cannot allocate NFA workspace");
+    }
+
+    return workspace;
+}
+
+// Start a new, empty set of states
+void next_generation(struct nfa_workspace *workspace)
+{
+    if (++workspace->generation == 0) {
+        // The marks wrapped around; old marks must not count as current
+        workspace->generation = 1;
+        memset(workspace->marks, 0, workspace->state_cnt * sizeof(uint32_t));
+    }
+}
+
+/*
+ * Adds state and all states reachable from it without consuming a byte to
+ * the set of count states at set, unless they are in there already, and
+ * returns the new count. Only states that consume something are stored;
+ * assertions whose kind is in the bit mask satisfied are passed through. The
+ * states in the set carry the current generation as mark.
+ */
+uint32_t closure(const struct regex *regex, struct nfa_workspace *workspace,
+                 uint32_t state, int satisfied, uint32_t *set, uint32_t count)
+{
+    uint32_t *stack = workspace->stack;
+    uint32_t *marks = workspace->marks;
+    uint32_t depth  = 0;
+    stack[depth++] = state;
+
+    while (depth > 0) {
+        uint32_t cur = stack[--depth];
+        if (marks[cur] == workspace->generation) {
+            continue;
+        }
+        marks[cur] = workspace->generation;
+
+        const struct nfa_state *nfa_state = &regex->states[cur];
+        if (nfa_state->kind == NFA_SPLIT) {
+            stack[depth++] = nfa_state->out1;
+            stack[depth++] = nfa_state->out;
+        }
+        else if (nfa_state->kind == NFA_EMPTY
+                 || (satisfied & 1 << nfa_state->kind)) {
+            stack[depth++] = nfa_state->out;
+        }
+        else {
+            set[count++] = cur;
+        }
+    }
+
+    return count;
+}
+
+// Return a copy of matcher that can be used alongside it in another thread
+struct matcher clone_matcher(const struct matcher *matcher)
+{
+    struct matcher clone = *matcher;
+    if (clone.regex != NULL) {
+        clone.cache = new_dfa_cache(clone.regex);
+    }
+
+    return clone;
+}
+
+// Free cache and all of its DFA states
+void free_dfa_cache(struct dfa_cache *cache)
+{
+    flush_cache(cache);
+    free(cache->states);
+    free(cache->buckets);
+    free(cache->set);
+    free(cache->result);
+    free(cache->workspace.stack);
+    free(cache->workspace.marks);
+    free(cache);
+}
+
+// Create an empty DFA cache for regex. The regex can be shared, but each
+// thread needs its own cache.
+struct dfa_cache *new_dfa_cache(const struct regex *regex)
+{
+    struct dfa_cache *cache = alloc_array(1, sizeof(struct dfa_cache));
+    cache->regex      = regex;
+    cache->states     = alloc_array(DFA_CACHE_STATES,
+                                    sizeof(struct dfa_state *));
+    cache->state_cnt  = 0;
+    cache->buckets    = calloc(DFA_CACHE_BUCKETS, sizeof(struct dfa_state *));
+    cache->line_start = NULL;
+    cache->set        = alloc_array(regex->state_cnt, sizeof(uint32_t));
+    cache->result     = alloc_array(regex->state_cnt, sizeof(uint32_t));
+    cache->workspace  = new_workspace(regex);
+    if (cache->buckets == NULL) {
+        err(INPUT_ERROR, "Cannot allocate DFA cache");
+    }
+
+    return cache;
+}
+
+/*
+ * Searches the lines in the length bytes at haystack with the lazy DFA and
+ * returns a pointer into the first line that matches or NULL. If the regular
+ * expression has a literal prefix, the DFA only looks at the lines that
+ * contain it.
+ */
+const unsigned char *find_regex(const struct matcher *matcher,
+                                const unsigned char *haystack, size_t length)
+{
+    const struct regex *regex = matcher->regex;
+    const unsigned char *end  = haystack + length;
+    if (regex->prefix == NULL) {
+        return scan_dfa(matcher->cache, haystack, end);
+    }
+
+    const unsigned char *pos = haystack;
+    while (pos < end) {
+        const unsigned char *hit = regex->prefix->find(regex->prefix, pos,
+                                                       end - pos);
+        if (hit == NULL) {
+            return NULL;
+        }
+
+        const unsigned char *line_start = memrchr(pos, '\n', hit - pos);
+        line_start = line_start == NULL ? pos : line_start + 1;
+        const unsigned char *line_end = memchr(hit, '\n', end - hit);
+        line_end = line_end == NULL ? end : line_end + 1;
+
+        const unsigned char *match = scan_dfa(matcher->cache, line_start,
+                                              line_end);
+        if (match != NULL) {
+            return match;
+        }
+        pos = line_end;
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs the DFA over the lines between start and end, computing missing
+ * transitions on the way. At every newline, the end of line is checked and
+ * the DFA restarts in the line start state. Returns a pointer into the first
+ * matching line or NULL.
+ */
+const unsigned char *scan_dfa(struct dfa_cache *cache,
+                              const unsigned char *start,
+                              const unsigned char *end)
+{
+    struct dfa_state *state = line_start_state(cache);
+    for (const unsigned char *pos = start; pos < end; ++pos) {
+        if (state->is_match) {
+            return pos;
+        }
+
+        unsigned char c = *pos;
+        if (c == '\n') {
+            int is_empty = pos == start || pos[-1] == '\n';
+            if (is_empty ? cache->regex->empty_line_match
+                         : eol_matches(cache, state)) {
+                return pos;
+            }
+            state = line_start_state(cache);
+            continue;
+        }
+
+        struct dfa_state *next = state->next[c];
+        state = next != NULL ? next : compute_next(cache, state, c);
+    }
+
+    // The last line may lack its newline
+    if (end > start && end[-1] != '\n'
+            && (state->is_match || eol_matches(cache, state))) {
+        return end - 1;
+    }
+
+    return NULL;
+}
+
+// Return the state the DFA is in at the beginning of a line
+struct dfa_state *line_start_state(struct dfa_cache *cache)
+{
+    if (cache->line_start == NULL) {
+        // Take the virtual beginning of line symbol from the start state
+        next_generation(&cache->workspace);
+        uint32_t count = closure(cache->regex, &cache->workspace,
+                                 cache->regex->start, 0, cache->set, 0);
+        count = step_set(cache, cache->set, count, NFA_BOL, 0);
+
+        // A flush in the middle of the last line may have left the cache
+        // full. No other state is held across a line start, so it can go.
+        uint32_t hash = hash_set(cache->result, count);
+        if (find_state(cache, cache->result, count, hash) == NULL
+                && cache->state_cnt == DFA_CACHE_STATES) {
+            flush_cache(cache);
+        }
+        cache->line_start = intern_state(cache, cache->result, count);
+    }
+
+    return cache->line_start;
+}
+
+// Return whether the regular expression matches if the line ends in state
+int eol_matches(struct dfa_cache *cache, struct dfa_state *state)
+{
+    if (state->eol_match == -1) {
+        uint32_t count = step_set(cache, state->nfa_states, state->nfa_cnt,
+                                  NFA_EOL, 0);
+        state->eol_match = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (cache->regex->states[cache->result[i]].kind == NFA_MATCH) {
+                state->eol_match = 1;
+            }
+        }
+    }
+
+    return state->eol_match;
+}
+
+/*
+ * Computes the state the DFA goes to from state on byte c and remembers the
+ * transition. If the cache is full, it is flushed first, which frees state.
+ */
+struct dfa_state *compute_next(struct dfa_cache *cache,
+                               struct dfa_state *state, unsigned char c)
+{
+    uint32_t count = step_set(cache, state->nfa_states, state->nfa_cnt,
+                              NFA_NONE, c);
+
+    // Flush the cache when it's full. Everything has to be computed again,
+    // but the memory stays bounded whatever the input.
+    uint32_t hash = hash_set(cache->result, count);
+    struct dfa_state *next = find_state(cache, cache->result, count, hash);
+    if (next == NULL) {
+        if (cache->state_cnt == DFA_CACHE_STATES) {
+            flush_cache(cache);
+            state = NULL;
+        }
+        next = intern_state(cache, cache->result, count);
+    }
+
+    if (state != NULL) {
+        state->next[c] = next;
+    }
+
+    return next;
+}
+
+/*
+ * Computes the set of NFA states reached from the count states at states and
+ * stores it in cache->result, sorted, returning its size. With assertion
+ * NFA_BOL or NFA_EOL, the virtual symbol for the beginning or end of the line
+ * is taken: states of that kind are passed, all others are kept. Otherwise the
+ * states that accept byte c are advanced.
+ */
+uint32_t step_set(struct dfa_cache *cache, const uint32_t *states,
+                  uint32_t count, int assertion, unsigned char c)
+{
+    const struct regex *regex = cache->regex;
+    struct nfa_workspace *workspace = &cache->workspace;
+    uint32_t *result = cache->result;
+    uint32_t result_cnt = 0;
+
+    next_generation(workspace);
+    for (uint32_t i = 0; i < count; ++i) {
+        const struct nfa_state *state = &regex->states[states[i]];
+        if (assertion != NFA_NONE) {
+            if (state->kind == assertion) {
+                result_cnt = closure(regex, workspace, state->out,
+                                     1 << assertion, result, result_cnt);
+            }
+            else if (workspace->marks[states[i]] != workspace->generation) {
+                workspace->marks[states[i]] = workspace->generation;
+                result[result_cnt++] = states[i];
+            }
+        }
+        else if (state->kind == NFA_BYTES && has_byte(state, c)) {
+            result_cnt = closure(regex, workspace, state->out, 0, result,
+                                 result_cnt);
+        }
+    }
+
+    qsort(result, result_cnt, sizeof(uint32_t), compare_states);
+    return result_cnt;
+}
+
+// Order NFA state numbers for qsort
+int compare_states(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+// FNV-1a hash of a set of NFA states
+uint32_t hash_set(const uint32_t *set, uint32_t count)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < count; ++i) {
+        hash = (hash ^ set[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Return the cached DFA state for the set of count NFA states or NULL
+struct dfa_state *find_state(const struct dfa_cache *cache,
+                             const uint32_t *set, uint32_t count,
+                             uint32_t hash)
+{
+    struct dfa_state *state = cache->buckets[hash % DFA_CACHE_BUCKETS];
+    for (; state != NULL; state = state->hash_next) {
+        if (state->hash == hash && state->nfa_cnt == count
+                && memcmp(state->nfa_states, set,
+                          count * sizeof(uint32_t)) == 0) {
+            return state;
+        }
+    }
+
+    return NULL;
+}
+
+// Return the DFA state for the set of count NFA states, adding it to the
+// cache if it's not in there. The cache must not be full.
+struct dfa_state *intern_state(struct dfa_cache *cache, const uint32_t *set,
+                               uint32_t count)
+{
+    uint32_t hash = hash_set(set, count);
+    struct dfa_state *state = find_state(cache, set, count, hash);
+    if (state != NULL) {
+        return state;
+    }
+
+    state = alloc_array(1, sizeof(struct dfa_state)
+                           + count * sizeof(uint32_t));
+    memset(state->next, 0, sizeof(state->next));
+    state->hash      = hash;
+    state->eol_match = -1;
+    state->is_match  = 0;
+    state->nfa_cnt   = count;
+    for (uint32_t i = 0; i < count; ++i) {
+        state->nfa_states[i] = set[i];
+        if (cache->regex->states[set[i]].kind == NFA_MATCH) {
+            state->is_match = 1;
+        }
+    }
+
+    state->hash_next = cache->buckets[hash % DFA_CACHE_BUCKETS];
+    cache->buckets[hash % DFA_CACHE_BUCKETS] = state;
+    cache->states[cache->state_cnt++] = state;
+
+    return state;
+}
+
+// Throw away all DFA states
+void flush_cache(struct dfa_cache *cache)
+{
+    for (size_t i = 0; i < cache->state_cnt; ++i) {
+        free(cache->states[i]);
+    }
+    cache->state_cnt  = 0;
+    cache->line_start = NULL;
+    memset(cache->buckets, 0, DFA_CACHE_BUCKETS * sizeof(struct dfa_state *));
+}
+
+/*
+ * Builds a trigram index of the path_cnt files and directories in paths and
+ * writes it to the file at path. Directories are walked recursively, in the
+ * order of the names, like the search does.
+ */
+void build_index(const char *path, char **paths, int path_cnt)
+{
+    struct index_builder builder;
+    builder.list_cnt         = 0;
+    builder.capacity         = 1024;
+    builder.lists            = calloc(builder.capacity,
+                                      sizeof(struct posting_list));
+    builder.seen             = calloc(TRIGRAM_CNT / 64, sizeof(uint64_t));
+    builder.file_trigrams    = alloc_array(TRIGRAM_CNT, sizeof(uint32_t));
+    builder.file_trigram_cnt = 0;
+    builder.files            = NULL;
+    builder.file_cnt         = 0;
+    builder.file_capacity    = 0;
+    builder.names            = NULL;
+    builder.names_length     = 0;
+    builder.names_capacity   = 0;
+    builder.buffer           = alloc_array(BUFSIZE, 1);
+    if (builder.lists == NULL || builder.seen == NULL) {
+        err(INPUT_ERROR, "Cannot allocate index");
+    }
+
+    for (int i = 0; i < path_cnt; ++i) {
+        index_tree(&builder, paths[i], 1);
+    }
+    write_index(&builder, path);
+
+    for (size_t i = 0; i < builder.capacity; ++i) {
+        free(builder.lists[i].bytes);
+    }
+    free(builder.lists);
+    free(builder.seen);
+    free(builder.file_trigrams);
+    free(builder.files);
+    free(builder.names);
+    free(builder.buffer);
+}
+
+// Add the file or directory at path to the index, following symbolic links
+// only for operands
+void index_tree(struct index_builder *builder, const char *path,
+                int is_operand)
+{
+    struct stat path_stat;
+    int result = is_operand ? stat(path, &path_stat)
+                            : lstat(path, &path_stat);
+    if (result == -1) {
+        err(ARG_ERROR, "Cannot open %s for reading", path);
+    }
+
+    if (S_ISREG(path_stat.st_mode)) {
+        index_file(builder, path, &path_stat);
+        return;
+    }
+    if (!S_ISDIR(path_stat.st_mode)) {
+        return;
+    }
+
+    // Collect and sort the entries of the directory
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        err(ARG_ERROR, "Cannot open directory %s", path);
+    }
+    char **names    = NULL;
+    size_t name_cnt = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0
+                || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (name_cnt == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            names = realloc(names, capacity * sizeof(char *));
+            if (names == NULL) {
+                err(INPUT_ERROR, "Cannot allocate memory for file list");
+            }
+        }
+        names[name_cnt++] = join_path(path, entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, name_cnt, sizeof(char *), compare_names);
+
+    for (size_t i = 0; i < name_cnt; ++i) {
+        index_tree(builder, names[i], 0);
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Add the trigrams of the regular file at path, which has the given status,
+// to the index
+void index_file(struct index_builder *builder, const char *path,
+                const struct stat *file_stat)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        err(ARG_ERROR, "Cannot open %s for reading", path);
+    }
+
+    // Every trigram of the file is added once, under the file's number
+    uint32_t trigram = 0;
+    uint64_t byte_cnt = 0;
+    ssize_t read_cnt;
+    while ((read_cnt = read(fd, builder->buffer, BUFSIZE)) > 0) {
+        for (ssize_t i = 0; i < read_cnt; ++i) {
+            trigram = (trigram << 8 | builder->buffer[i]) & (TRIGRAM_CNT - 1);
+            if (++byte_cnt >= 3
+                    && !(builder->seen[trigram / 64] >> (trigram % 64) & 1)) {
+                builder->seen[trigram / 64] |= (uint64_t) 1 << (trigram % 64);
+                builder->file_trigrams[builder->file_trigram_cnt++] = trigram;
+            }
+        }
+    }
+    if (read_cnt == -1) {
+        err(INPUT_ERROR, "Error in reading %s", path);
+    }
+    close(fd);
+
+    uint32_t file_nr = builder->file_cnt;
+    for (size_t i = 0; i < builder->file_trigram_cnt; ++i) {
+        uint32_t seen_trigram = builder->file_trigrams[i];
+        struct posting_list *list = find_posting_list(builder, seen_trigram);
+        append_varint(list, file_nr - list->last_file);
+        list->last_file = file_nr;
+        ++list->file_cnt;
+        builder->seen[seen_trigram / 64] = 0;
+    }
+    builder->file_trigram_cnt = 0;
+
+    // Remember the name, size and modification time
+    size_t name_length = strlen(path) + 1;
+    if (builder->names_length + name_length > builder->names_capacity) {
+        builder->names_capacity = 2 * (builder->names_capacity + name_length);
+        builder->names = realloc(builder->names, builder->names_capacity);
+        if (builder->names == NULL) {
+            err(INPUT_ERROR, "Cannot allocate memory for file list");
+        }
+    }
+    if (builder->file_cnt == builder->file_capacity) {
+        builder->file_capacity = builder->file_capacity == 0
+                                 ? 64 : 2 * builder->file_capacity;
+        builder->files = realloc(builder->files, builder->file_capacity
+                                                 * sizeof(struct index_file));
+        if (builder->files == NULL) {
+            err(INPUT_ERROR, "Cannot allocate memory for file list");
+        }
+    }
+
+    struct index_file *file = &builder->files[builder->file_cnt++];
+    file->name_offset = builder->names_length;
+    file->size        = file_stat->st_size;
+    file->mtime_sec   = file_stat->st_mtim.tv_sec;
+    file->mtime_nsec  = file_stat->st_mtim.tv_nsec;
+    memcpy(builder->names + builder->names_length, path, name_length);
+    builder->names_length += name_length;
+}
+
+// Return the posting list of trigram, creating it if needed
+struct posting_list *find_posting_list(struct index_builder *builder,
+                                       uint32_t trigram)
+{
+    // Keep the table at most half full
+    if (2 * (builder->list_cnt + 1) > builder->capacity) {
+        struct posting_list *old = builder->lists;
+        size_t old_capacity      = builder->capacity;
+        builder->capacity *= 2;
+        builder->lists = calloc(builder->capacity,
+                                sizeof(struct posting_list));
+        if (builder->lists == NULL) {
+            err(INPUT_ERROR, "Cannot allocate index");
+        }
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].bytes != NULL) {
+                builder->lists[posting_slot(builder, old[i].trigram)]
+                    = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct posting_list *list = &builder->lists[posting_slot(builder,
+                                                             trigram)];
+    if (list->bytes == NULL) {
+        list->trigram   = trigram;
+        list->file_cnt  = 0;
+        list->last_file = 0;
+        list->length    = 0;
+        list->capacity  = 8;
+        list->bytes     = alloc_array(list->capacity, 1);
+        ++builder->list_cnt;
+    }
+
+    return list;
+}
+
+// Return the slot of the posting list of trigram, or the free slot where it
+// belongs
+size_t posting_slot(const struct index_builder *builder, uint32_t trigram)
+{
+    // Trigrams are 24 bits, so multiplying spreads them over all 32
+    size_t slot = (trigram * 2654435761u) & (builder->capacity - 1);
+    while (builder->lists[slot].bytes != NULL
+            && builder->lists[slot].trigram != trigram) {
+        slot = (slot + 1) & (builder->capacity - 1);
+    }
+
+    return slot;
+}
+
+// Append value to the postings in list as a varint
+void append_varint(struct posting_list *list, uint32_t value)
+{
+    if (list->length + 5 > list->capacity) {
+        list->capacity *= 2;
+        list->bytes = realloc(list->bytes, list->capacity);
+        if (list->bytes == NULL) {
+            err(INPUT_ERROR, "Cannot allocate index");
+        }
+    }
+
+    while (value >= 0x80) {
+        list->bytes[list->length++] = value | 0x80;
+        value >>= 7;
+    }
+    list->bytes[list->length++] = value;
+}
+
+// Compare posting lists by trigram for qsort
+int compare_lists(const void *a, const void *b)
+{
+    uint32_t x = (*(struct posting_list * const *) a)->trigram;
+    uint32_t y = (*(struct posting_list * const *) b)->trigram;
+
+    return (x > y) - (x < y);
+}
+
+// Write the index built to the file at path
+void write_index(struct index_builder *builder, const char *path)
+{
+    // Sort the posting lists by trigram
+    struct posting_list **lists = alloc_array(builder->list_cnt + 1,
+                                              sizeof(struct posting_list *));
+    size_t list_cnt = 0;
+    for (size_t i = 0; i < builder->capacity; ++i) {
+        if (builder->lists[i].bytes != NULL) {
+            lists[list_cnt++] = &builder->lists[i];
+        }
+    }
+    qsort(lists, list_cnt, sizeof(struct posting_list *), compare_lists);
+
+    // Lay out the sections
+    struct index_header header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.file_cnt        = builder->file_cnt;
+    header.trigram_cnt     = list_cnt;
+    header.files_offset    = sizeof(struct index_header);
+    header.trigrams_offset = header.files_offset
+                             + builder->file_cnt * sizeof(struct index_file);
+    header.postings_offset = header.trigrams_offset
+                             + list_cnt * sizeof(struct index_trigram);
+
+    struct index_trigram *trigrams
+        = alloc_array(list_cnt + 1, sizeof(struct index_trigram));
+    uint64_t postings_size = 0;
+    for (size_t i = 0; i < list_cnt; ++i) {
+        trigrams[i].trigram         = lists[i]->trigram;
+        trigrams[i].file_cnt        = lists[i]->file_cnt;
+        trigrams[i].postings_offset = header.postings_offset + postings_size;
+        postings_size += lists[i]->length;
+    }
+    header.names_offset = header.postings_offset + postings_size;
+    header.size         = header.names_offset + builder->names_length;
+
+    // Names are stored relative to their section
+    for (size_t i = 0; i < builder->file_cnt; ++i) {
+        builder->files[i].name_offset += header.names_offset;
+    }
+
+    // Write everything
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+        err(ARG_ERROR, "Cannot open %s for writing", path);
+    }
+    write_all(stream, &header, sizeof(header), path);
+    write_all(stream, builder->files,
+              builder->file_cnt * sizeof(struct index_file), path);
+    write_all(stream, trigrams, list_cnt * sizeof(struct index_trigram),
+              path);
+    for (size_t i = 0; i < list_cnt; ++i) {
+        write_all(stream, lists[i]->bytes, lists[i]->length, path);
+    }
+    write_all(stream, builder->names, builder->names_length, path);
+    if (fclose(stream) == EOF) {
+        err(OUTPUT_ERROR, "Error in writing %s", path);
+    }
+
+    free(trigrams);
+    free(lists);
+}
+
+// Write the length bytes at data to *stream, which is the file at path
+void write_all(FILE *stream, const void *data, size_t length,
+               const char *path)
+{
+    if (length > 0 && fwrite(data, 1, length, stream) != length) {
+        err(OUTPUT_ERROR, "Error in writing %s", path);
+    }
+}
+
+/*
+ * Searches the files in the index at path with job_cnt threads. Only files
+ * that contain all trigrams of the literal every match must contain are read,
+ * and those that have a different size or modification time than when the
+ * index was built, since the postings say nothing about them anymore. Files
+ * added since then are not searched. Returns the exit status.
+ */
+int search_index(const struct matcher *matcher,
+                 const struct grep_options *options, const char *path,
+                 int job_cnt)
+{
+    // Map the index
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        err(ARG_ERROR, "Cannot open %s for reading", path);
+    }
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1) {
+        err(INPUT_ERROR, "Cannot examine %s", path);
+    }
+    if ((size_t) index_stat.st_size < sizeof(struct index_header)) {
+        errx(INPUT_ERROR, "%s is not an index", path);
+    }
+    const unsigned char *index = mmap(NULL, index_stat.st_size, PROT_READ,
+                                      MAP_PRIVATE, fd, 0);
+    if (index == MAP_FAILED) {
+        err(INPUT_ERROR, "Cannot map %s", path);
+    }
+    close(fd);
+
+    const struct index_header *header = (const struct index_header *) index;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->size != (uint64_t) index_stat.st_size
+            || header->files_offset + header->file_cnt
+               * sizeof(struct index_file) > header->trigrams_offset
+            || header->trigrams_offset + header->trigram_cnt
+               * sizeof(struct index_trigram) > header->postings_offset
+            || header->postings_offset > header->names_offset
+            || header->names_offset > header->size
+            || (header->file_cnt > 0
+                && (header->names_offset == header->size
+                    || index[header->size - 1] != '\0'))) {
+        errx(INPUT_ERROR, "%s is not an index", path);
+    }
+    const struct index_file *files
+        = (const struct index_file *) (index + header->files_offset);
+    const struct index_trigram *trigrams
+        = (const struct index_trigram *) (index + header->trigrams_offset);
+
+    // Without a literal of at least three bytes, every file is a candidate
+    uint32_t *candidates = alloc_array(header->file_cnt + 1,
+                                       sizeof(uint32_t));
+    uint32_t *postings   = alloc_array(header->file_cnt + 1,
+                                       sizeof(uint32_t));
+    size_t candidate_cnt = header->file_cnt;
+    for (uint32_t i = 0; i < header->file_cnt; ++i) {
+        candidates[i] = i;
+    }
+
+    // Intersect the postings of all trigrams of the literal
+    size_t literal_length;
+    const unsigned char *literal = required_literal(matcher, &literal_length);
+    for (size_t i = 0; i + 3 <= literal_length && candidate_cnt > 0; ++i) {
+        uint32_t trigram = literal[i] << 16 | literal[i + 1] << 8
+                           | literal[i + 2];
+        const struct index_trigram *entry = find_trigram(trigrams,
+                                                         header->trigram_cnt,
+                                                         trigram);
+        size_t posting_cnt = 0;
+        if (entry != NULL) {
+            // The postings have to fit into postings and into their region
+            if (entry->file_cnt > header->file_cnt
+                    || entry->postings_offset < header->postings_offset
+                    || entry->postings_offset >= header->names_offset) {
+                errx(INPUT_ERROR, "%s is not an index", path);
+            }
+            posting_cnt = decode_postings(index + entry->postings_offset,
+                                          index + header->names_offset,
+                                          entry->file_cnt, postings);
+            if (posting_cnt != entry->file_cnt) {
+                errx(INPUT_ERROR, "%s is not an index", path);
+            }
+        }
+        candidate_cnt = intersect(candidates, candidate_cnt, postings,
+                                  posting_cnt);
+    }
+
+    // Add the files that changed and collect the names. With -c, the files
+    // left out are kept as pruned, since their count of 0 is printed as well.
+    char **names  = alloc_array(header->file_cnt + 1, sizeof(char *));
+    char *pruned  = alloc_array(header->file_cnt + 1, sizeof(char));
+    int name_cnt  = 0;
+    size_t next  = 0;
+    for (uint32_t i = 0; i < header->file_cnt; ++i) {
+        int is_candidate = next < candidate_cnt && candidates[next] == i;
+        if (is_candidate) {
+            ++next;
+        }
+
+        // The names region ends with a null byte, so the name does as well
+        if (files[i].name_offset < header->names_offset
+                || files[i].name_offset >= header->size) {
+            errx(INPUT_ERROR, "%s is not an index", path);
+        }
+        const char *name = (const char *) index + files[i].name_offset;
+        struct stat file_stat;
+        if (!is_candidate
+                && stat(name, &file_stat) == 0
+                && (uint64_t) file_stat.st_size == files[i].size
+                && file_stat.st_mtim.tv_sec == files[i].mtime_sec
+                && file_stat.st_mtim.tv_nsec == files[i].mtime_nsec) {
+            if (!options->count_only) {
+                continue;
+            }
+            pruned[name_cnt] = 1;
+        }
+        else {
+            pruned[name_cnt] = 0;
+        }
+        names[name_cnt++] = (char *) name;
+    }
+
+    int status = search_tree(matcher, options, names, pruned, name_cnt,
+                             job_cnt);
+
+    free(pruned);
+    free(names);
+    free(postings);
+    free(candidates);
+    munmap((void *) index, index_stat.st_size);
+    return status;
+}
+
+// Binary search the trigram_cnt entries at trigrams for trigram
+const struct index_trigram *find_trigram(const struct index_trigram *trigrams,
+                                         uint32_t trigram_cnt,
+                                         uint32_t trigram)
+{
+    uint32_t low  = 0;
+    uint32_t high = trigram_cnt;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (trigrams[mid].trigram < trigram) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return low < trigram_cnt && trigrams[low].trigram == trigram
+           ? &trigrams[low] : NULL;
+}
+
+// Decode the file_cnt delta-encoded file numbers at bytes, which end before
+// end, into files and return how many there are. Fewer than file_cnt means
+// that the postings are cut off or a number is longer than 32 bits.
+size_t decode_postings(const unsigned char *bytes, const unsigned char *end,
+                       uint32_t file_cnt, uint32_t *files)
+{
+    uint32_t file_nr = 0;
+    for (uint32_t i = 0; i < file_cnt; ++i) {
+        uint32_t delta = 0;
+        int shift = 0;
+        do {
+            if (bytes == end || shift > 28) {
+                return i;
+            }
+            delta |= (uint32_t) (*bytes & 0x7f) << shift;
+            shift += 7;
+        } while (*bytes++ & 0x80);
+
+        file_nr += delta;
+        files[i] = file_nr;
+    }
+
+    return file_cnt;
+}
+
+// Keep only those of the count ascending numbers at set that are also among
+// the other_cnt ascending numbers at other. Returns the new count.
+size_t intersect(uint32_t *set, size_t count, const uint32_t *other,
+                 size_t other_cnt)
+{
+    size_t kept = 0;
+    size_t j    = 0;
+    for (size_t i = 0; i < count; ++i) {
+        while (j < other_cnt && other[j] < set[i]) {
+            ++j;
+        }
+        if (j < other_cnt && other[j] == set[i]) {
+            set[kept++] = set[i];
+        }
+    }
+
+    return kept;
+}
+
+/*
+ * Return the bytes every match of matcher contains and store their number in
+ * *length: the pattern itself or the prefix of a regular expression. For a
+ * set of patterns, there is no such literal and *length is 0.
+ */
+const unsigned char *required_literal(const struct matcher *matcher,
+                                      size_t *length)
+{
+    if (matcher->regex != NULL) {
+        const struct matcher *prefix = matcher->regex->prefix;
+        *length = prefix != NULL ? prefix->length : 0;
+        return prefix != NULL ? prefix->pattern : NULL;
+    }
+
+    *length = matcher->automaton != NULL ? 0 : matcher->length;
+    return matcher->pattern;
 }
@@ -1,80 +1,607 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
 #include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "errors.h"
 
-void wc(FILE *);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define BUFSIZE (128 * 1024)
+#define BLOCK_BYTES 64
+    // The vector kernels turn every 64 bytes into one 64-bit mask
+#define PARALLEL_CHUNK (16 * 1024 * 1024)
+    // Regular files are split into tasks of this many bytes
+#define MAX_JOBS 256
+
+// Which counts to print (and to compute, where that costs something)
+struct wc_options {
+    int lines;
+    int words;
+    int chars;
+    int bytes;
+    int max_line;
+};
+
+/*
+ * Characters are UTF-8 characters, counted as the bytes that are not
+ * continuation bytes (10xxxxxx). Line lengths are measured in characters and
+ * don't include the newline.
+ */
+struct wc_counts {
+    uint64_t newline_cnt;
+    uint64_t word_cnt;
+    uint64_t char_cnt;
+    uint64_t byte_cnt;
+    uint64_t max_line_len;
+};
+
+/*
+ * Counts so far and whether the last byte counted was whitespace. Before the
+ * first byte we are not in a word, so prev_ws starts out as 1.
+ *     For the longest line, the length of the first line (which may be the
+ * tail of a line begun in an earlier chunk) and of the current, unfinished
+ * line are kept, too. counts.max_line_len only covers finished lines.
+ */
+struct wc_state {
+    struct wc_counts counts;
+    int              prev_ws;
+    int              want_chars;
+    int              want_max_line;
+    int              has_newline;
+    uint64_t         first_line_len;
+    uint64_t         cur_line_len;
+};
+
+/*
+ * Counts for a piece of a file that was counted on its own, as if it were
+ * preceded by whitespace and a newline. To glue two pieces together, we need
+ * to know whether the first piece ends in a word and the second one starts in
+ * a word: then the word that spans the boundary was counted twice. Likewise,
+ * the line spanning the boundary is the last line of the first piece plus the
+ * first line of the second.
+ */
+struct chunk_counts {
+    struct wc_counts counts;
+    int              starts_in_word;
+    int              ends_in_word;
+    int              has_newline;
+    uint64_t         first_line_len;
+    uint64_t         last_line_len;
+};
+
+typedef void (*count_kernel)(const unsigned char *, size_t,
+                             struct wc_state *);
+
+/*
+ * A file to be counted. A regular file is split into chunk_cnt chunks of
+ * PARALLEL_CHUNK bytes starting at offset start, which are counted
+ * independently. Anything else (pipes, terminals, ...) is a single chunk that
+ * is read sequentially. name is NULL for stdin.
+ */
+struct wc_file {
+    const char          *name;
+    int                 is_stream;
+    off_t               start;
+    off_t               size;
+    long                first_task;
+    long                chunk_cnt;
+    long                chunks_left;
+    int                 open_errno;
+    int                 read_errno;
+    struct chunk_counts *results;
+};
+
+/*
+ * What the worker threads share. Tasks are the chunks of all files in
+ * argument order; every worker takes the next task that nobody has taken
+ * yet. task_file maps a task number to its file.
+ */
+struct wc_pool {
+    struct wc_file    *files;
+    long              *task_file;
+    long              task_cnt;
+    long              next_task;
+    count_kernel      count_block;
+    struct wc_options options;
+    pthread_mutex_t   lock;
+    pthread_cond_t    file_done;
+};
+
+void wc(const char **, int, int, struct wc_options);
+void plan_file(struct wc_file *);
+void *count_worker(void *);
+void count_task(struct wc_pool *, struct wc_file *, long, unsigned char *);
+struct chunk_counts count_stream(int, struct wc_pool *, unsigned char *,
+                                 int *);
+struct chunk_counts count_range(int, off_t, off_t, struct wc_pool *,
+                                unsigned char *, int *);
+struct wc_state new_state(struct wc_options);
+struct chunk_counts finish_chunk(struct wc_state, int);
+struct chunk_counts merge_counts(struct chunk_counts, struct chunk_counts);
+struct wc_counts final_counts(struct chunk_counts);
+void print_counts(struct wc_counts, const char *, struct wc_options);
 int is_whitespace(int);
+count_kernel select_kernel(void);
+void count_scalar(const unsigned char *, size_t, struct wc_state *);
+#ifdef HAVE_X86_KERNELS
+void count_sse2(const unsigned char *, size_t, struct wc_state *);
+void count_avx2(const unsigned char *, size_t, struct wc_state *);
+#endif
 
-int main(int argc, const char *argv[])
+/*
+ * Counts newlines, words and bytes in the given files or stdin. Files are
+ * counted by a pool of threads (one per online CPU unless -j jobs is given),
+ * large regular files in several pieces at once. The counts are printed in
+ * argument order, followed by a total if there is more than one file.
+ *     -l, -w, -m, -c and -L select lines, words, characters, bytes and the
+ * length of the longest line. Without any of them, lines, words and bytes are
+ * printed. Everything is counted in the same pass over the data.
+ */
+int main(int argc, char *argv[])
 {
-    // If no command line argument is given, read from stdin
-    if (argc == 1) {
-        wc(stdin);
+    // Parse options
+    long job_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    if (job_cnt < 1 || job_cnt > MAX_JOBS) {
+        job_cnt = job_cnt < 1 ? 1 : MAX_JOBS;
+    }
+    struct wc_options options = { 0, 0, 0, 0, 0 };
+    int opt;
+    while ((opt = getopt(argc, argv, "j:lwmcL")) != -1) {
+        switch (opt) {
+        case 'j':
+            job_cnt = atoi(optarg);
+            if (job_cnt < 1 || job_cnt > MAX_JOBS) {
+                errx(ARG_ERROR, "Invalid number of jobs: %s", optarg);
+            }
+            break;
+        case 'l':
+            options.lines = 1;
+            break;
+        case 'w':
+            options.words = 1;
+            break;
+        case 'm':
+            options.chars = 1;
+            break;
+        case 'c':
+            options.bytes = 1;
+            break;
+        case 'L':
+            options.max_line = 1;
+            break;
+        default:
+            errx(ARG_ERROR, "Usage: wc [-lwmcL] [-j jobs] [file...]");
+        }
+    }
+    if (!options.lines && !options.words && !options.chars && !options.bytes
+            && !options.max_line) {
+        options.lines = options.words = options.bytes = 1;
+    }
+
+    // If no file is given, read from stdin
+    if (optind == argc) {
+        const char *no_name = NULL;
+        wc(&no_name, 1, job_cnt, options);
         return 0;
     }
 
-    // Otherwise open the given file (further arguments are ignored)
-    FILE *stream = fopen(argv[1], "r");
-    if (stream == NULL) {
-        err(ARG_ERROR, "Cannot open %s for reading", argv[1]);
+    // Otherwise count all given files
+    wc((const char **) argv + optind, argc - optind, job_cnt, options);
+
+    return 0;
+}
+
+/*
+ * Prints the number of newlines, words and bytes (or what options asks for)
+ * in each of the file_cnt files named in names, reading until EOF. A word is
+ * a sequence of bytes not containing a blank, a tab or a newline (following
+ * the K&R in this).
+ */
+void wc(const char **names, int file_cnt, int job_cnt,
+        struct wc_options options)
+{
+    /*
+     * Every file becomes one or more tasks, which job_cnt workers take in
+     * order. Meanwhile, this thread waits for the files to be finished one
+     * after another and prints their counts, so output starts before the
+     * last file is counted and its order never depends on timing.
+     */
+    struct wc_pool pool;
+    pool.files = malloc(file_cnt * sizeof(struct wc_file));
+    if (pool.files == NULL) {
+        err(INPUT_ERROR, "Cannot allocate memory for file list");
+    }
+
+    // Find out how many tasks each file needs
+    pool.task_cnt = 0;
+    for (int i = 0; i < file_cnt; ++i) {
+        pool.files[i].name = names[i];
+        plan_file(&pool.files[i]);
+        pool.files[i].first_task = pool.task_cnt;
+        pool.task_cnt += pool.files[i].chunk_cnt;
+    }
+
+    // Number the tasks
+    pool.task_file = malloc(pool.task_cnt * sizeof(long));
+    if (pool.task_file == NULL) {
+        err(INPUT_ERROR, "Cannot allocate memory for task list");
+    }
+    for (int i = 0; i < file_cnt; ++i) {
+        for (long c = 0; c < pool.files[i].chunk_cnt; ++c) {
+            pool.task_file[pool.files[i].first_task + c] = i;
+        }
     }
 
-    // Count
-    wc(stream);
+    pool.next_task   = 0;
+    pool.count_block = select_kernel();
+    pool.options     = options;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.file_done, NULL);
 
-    // Close the file
-    if (fclose(stream) == EOF) {
-        err(INPUT_ERROR, "Error closing file");
+    // Start the workers, but not more than there are tasks
+    if (job_cnt > pool.task_cnt) {
+        job_cnt = pool.task_cnt;
+    }
+    pthread_t workers[MAX_JOBS];
+    for (int i = 0; i < job_cnt; ++i) {
+        errno = pthread_create(&workers[i], NULL, count_worker, &pool);
+        if (errno != 0) {
+            err(INPUT_ERROR, "Cannot start worker thread");
+        }
     }
 
-    return 0;
+    // Print the counts for every file as soon as it and its predecessors
+    // are done
+    struct wc_counts total = { 0, 0, 0, 0, 0 };
+    for (int i = 0; i < file_cnt; ++i) {
+        struct wc_file *file = &pool.files[i];
+
+        pthread_mutex_lock(&pool.lock);
+        while (file->chunks_left > 0) {
+            pthread_cond_wait(&pool.file_done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        // Report errors in the same order as the counts
+        if (file->open_errno != 0) {
+            errno = file->open_errno;
+            err(ARG_ERROR, "Cannot open %s for reading", file->name);
+        }
+        if (file->read_errno != 0) {
+            errno = file->read_errno;
+            err(INPUT_ERROR, "Error in reading %s",
+                file->name != NULL ? file->name : "stdin");
+        }
+
+        // Glue the chunks together
+        struct chunk_counts file_chunks = file->results[0];
+        for (long c = 1; c < file->chunk_cnt; ++c) {
+            file_chunks = merge_counts(file_chunks, file->results[c]);
+        }
+        free(file->results);
+
+        struct wc_counts file_counts = final_counts(file_chunks);
+        print_counts(file_counts, file->name, options);
+
+        total.newline_cnt += file_counts.newline_cnt;
+        total.word_cnt    += file_counts.word_cnt;
+        total.char_cnt    += file_counts.char_cnt;
+        total.byte_cnt    += file_counts.byte_cnt;
+        if (file_counts.max_line_len > total.max_line_len) {
+            total.max_line_len = file_counts.max_line_len;
+        }
+    }
+
+    if (file_cnt > 1) {
+        print_counts(total, "total", options);
+    }
+
+    // Clean up
+    for (int i = 0; i < job_cnt; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool.file_done);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.task_file);
+    free(pool.files);
 }
 
 /*
- * Reads characters from *stream and prints the number of newlines, words and
- * bytes read until EOF. A word is a sequence of bytes not containing a blank,
- * a tab or a newline (following the K&R in this).
+ * Decide how *file is read. Only regular files can be split into chunks; if
+ * the file can't be examined, it is treated as a stream and the error shows
+ * up when the worker opens it.
  */
-void wc(FILE *stream)
+void plan_file(struct wc_file *file)
 {
-    int newline_cnt = 0;
-    int word_cnt    = 0;
-    int byte_cnt    = 0;
+    struct stat file_stat;
+    int stat_ret;
+    off_t start = 0;
+    if (file->name == NULL) {
+        // Start where stdin is (it may have been read from before)
+        stat_ret = fstat(STDIN_FILENO, &file_stat);
+        start    = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    }
+    else {
+        stat_ret = stat(file->name, &file_stat);
+    }
+
+    if (stat_ret == 0 && S_ISREG(file_stat.st_mode) && start != -1
+            && file_stat.st_size > start) {
+        file->is_stream = 0;
+        file->start     = start;
+        file->size      = file_stat.st_size - start;
+        file->chunk_cnt = (file->size + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    }
+    else {
+        file->is_stream = 1;
+        file->start     = 0;
+        file->size      = 0;
+        file->chunk_cnt = 1;
+    }
 
-    int in_word = 0;
+    file->chunks_left = file->chunk_cnt;
+    file->open_errno  = 0;
+    file->read_errno  = 0;
+    file->results     = malloc(file->chunk_cnt * sizeof(struct chunk_counts));
+    if (file->results == NULL) {
+        err(INPUT_ERROR, "Cannot allocate memory for chunk counts");
+    }
+}
 
-    // Read the stream character by character
-    int cur_char;
-    while ((cur_char = fgetc(stream)) != EOF) {
-        // Increment the number of bytes read for every character
-        ++byte_cnt;
+// Count tasks of the wc_pool at arg until there are none left
+void *count_worker(void *arg)
+{
+    struct wc_pool *pool = arg;
 
-        // Increment the number of newlines/lines read for every newline (!)
-        if (cur_char == '\n') {
-            ++newline_cnt;
+    unsigned char *buffer = malloc(BUFSIZE);
+    if (buffer == NULL) {
+        err(INPUT_ERROR, "Cannot allocate buffer");
+    }
+
+    while (1) {
+        // Take the next task
+        pthread_mutex_lock(&pool->lock);
+        long task_nr = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        if (task_nr >= pool->task_cnt) {
+            break;
         }
 
-        // If we haven't been in a word but encounter a word character now
-        if (!in_word && !is_whitespace(cur_char)) {
-            // Increment the number of words read
-            ++word_cnt;
+        struct wc_file *file = &pool->files[pool->task_file[task_nr]];
+        count_task(pool, file, task_nr - file->first_task, buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
 
-            // Say that we are in a word now
-            in_word = 1;
+// Count chunk chunk_nr of *file into its results and tell the printing
+// thread if that was the last one
+void count_task(struct wc_pool *pool, struct wc_file *file, long chunk_nr,
+                unsigned char *buffer)
+{
+    struct chunk_counts counts = finish_chunk(new_state(pool->options), 0);
+    int open_errno = 0;
+    int read_errno = 0;
+
+    // Every task opens the file on its own, so no descriptors are shared
+    int fd = STDIN_FILENO;
+    if (file->name != NULL) {
+        fd = open(file->name, O_RDONLY);
+        if (fd == -1) {
+            open_errno = errno;
+        }
+    }
+
+    if (fd != -1) {
+        if (file->is_stream) {
+            counts = count_stream(fd, pool, buffer, &read_errno);
+        }
+        else {
+            off_t offset = chunk_nr * (off_t) PARALLEL_CHUNK;
+            off_t length = file->size - offset < PARALLEL_CHUNK
+                           ? file->size - offset : PARALLEL_CHUNK;
+            counts = count_range(fd, file->start + offset, length, pool,
+                                 buffer, &read_errno);
         }
-        // Say that we aren't in a word if we are on whitespace
-        else if (is_whitespace(cur_char)) {
-            in_word = 0;
+
+        if (file->name != NULL) {
+            close(fd);
         }
     }
 
+    // Hand in the result
+    pthread_mutex_lock(&pool->lock);
+    file->results[chunk_nr] = counts;
+    if (open_errno != 0) {
+        file->open_errno = open_errno;
+    }
+    if (read_errno != 0) {
+        file->read_errno = read_errno;
+    }
+    if (--file->chunks_left == 0) {
+        pthread_cond_broadcast(&pool->file_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Count everything that can be read from fd. On a read error, *read_errno
+// is set.
+struct chunk_counts count_stream(int fd, struct wc_pool *pool,
+                                 unsigned char *buffer, int *read_errno)
+{
+    struct wc_state state = new_state(pool->options);
+    int starts_in_word = 0;
+
+    // Read the stream block by block and count in each block
+    ssize_t read_cnt;
+    while ((read_cnt = read(fd, buffer, BUFSIZE)) > 0) {
+        if (state.counts.byte_cnt == 0) {
+            starts_in_word = !is_whitespace(buffer[0]);
+        }
+        pool->count_block(buffer, read_cnt, &state);
+    }
+
     // Check whether our file walking ended abnormally
-    if (ferror(stream)) {
-        err(OUTPUT_ERROR, "Error in reading");
+    if (read_cnt == -1) {
+        *read_errno = errno;
+    }
+
+    return finish_chunk(state, starts_in_word);
+}
+
+// Count length bytes of fd from offset as if they were preceded by
+// whitespace. On a read error, *read_errno is set.
+struct chunk_counts count_range(int fd, off_t offset, off_t length,
+                                struct wc_pool *pool, unsigned char *buffer,
+                                int *read_errno)
+{
+    struct wc_state state = new_state(pool->options);
+    int starts_in_word = 0;
+
+    off_t end = offset + length;
+    while (offset < end) {
+        size_t want = end - offset < BUFSIZE ? end - offset : BUFSIZE;
+        ssize_t read_cnt = pread(fd, buffer, want, offset);
+        if (read_cnt <= 0) {
+            // A file that shrinks under us counts as a read error, too
+            *read_errno = read_cnt == 0 ? EIO : errno;
+            break;
+        }
+
+        if (state.counts.byte_cnt == 0) {
+            starts_in_word = !is_whitespace(buffer[0]);
+        }
+        pool->count_block(buffer, read_cnt, &state);
+        offset += read_cnt;
+    }
+
+    return finish_chunk(state, starts_in_word);
+}
+
+// Return the state for counting a new piece of data
+struct wc_state new_state(struct wc_options options)
+{
+    struct wc_state state = { { 0, 0, 0, 0, 0 }, 1, 0, 0, 0, 0, 0 };
+    state.want_chars    = options.chars;
+    state.want_max_line = options.max_line;
+
+    return state;
+}
+
+// Return the counts for a piece that was counted into state and whose first
+// byte is a word character if starts_in_word is set
+struct chunk_counts finish_chunk(struct wc_state state, int starts_in_word)
+{
+    struct chunk_counts counts;
+    counts.counts         = state.counts;
+    counts.starts_in_word = starts_in_word;
+    counts.ends_in_word   = !state.prev_ws;
+    counts.has_newline    = state.has_newline;
+    counts.first_line_len = state.has_newline ? state.first_line_len
+                                              : state.cur_line_len;
+    counts.last_line_len  = state.cur_line_len;
+
+    return counts;
+}
+
+/*
+ * Return the counts for the concatenation of the pieces counted in a and b.
+ * The operation is associative, so chunks can be merged in any grouping as
+ * long as their order is kept.
+ */
+struct chunk_counts merge_counts(struct chunk_counts a, struct chunk_counts b)
+{
+    // An empty piece changes nothing
+    if (a.counts.byte_cnt == 0) {
+        return b;
+    }
+    if (b.counts.byte_cnt == 0) {
+        return a;
+    }
+
+    struct chunk_counts sum;
+    sum.counts.newline_cnt = a.counts.newline_cnt + b.counts.newline_cnt;
+    sum.counts.word_cnt    = a.counts.word_cnt + b.counts.word_cnt;
+    sum.counts.char_cnt    = a.counts.char_cnt + b.counts.char_cnt;
+    sum.counts.byte_cnt    = a.counts.byte_cnt + b.counts.byte_cnt;
+    sum.starts_in_word     = a.starts_in_word;
+    sum.ends_in_word       = b.ends_in_word;
+
+    // A word running across the boundary was counted once in each piece
+    if (a.ends_in_word && b.starts_in_word) {
+        --sum.counts.word_cnt;
+    }
+
+    // The line running across the boundary is finished only if b has a
+    // newline
+    uint64_t joined_len = a.last_line_len + b.first_line_len;
+    sum.counts.max_line_len = a.counts.max_line_len;
+    if (b.has_newline) {
+        if (b.counts.max_line_len > sum.counts.max_line_len) {
+            sum.counts.max_line_len = b.counts.max_line_len;
+        }
+        if (joined_len > sum.counts.max_line_len) {
+            sum.counts.max_line_len = joined_len;
+        }
+    }
+    sum.has_newline    = a.has_newline || b.has_newline;
+    sum.first_line_len = a.has_newline ? a.first_line_len : joined_len;
+    sum.last_line_len  = b.has_newline ? b.last_line_len : joined_len;
+
+    return sum;
+}
+
+// Return the counts for a whole file from the merged counts of its chunks
+struct wc_counts final_counts(struct chunk_counts chunks)
+{
+    // A last line without newline is a line, too
+    if (chunks.last_line_len > chunks.counts.max_line_len) {
+        chunks.counts.max_line_len = chunks.last_line_len;
     }
 
-    // Print the summary of counts
-    printf("%6d %6d %6d\n", newline_cnt, word_cnt, byte_cnt);
+    return chunks.counts;
+}
+
+// Print one line of the counts selected in options, followed by name unless
+// it is NULL
+void print_counts(struct wc_counts counts, const char *name,
+                  struct wc_options options)
+{
+    const char *sep = "";
+    if (options.lines) {
+        printf("%s%6" PRIu64, sep, counts.newline_cnt);
+        sep = " ";
+    }
+    if (options.words) {
+        printf("%s%6" PRIu64, sep, counts.word_cnt);
+        sep = " ";
+    }
+    if (options.chars) {
+        printf("%s%6" PRIu64, sep, counts.char_cnt);
+        sep = " ";
+    }
+    if (options.bytes) {
+        printf("%s%6" PRIu64, sep, counts.byte_cnt);
+        sep = " ";
+    }
+    if (options.max_line) {
+        printf("%s%6" PRIu64, sep, counts.max_line_len);
+    }
+    if (name != NULL) {
+        printf(" %s", name);
+    }
+    putchar('\n');
 }
 
 /*
@@ -89,3 +616,203 @@ int is_whitespace(int character)
 
     return 0;
 }
+
+// Return the fastest counting kernel the CPU we're running on supports
+count_kernel select_kernel(void)
+{
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        return count_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return count_sse2;
+    }
+#endif
+
+    return count_scalar;
+}
+
+// Record the end of a line of line_len characters in *state
+static inline void end_line(struct wc_state *state, uint64_t line_len)
+{
+    if (!state->has_newline) {
+        state->first_line_len = line_len;
+        state->has_newline    = 1;
+    }
+    if (line_len > state->counts.max_line_len) {
+        state->counts.max_line_len = line_len;
+    }
+}
+
+// Count newlines, words and bytes in the length bytes at data byte by byte
+void count_scalar(const unsigned char *data, size_t length,
+                  struct wc_state *state)
+{
+    for (size_t i = 0; i < length; ++i) {
+        int cur_ws = is_whitespace(data[i]);
+
+        // Count every byte that isn't a UTF-8 continuation byte as character
+        int is_char = (data[i] & 0xc0) != 0x80;
+        state->counts.char_cnt += is_char;
+
+        // Increment the number of newlines/lines read for every newline (!)
+        if (data[i] == '\n') {
+            ++state->counts.newline_cnt;
+            end_line(state, state->cur_line_len);
+            state->cur_line_len = 0;
+        }
+        else {
+            state->cur_line_len += is_char;
+        }
+
+        // A word starts wherever a word character follows whitespace
+        if (state->prev_ws && !cur_ws) {
+            ++state->counts.word_cnt;
+        }
+
+        state->prev_ws = cur_ws;
+    }
+
+    state->counts.byte_cnt += length;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Add the counts for one 64-byte block to *state. Bit i of newline_mask is set
+ * if byte i is a newline, bit i of ws_mask if it is whitespace and bit i of
+ * char_mask if it starts a character. char_mask is only looked at if
+ * characters or line lengths are wanted.
+ */
+static inline void count_masks(uint64_t newline_mask, uint64_t ws_mask,
+                               uint64_t char_mask, struct wc_state *state)
+{
+    /*
+     * A byte starts a word if it isn't whitespace and the byte before it is.
+     * Shifting ws_mask left by one lines up every byte with its predecessor;
+     * the predecessor of byte 0 is the last byte of the previous block.
+     */
+    uint64_t prev_ws_mask = (ws_mask << 1) | (uint64_t) state->prev_ws;
+    uint64_t word_starts  = ~ws_mask & prev_ws_mask;
+
+    state->counts.newline_cnt += __builtin_popcountll(newline_mask);
+    state->counts.word_cnt    += __builtin_popcountll(word_starts);
+    state->counts.byte_cnt    += BLOCK_BYTES;
+    state->prev_ws             = ws_mask >> 63;
+
+    if (state->want_chars) {
+        state->counts.char_cnt += __builtin_popcountll(char_mask);
+    }
+
+    // Every newline ends a line that consists of the characters between it
+    // and the previous newline
+    if (state->want_max_line) {
+        int line_start = 0;
+        while (newline_mask != 0) {
+            int nl_pos = __builtin_ctzll(newline_mask);
+            uint64_t line_mask = char_mask & ((1ULL << nl_pos) - 1)
+                                 & (~0ULL << line_start);
+            end_line(state,
+                     state->cur_line_len + __builtin_popcountll(line_mask));
+
+            state->cur_line_len = 0;
+            line_start          = nl_pos + 1;
+            newline_mask       &= newline_mask - 1;
+        }
+        if (line_start < 64) {
+            state->cur_line_len
+                += __builtin_popcountll(char_mask & (~0ULL << line_start));
+        }
+    }
+}
+
+// Count with 16-byte SSE2 compares, four vectors per block
+__attribute__((target("sse2")))
+void count_sse2(const unsigned char *data, size_t length,
+                struct wc_state *state)
+{
+    const __m128i newline  = _mm_set1_epi8('\n');
+    const __m128i blank    = _mm_set1_epi8(' ');
+    const __m128i tab      = _mm_set1_epi8('\t');
+    const __m128i cont_max = _mm_set1_epi8(-64);
+        // Continuation bytes 0x80 to 0xbf are -128 to -65 as signed chars
+
+    size_t i = 0;
+    for (; i + BLOCK_BYTES <= length; i += BLOCK_BYTES) {
+        uint64_t newline_mask = 0;
+        uint64_t ws_mask      = 0;
+        uint64_t cont_mask    = 0;
+
+        for (int part = 0; part < 4; ++part) {
+            __m128i v    = _mm_loadu_si128((const __m128i *)
+                                           (data + i + 16 * part));
+            __m128i nl   = _mm_cmpeq_epi8(v, newline);
+            __m128i ws   = _mm_or_si128(
+                               nl,
+                               _mm_or_si128(_mm_cmpeq_epi8(v, blank),
+                                            _mm_cmpeq_epi8(v, tab))
+                           );
+            __m128i cont = _mm_cmplt_epi8(v, cont_max);
+
+            newline_mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(nl)
+                            << (16 * part);
+            ws_mask      |= (uint64_t) (uint16_t) _mm_movemask_epi8(ws)
+                            << (16 * part);
+            cont_mask    |= (uint64_t) (uint16_t) _mm_movemask_epi8(cont)
+                            << (16 * part);
+        }
+
+        count_masks(newline_mask, ws_mask, ~cont_mask, state);
+    }
+
+    // Count the rest that doesn't fill a block
+    count_scalar(data + i, length - i, state);
+}
+
+// Count with 32-byte AVX2 compares, two vectors per block
+__attribute__((target("avx2,popcnt,bmi")))
+void count_avx2(const unsigned char *data, size_t length,
+                struct wc_state *state)
+{
+    const __m256i newline  = _mm256_set1_epi8('\n');
+    const __m256i blank    = _mm256_set1_epi8(' ');
+    const __m256i tab      = _mm256_set1_epi8('\t');
+    const __m256i cont_max = _mm256_set1_epi8(-64);
+        // Continuation bytes 0x80 to 0xbf are -128 to -65 as signed chars
+
+    size_t i = 0;
+    for (; i + BLOCK_BYTES <= length; i += BLOCK_BYTES) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+
+        __m256i nl_lo   = _mm256_cmpeq_epi8(lo, newline);
+        __m256i nl_hi   = _mm256_cmpeq_epi8(hi, newline);
+        __m256i ws_lo   = _mm256_or_si256(
+                              nl_lo,
+                              _mm256_or_si256(_mm256_cmpeq_epi8(lo, blank),
+                                              _mm256_cmpeq_epi8(lo, tab))
+                          );
+        __m256i ws_hi   = _mm256_or_si256(
+                              nl_hi,
+                              _mm256_or_si256(_mm256_cmpeq_epi8(hi, blank),
+                                              _mm256_cmpeq_epi8(hi, tab))
+                          );
+        __m256i cont_lo = _mm256_cmpgt_epi8(cont_max, lo);
+        __m256i cont_hi = _mm256_cmpgt_epi8(cont_max, hi);
+
+        uint64_t newline_mask
+            = (uint32_t) _mm256_movemask_epi8(nl_lo)
+              | (uint64_t) (uint32_t) _mm256_movemask_epi8(nl_hi) << 32;
+        uint64_t ws_mask
+            = (uint32_t) _mm256_movemask_epi8(ws_lo)
+              | (uint64_t) (uint32_t) _mm256_movemask_epi8(ws_hi) << 32;
+        uint64_t cont_mask
+            = (uint32_t) _mm256_movemask_epi8(cont_lo)
+              | (uint64_t) (uint32_t) _mm256_movemask_epi8(cont_hi) << 32;
+
+        count_masks(newline_mask, ws_mask, ~cont_mask, state);
+    }
+
+    // Count the rest that doesn't fill a block
+    count_scalar(data + i, length - i, state);
+}
+#endif
@@ -1,511 +1,892 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <string.h>
 #include "errors.h"
+#include "libfat.h"
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
-#define IMG_NAME "drive.img"
 #define PATH_DELIM '/'
-#define DIR_ENT_BYTES 32
-#define NO_SUCH_ENTRY 0
-#define NAME_BYTES 12
-#define NO_MORE_ENTRIES_ATTR 0x00
-#define NO_MORE_ENTRIES_FCL 0
-    // Note that these values shouldn't be negative
-
-struct fat_info {
-    u_int16_t BytsPerSec;
-    u_int8_t  SecPerClus;
-    u_int16_t RsvdSecCnt;
-    u_int8_t  NumFATs;
-    u_int16_t RootEntCnt;
-    u_int32_t fat_size;
-    u_int32_t first_root_dir_sec_num;
-    u_int32_t first_data_sector;
-    u_int16_t dir_ents_per_cluster;
-    FILE      *fs_img;
-};
+#define MAX_JOBS 256
+#define RECORD_BUFFER_BYTES (64 * 1024)
+    // Records are written out once a worker has collected this many bytes
+#define USAGE "Usage: drive-ls [-i image] [-R] [-j jobs] [path...]\n" \
+              "       drive-ls [-i image] -x file...\n" \
+              "       drive-ls [-i image] -a [-j jobs]\n" \
+              "       drive-ls -b [-j jobs] [image...]"
 
-struct fat_dir_info {
-    char      name[NAME_BYTES];
-    u_int8_t  Attr;
-    u_int16_t FstClusLO;
+/*
+ * What the analysis of an image collects. owned has a bit for every cluster
+ * that belongs to a file or directory. free_runs[i] counts the runs of free
+ * clusters that are at least 2^i and less than 2^(i+1) long.
+ */
+struct analysis {
+    struct fat_info     *fs_info;
+    struct fat_geometry geometry;
+    u_int64_t           *owned;
+    u_int64_t           file_cnt;
+    u_int64_t           dir_cnt;
+    u_int64_t           owned_cnt;
+    u_int64_t           cross_linked_cnt;
+    u_int64_t           bad_size_cnt;
+    u_int64_t           fragmented_cnt;
+    u_int64_t           scored_cnt;
+    double              score_sum;
+    u_int64_t           free_cnt;
+    u_int64_t           bad_cnt;
+    u_int64_t           lost_chain_cnt;
+    u_int64_t           lost_cnt;
+    u_int64_t           free_runs[32];
+    u_int64_t           free_run_clusters[32];
 };
 
-struct dir_entry_iterator_state {
-    // Indicates whether we're traversing the root directory or not
-    u_int8_t is_root_dir;
-
-    // The maximum number of directory entries in this cluster (or root dir)
-    u_int16_t max_entry_cnt;
-
-    // The number of the current cluster (or -1 for root directory)
-    u_int16_t cluster_nr;
+// A piece of text that grows as needed
+struct text {
+    char   *data;
+    size_t length;
+    size_t capacity;
+};
 
-    // The byte offset of the start of the current cluster (or root directory)
-    u_int32_t cluster_offset;
+// The images of a batch and what the workers scanning them share
+struct batch {
+    char            **images;
+    size_t          image_cnt;
+    size_t          next_image_nr;
+    int             status;
+    pthread_mutex_t lock;
 
-    // The number of the entry examined last in the cluster
-    u_int16_t entry_nr;
+    // Held while a worker writes its records to stdout
+    pthread_mutex_t output_lock;
+};
 
-    // The entry at entry_nr
-    struct fat_dir_info cur_entry;
+// A thread of the batch pool with the records it hasn't written yet, and
+// the escaped image name and path of the entry it is at
+struct batch_worker {
+    pthread_t    thread;
+    struct batch *batch;
+    struct text  records;
+    struct text  image;
+    struct text  path;
 };
 
-void ls(struct fat_info, u_int32_t, char *);
-u_int32_t find_path_sec_num(struct fat_info, u_int32_t, char *);
-struct dir_entry_iterator_state new_dir_entry_iterator(struct fat_info,
-                                                       u_int32_t);
-struct fat_dir_info next_dir_entry(struct fat_info,
-        struct dir_entry_iterator_state *);
-u_int32_t cluster_to_sec(struct fat_info, u_int16_t);
-u_int32_t sec_to_offset(struct fat_info, u_int32_t);
-int is_no_more_entries(struct fat_dir_info);
-struct fat_dir_info no_more_entries();
-u_int16_t get_next_cluster_nr(struct fat_info, u_int16_t);
-int is_eoc(u_int16_t);
-struct fat_dir_info read_dir_entry(FILE *, long);
-void sprint_filename(char *, char *);
-int name_equals(char *, char *);
-u_int8_t read_8(FILE *, long);
-u_int16_t read_16(FILE *, long);
-u_int32_t read_32(FILE *, long);
-int is_directory(struct fat_dir_info);
+int ls(struct fat_info *, u_int32_t);
+int print_entry(const struct fat_dir_info *, void *);
+void list_tree(struct fat_info *, u_int32_t, int);
+u_int64_t print_tree(struct tree_node *, char **, size_t *, size_t);
+int analyse(struct fat_info *, int);
+void analyse_tree(struct analysis *, struct tree_node *, char **, size_t *,
+                  size_t);
+u_int32_t claim_chain(struct analysis *, u_int32_t, u_int32_t *, u_int32_t *);
+void count_free_runs(struct analysis *);
+int is_lost(struct analysis *, u_int32_t);
+int test_bit(const u_int64_t *, u_int32_t);
+void set_bit(u_int64_t *, u_int32_t);
+int scan_batch(char **, size_t, int);
+void *batch_worker(void *);
+int scan_image(struct batch_worker *, const char *);
+void add_records(struct batch_worker *, const struct fat_info *,
+                 const struct tree_node *);
+void flush_records(struct batch_worker *);
+char **read_image_list(FILE *, size_t *);
+void append_text(struct text *, const char *, size_t);
+void append_escaped(struct text *, const char *);
 
 /*
- * Path names must be given in the form BLA1/BLA2/BLA3/ with uppercase letters
- * and trailing slash. No argument asks for printing the root directory.
+ * Lists the directories given as paths of the form BLA1/BLA2/BLA3/, in which
+ * case doesn't matter and the slashes at the ends are optional. No argument
+ * asks for printing the root directory. Options:
+ *     -i image read the filesystem from image (default: drive.img in the
+ *              current directory)
+ *     -R       list the whole tree below the directory, with the total size
+ *              of each subdirectory, like du -a
+ *     -j jobs  read directories with jobs threads for -R (default: one per
+ *              processor)
+ *     -x       write the contents of the files given as paths to stdout
+ *              instead of listing directories
+ *     -a       check the whole image for lost and cross-linked clusters and
+ *              report free space and fragmentation; exits with
+ *              INCONSISTENT_ERR if the image has errors
+ *     -b       scan the images given as arguments, or read one path per line
+ *              from stdin if there are none, with jobs threads, and print a
+ *              record for every file and directory in them (see scan_batch)
  */
 int main(int argc, char *argv[])
 {
-    // Open the filesystem image
-    FILE *fs_img = fopen(IMG_NAME, "r");
-    if (fs_img == NULL) {
-        err(INPUT_ERR, "Cannot open %s for reading", IMG_NAME);
+    // Parse options
+    const char *image_path = NULL;
+    int recursive  = 0;
+    int extracting = 0;
+    int analysing  = 0;
+    int batching   = 0;
+    long job_cnt   = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "i:Rj:xab")) != -1) {
+        switch (opt) {
+        case 'i':
+            image_path = optarg;
+            break;
+        case 'b':
+            batching = 1;
+            break;
+        case 'R':
+            recursive = 1;
+            break;
+        case 'x':
+            extracting = 1;
+            break;
+        case 'a':
+            analysing = 1;
+            break;
+        case 'j': {
+            char *end;
+            job_cnt = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || job_cnt < 1
+                    || job_cnt > MAX_JOBS) {
+                errx(ARG_ERR, "Invalid number of jobs: %s", optarg);
+            }
+            break;
+        }
+        default:
+            errx(ARG_ERR, USAGE);
+        }
     }
-
-    // Read the necessary filesystem information
-    struct fat_info fs_info;
-    fs_info.BytsPerSec = read_16(fs_img, 11);
-    fs_info.SecPerClus = read_8( fs_img, 13);
-    fs_info.RsvdSecCnt = read_16(fs_img, 14);
-    fs_info.NumFATs    = read_8( fs_img, 16);
-    fs_info.RootEntCnt = read_16(fs_img, 17);
-
-    // Determine the size of one FAT
-    u_int16_t fatsz_16 = read_16(fs_img, 22);
-    if (fatsz_16 != 0) {
-        fs_info.fat_size = (u_int32_t) fatsz_16;
+    if ((extracting && (recursive || analysing || optind == argc))
+            || (analysing && (recursive || optind < argc))
+            || (batching && (recursive || extracting || analysing
+                             || image_path != NULL))) {
+        errx(ARG_ERR, USAGE);
     }
-    else {
-        fs_info.fat_size = read_32(fs_img, 32);
+    if (job_cnt < 1) {
+        job_cnt = 1;
+    }
+    else if (job_cnt > MAX_JOBS) {
+        job_cnt = MAX_JOBS;
     }
 
-    // Calculate the number of the first sector of the root directory
-    int root_dir_sectors = (
-                             (fs_info.RootEntCnt * 32)
-                             + (fs_info.BytsPerSec - 1)
-                           ) / fs_info.BytsPerSec;
-    fs_info.first_root_dir_sec_num
-        = fs_info.RsvdSecCnt + (fs_info.NumFATs * fs_info.fat_size);
-
-    // Calculate the number of the first data sector
-    fs_info.first_data_sector
-        = fs_info.first_root_dir_sec_num + root_dir_sectors;
-
-    // Calculate the maximum number of directory entries per cluster
-    fs_info.dir_ents_per_cluster
-        = fs_info.BytsPerSec * fs_info.SecPerClus / DIR_ENT_BYTES;
+    // Scan many images instead of looking into one if asked to
+    if (batching) {
+        if (optind < argc) {
+            return scan_batch(argv + optind, argc - optind, job_cnt);
+        }
+        size_t image_cnt;
+        char **images = read_image_list(stdin, &image_cnt);
+        int status = scan_batch(images, image_cnt, job_cnt);
+        for (size_t i = 0; i < image_cnt; ++i) {
+            free(images[i]);
+        }
+        free(images);
+        return status;
+    }
 
-    // List the specified directory's contents
-    fs_info.fs_img = fs_img;
-    if (argc == 1) {
-        ls(fs_info, fs_info.first_root_dir_sec_num , "");
+    // Open the filesystem image
+    if (image_path == NULL) {
+        image_path = FAT_DEFAULT_IMAGE;
     }
-    else {
-        ls(fs_info, fs_info.first_root_dir_sec_num , argv[1]);
+    struct fat_info *fs_info = fat_open(image_path);
+    if (fs_info == NULL) {
+        return INPUT_ERR;
     }
+    struct fat_geometry geometry;
+    fat_get_geometry(fs_info, &geometry);
 
-    return 0;
-}
-
-/*
- * List the contents of the specified directory relative to the directory with
- * the specified sector number.
- */
-void ls(struct fat_info fs_info, u_int32_t sec_num, char *path)
-{
-    /*
-     * sec_num is the sector number of the "current working directory". A call
-     * to this subroutine is the same as "ls path" in that directory.
-     * Execution is recursive.
-     *
-     * Let sec_num point to some directory and path = bla1/bla2/bla3/.
-     * This subroutine chops off the first part of path, thus
-     *     sub_path = bla2/bla3/
-     *     path     = bla1.
-     * Then it finds the sector where bla1 (which contains bla2/bla3) starts.
-     * That is path_sec_num. With these information it calls ls recursively.
-     *
-     * Now sec_num, being path_sec_num points to bla1 and path = bla2/bla3/.
-     * It chops off the first part again, thus
-     *     sub_path = bla3/
-     *     path     = bla2.
-     * It finds the sector where bla2 starts and stores it in path_sec_num.
-     * Recursion, again.
-     *
-     * Now sec_num points to bla2 and path = bla3/. Chopping yields
-     *     sub_path = (empty)
-     *     path     = bla3.
-     * It finds the sector where bla3 starts. There the recursive call to ls
-     * looks for (empty). This is the anchor of recursion and the contents of
-     * that directory are printed.
-     */
+    // Check the image if asked to
+    int status = 0;
+    if (analysing) {
+        status = analyse(fs_info, job_cnt);
+    }
 
-    // List contents of directory at sec_num if nothing is left as path
-    if (strlen(path) == 0) {
-        // Initialise the iterator for directory entries
-        struct dir_entry_iterator_state dit_state
-            = new_dir_entry_iterator(fs_info, sec_num);
-
-        // Go through the directory entries
-        while (1) {
-            struct fat_dir_info entry = next_dir_entry(fs_info, &dit_state);
-            if (is_no_more_entries(entry)) {
-                break;
+    // Write out the specified files if asked to
+    else if (extracting) {
+        for (int i = optind; status == 0 && i < argc; ++i) {
+            struct fat_dir_info entry;
+            status = fat_find_file(fs_info, argv[i], &entry);
+            if (status == 0) {
+                status = fat_extract(fs_info, entry, STDOUT_FILENO, argv[i]);
             }
+        }
+    }
 
-            // Print them
-            char pretty_name[NAME_BYTES + 1];
-            sprint_filename(pretty_name, entry.name);
-            puts(pretty_name);
+    // List the root directory if no path is given
+    else if (optind == argc) {
+        if (recursive) {
+            list_tree(fs_info, geometry.root_cluster_nr, job_cnt);
+        }
+        else {
+            status = ls(fs_info, geometry.root_cluster_nr);
         }
     }
-    // Go one level down the directory hierarchy
-    else {
-        // Chop the name of the directory at sec_num off the path
-        char *sub_path = strchr(path, PATH_DELIM);
-        *sub_path = '\0';
-        ++sub_path;  // Look above for the effects of this
 
-        // Find the directory entry with that name in the directory at sec_num
-        u_int32_t path_sec_num = find_path_sec_num(fs_info, sec_num, path);
-            // path contains only the first part of the argument path now
-        if (path_sec_num == NO_SUCH_ENTRY) {
-            errx(NOT_FOUND_ERR, "There is no entry with name %s", path);
+    // Otherwise find the specified directories and list their contents, each
+    // under its name if there are several
+    for (int i = optind; !extracting && !analysing && i < argc; ++i) {
+        u_int32_t cluster_nr;
+        status = fat_find_dir(fs_info, argv[i], &cluster_nr);
+        if (status != 0) {
+            break;
+        }
+        if (argc - optind > 1) {
+            printf("%s%s:\n", i > optind ? "\n" : "", argv[i]);
         }
 
-        // List the contents of sub_path relative to the subdirectory
-        ls(fs_info, path_sec_num, sub_path);
+        if (recursive) {
+            list_tree(fs_info, cluster_nr, job_cnt);
+        }
+        else {
+            status = ls(fs_info, cluster_nr);
+        }
     }
 
-    return;
+    fat_close(fs_info);
+    return status;
 }
 
-// Search in the directory at sec_num for the entry with name name and return
-// the number of the sector where it starts
-u_int32_t find_path_sec_num(struct fat_info fs_info, u_int32_t sec_num,
-                            char *name)
+// Print the names of the entries of the directory at cluster_nr
+int ls(struct fat_info *fs_info, u_int32_t cluster_nr)
 {
-    // Initialise the iterator for directory entries
-    struct dir_entry_iterator_state dit_state
-        = new_dir_entry_iterator(fs_info, sec_num);
-
-    // Go through the directory entries
-    struct fat_dir_info entry;
-    while (! is_no_more_entries(entry = next_dir_entry(fs_info, &dit_state))) {
-        // Skip non-directories
-        if (!is_directory(entry)) {
-            continue;
-        }
+    return fat_read_dir(fs_info, cluster_nr, print_entry, NULL);
+}
 
-        // Return the indicated sector number if we have found the right entry
-        if (name_equals(entry.name, name)) {
-            return cluster_to_sec(fs_info, entry.FstClusLO);
-        }
+// Print the name of a directory entry for ls
+int print_entry(const struct fat_dir_info *entry, void *arg)
+{
+    char pretty_name[FAT_NAME_BYTES + 1];
+    if (puts(fat_display_name(*entry, pretty_name)) == EOF) {
+        err(OUTPUT_ERR, "Cannot write to stdout");
     }
 
-    // Return failure if there are no more entries
-    return NO_SUCH_ENTRY;
+    return 0;
 }
 
-// Construct an iterator for traversing a directory. The start of the
-// directory is indicated by sec_num, which must be the number of first sector
-// of a cluster.
-struct dir_entry_iterator_state new_dir_entry_iterator(
-        struct fat_info fs_info, u_int32_t sec_num)
+/*
+ * Print every file and directory below the directory at cluster_nr with its
+ * size, like du -a: the entries of each directory sorted by name, and every
+ * directory after its contents with the total size of the files in it. The
+ * directories are read by job_cnt threads.
+ */
+void list_tree(struct fat_info *fs_info, u_int32_t cluster_nr, int job_cnt)
 {
-    struct dir_entry_iterator_state dit_state;
-
-    // Set some values depending on whether we're in the root directory or not
-    if (sec_num == fs_info.first_root_dir_sec_num) {
-        dit_state.is_root_dir   = 1;
-        dit_state.max_entry_cnt = fs_info.RootEntCnt;
-        dit_state.cluster_nr    = -1;
+    // The tree is only printed when all of it has been read, since the
+    // totals have to be known by then anyway
+    struct tree_node root;
+    fat_read_tree(fs_info, cluster_nr, job_cnt, &root);
+
+    // Print it
+    size_t path_capacity = 256;
+    char *path = malloc(path_capacity);
+    if (path == NULL) {
+        err(INPUT_ERR, "Cannot allocate path buffer");
     }
-    else {
-        dit_state.is_root_dir   = 0;
-        dit_state.max_entry_cnt = fs_info.dir_ents_per_cluster;
-        dit_state.cluster_nr    = (sec_num - fs_info.first_data_sector)
-                                  / fs_info.SecPerClus + 2;
+    strcpy(path, ".");
+    print_tree(&root, &path, &path_capacity, 1);
+    if (fflush(stdout) == EOF) {
+        err(OUTPUT_ERR, "Cannot write to stdout");
     }
 
-    dit_state.cluster_offset = sec_to_offset(fs_info, sec_num);
-    dit_state.entry_nr       = -1;
-        // See above for descriptions of the struct's fields
-
-    return dit_state;
+    free(path);
+    fat_free_tree(&root);
 }
 
-// Look whether there are more entries in the traversed directory.
-struct fat_dir_info next_dir_entry(struct fat_info fs_info,
-                                   struct dir_entry_iterator_state *dit_state)
+/*
+ * Print the subtree at node in du -a order and return its total size. The
+ * path of node, path_length bytes long, is in *path, a buffer of
+ * *path_capacity bytes that grows as needed.
+ */
+u_int64_t print_tree(struct tree_node *node, char **path,
+                     size_t *path_capacity, size_t path_length)
 {
-    // Increment entry number
-    ++(dit_state->entry_nr);
-
-    // Check whether we're at the end of a directory
-    if (dit_state->entry_nr == dit_state->max_entry_cnt) {
-        // We have no more entries if we're at the end of the root directory
-        if (dit_state->is_root_dir) {
-            return no_more_entries();
-        }
+    if (!fat_is_directory(node->entry)) {
+        node->total = node->entry.FileSize;
+    }
+    else {
+        node->total = 0;
+        for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+            struct tree_node *child = &node->children[i];
+
+            // Append "/name" to the path
+            size_t child_length = path_length + 1 + strlen(child->name);
+            if (child_length + 1 > *path_capacity) {
+                *path_capacity = 2 * (child_length + 1);
+                *path = realloc(*path, *path_capacity);
+                if (*path == NULL) {
+                    err(INPUT_ERR, "Cannot allocate path buffer");
+                }
+            }
+            (*path)[path_length] = PATH_DELIM;
+            strcpy(*path + path_length + 1, child->name);
 
-        // Otherwise go to the next cluster in the chain if it exists
-        u_int16_t next_cluster_nr
-            = get_next_cluster_nr(fs_info, dit_state->cluster_nr);
-        if (is_eoc(next_cluster_nr)) {
-            return no_more_entries();
-        }
-        else {
-            dit_state->cluster_nr = next_cluster_nr;
-            dit_state->cluster_offset
-                = cluster_to_sec(fs_info, next_cluster_nr);
-            dit_state->entry_nr   = -1;
+            node->total += print_tree(child, path, path_capacity,
+                                      child_length);
         }
+        (*path)[path_length] = '\0';
     }
 
-    // Calculate the offset of the start of the directory
-    long offset = dit_state->cluster_offset
-                  + dit_state->entry_nr * DIR_ENT_BYTES;
+    if (printf("%llu\t%s\n", (unsigned long long) node->total, *path) < 0) {
+        err(OUTPUT_ERR, "Cannot write to stdout");
+    }
+    return node->total;
+}
 
-    // If we're in the root directory, skip the entry if its the VOLUME_ID one
-    if ((read_8(fs_info.fs_img, offset + 11) & 0x08) != 0) {
-        return next_dir_entry(fs_info, dit_state);
+/*
+ * Check the whole image and print a report. Returns INCONSISTENT_ERR if there
+ * are lost or cross-linked clusters or files whose chain doesn't fit their
+ * size, and 0 otherwise.
+ */
+int analyse(struct fat_info *fs_info, int job_cnt)
+{
+    /*
+     * Everything is linear in the size of the image:
+     *     1. The directory tree is read, in parallel like for -R.
+     *     2. It is walked in order, and each file or directory claims the
+     *        clusters of its chain in the owned bitset. A chain that runs into
+     *        a cluster claimed before is cross-linked (or loops).
+     *     3. One pass over the FAT finds the free runs, and the allocated
+     *        clusters nobody claimed, which make up the lost chains.
+     */
+    struct analysis analysis;
+    memset(&analysis, 0, sizeof(analysis));
+    analysis.fs_info = fs_info;
+    fat_get_geometry(fs_info, &analysis.geometry);
+    struct fat_geometry geometry = analysis.geometry;
+    analysis.owned = calloc((geometry.cluster_cnt + 2 + 63) / 64,
+                            sizeof(u_int64_t));
+    if (analysis.owned == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster bitset");
     }
 
-    // Read in the current directory entry
-    struct fat_dir_info cur_entry = read_dir_entry(fs_info.fs_img, offset);
+    struct tree_node root;
+    fat_read_tree(fs_info, geometry.root_cluster_nr, job_cnt, &root);
 
-    // Stop if we are at a last directory entry
-    if (*(cur_entry.name) == 0x00) {
-        --(dit_state->entry_nr);
-            // So that we're at the same entry in the next call
-        return no_more_entries();
+    // The root directory of FAT32 has a chain like any other
+    if (geometry.type == FAT32) {
+        u_int32_t cluster_cnt, fragment_cnt;
+        u_int32_t taken = claim_chain(&analysis, geometry.root_cluster_nr,
+                                      &cluster_cnt, &fragment_cnt);
+        if (taken != 0) {
+            printf("cross-linked: . loops back to cluster %u\n", taken);
+        }
     }
 
-    // Skip the entry if it is empty
-    if (*(cur_entry.name) == 0xe5) {
-        return next_dir_entry(fs_info, dit_state);
+    size_t path_capacity = 256;
+    char *path = malloc(path_capacity);
+    if (path == NULL) {
+        err(INPUT_ERR, "Cannot allocate path buffer");
+    }
+    strcpy(path, ".");
+    analyse_tree(&analysis, &root, &path, &path_capacity, 1);
+    free(path);
+    fat_free_tree(&root);
+
+    count_free_runs(&analysis);
+
+    // Print the summary
+    printf("FAT%d, %u clusters of %u bytes\n", geometry.type,
+           geometry.cluster_cnt, geometry.cluster_bytes);
+    printf("%llu directories, %llu files\n",
+           (unsigned long long) analysis.dir_cnt,
+           (unsigned long long) analysis.file_cnt);
+    printf("%llu clusters in use, %llu free, %llu bad\n",
+           (unsigned long long) analysis.owned_cnt,
+           (unsigned long long) analysis.free_cnt,
+           (unsigned long long) analysis.bad_cnt);
+    printf("%llu lost chains with %llu clusters\n",
+           (unsigned long long) analysis.lost_chain_cnt,
+           (unsigned long long) analysis.lost_cnt);
+    printf("%llu cross-linked chains\n",
+           (unsigned long long) analysis.cross_linked_cnt);
+    printf("%llu files with a size that doesn't fit their chain\n",
+           (unsigned long long) analysis.bad_size_cnt);
+    printf("%llu fragmented files, average fragmentation %.3f\n",
+           (unsigned long long) analysis.fragmented_cnt,
+           analysis.scored_cnt > 0
+           ? analysis.score_sum / analysis.scored_cnt : 0.0);
+    printf("free runs:\n");
+    for (int i = 0; i < 32; ++i) {
+        if (analysis.free_runs[i] > 0) {
+            printf("%10llu - %10llu clusters: %10llu runs, %10llu clusters\n",
+                   1ULL << i, (2ULL << i) - 1,
+                   (unsigned long long) analysis.free_runs[i],
+                   (unsigned long long) analysis.free_run_clusters[i]);
+        }
+    }
+    if (fflush(stdout) == EOF) {
+        err(OUTPUT_ERR, "Cannot write to stdout");
     }
 
-    return cur_entry;
+    free(analysis.owned);
+    if (analysis.lost_cnt > 0 || analysis.cross_linked_cnt > 0
+            || analysis.bad_size_cnt > 0) {
+        return INCONSISTENT_ERR;
+    }
+    return 0;
 }
 
-// Return the number of the first sector of the specified cluster number
-u_int32_t cluster_to_sec(struct fat_info fs_info, u_int16_t cluster_nr)
+/*
+ * Claim the chains of node and everything below it, in the same order as
+ * -R prints them, and report problems with them. The path of node,
+ * path_length bytes long, is in *path, a buffer of *path_capacity bytes.
+ */
+void analyse_tree(struct analysis *analysis, struct tree_node *node,
+                  char **path, size_t *path_capacity, size_t path_length)
 {
-    // Cluster number 0 indicates root directory
-    if (cluster_nr == 0) {
-        return fs_info.first_root_dir_sec_num;
-    }
+    struct fat_info *fs_info = analysis->fs_info;
+
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        struct tree_node *child = &node->children[i];
+
+        // Append "/name" to the path
+        size_t child_length = path_length + 1 + strlen(child->name);
+        if (child_length + 1 > *path_capacity) {
+            *path_capacity = 2 * (child_length + 1);
+            *path = realloc(*path, *path_capacity);
+            if (*path == NULL) {
+                err(INPUT_ERR, "Cannot allocate path buffer");
+            }
+        }
+        (*path)[path_length] = PATH_DELIM;
+        strcpy(*path + path_length + 1, child->name);
+
+        // Claim its clusters
+        u_int32_t cluster_cnt, fragment_cnt;
+        u_int32_t first = fat_first_cluster(fs_info, child->entry);
+        u_int32_t taken = claim_chain(analysis, first, &cluster_cnt,
+                                      &fragment_cnt);
+        if (taken != 0) {
+            printf("cross-linked: %s runs into cluster %u, which is already "
+                   "in use\n", *path, taken);
+        }
 
-    return (cluster_nr - 2) * fs_info.SecPerClus + fs_info.first_data_sector;
-}
+        if (fat_is_directory(child->entry)) {
+            ++(analysis->dir_cnt);
+            analyse_tree(analysis, child, path, path_capacity, child_length);
+        }
+        else {
+            ++(analysis->file_cnt);
+
+            // The chain has to be just long enough for the size. That of a
+            // cross-linked file is cut short, which has been reported already
+            u_int64_t cluster_bytes = analysis->geometry.cluster_bytes;
+            u_int64_t needed = (child->entry.FileSize + cluster_bytes - 1)
+                               / cluster_bytes;
+            if (taken == 0 && needed != cluster_cnt) {
+                printf("size mismatch: %s has %u bytes in %u clusters\n",
+                       *path, child->entry.FileSize, cluster_cnt);
+                ++(analysis->bad_size_cnt);
+            }
 
-// Return the byte offset of the specified sector number
-u_int32_t sec_to_offset(struct fat_info fs_info, u_int32_t sec_nr)
-{
-    return sec_nr * fs_info.BytsPerSec;
+            // 0 means contiguous and 1 that no two clusters are adjacent
+            if (cluster_cnt > 1) {
+                double score = (double) (fragment_cnt - 1) / (cluster_cnt - 1);
+                analysis->score_sum += score;
+                ++(analysis->scored_cnt);
+                if (fragment_cnt > 1) {
+                    printf("fragmented: %s has %u fragments in %u clusters "
+                           "(%.3f)\n", *path, fragment_cnt, cluster_cnt,
+                           score);
+                    ++(analysis->fragmented_cnt);
+                }
+            }
+        }
+    }
+    (*path)[path_length] = '\0';
 }
 
-// Generate return value for exhausted directory iterator
-struct fat_dir_info no_more_entries()
+/*
+ * Mark the clusters of the chain starting at first as owned, counting them
+ * and the runs of consecutive clusters they form. Stops at the first cluster
+ * that is already owned and returns its number in that case, and 0 otherwise.
+ */
+u_int32_t claim_chain(struct analysis *analysis, u_int32_t first,
+                u_int32_t *cluster_cnt, u_int32_t *fragment_cnt)
 {
-    struct fat_dir_info nme;
-    nme.Attr      = NO_MORE_ENTRIES_ATTR;
-    nme.FstClusLO = NO_MORE_ENTRIES_FCL;
-    return nme;
-}
+    struct fat_info *fs_info = analysis->fs_info;
+    *cluster_cnt  = 0;
+    *fragment_cnt = 0;
+
+    u_int32_t cluster_nr = first, previous = 0;
+    while (!fat_is_eoc(fs_info, cluster_nr)) {
+        if (test_bit(analysis->owned, cluster_nr)) {
+            ++(analysis->cross_linked_cnt);
+            return cluster_nr;
+        }
+        set_bit(analysis->owned, cluster_nr);
+        ++(analysis->owned_cnt);
 
-// Check whether the specified entry indicates an exhausted iterator
-int is_no_more_entries(struct fat_dir_info dir_info)
-{
-    if (dir_info.Attr == NO_MORE_ENTRIES_ATTR
-            && dir_info.FstClusLO == NO_MORE_ENTRIES_FCL) {
-        return 1;
+        ++(*cluster_cnt);
+        if (cluster_nr != previous + 1) {
+            ++(*fragment_cnt);
+        }
+        previous   = cluster_nr;
+        cluster_nr = fat_next_cluster(fs_info, cluster_nr);
     }
 
     return 0;
 }
 
-// Convert a filename from the FAT format to a *.* format
-void sprint_filename(char *out_name, char *in_name)
+/*
+ * Go through the FAT once, counting free and bad clusters and sorting the
+ * runs of free clusters into the histogram. Allocated clusters that no file
+ * or directory owns are lost; a lost cluster that no other lost cluster
+ * points to starts a lost chain, and so does a loop of lost clusters, which
+ * has no such cluster.
+ */
+void count_free_runs(struct analysis *analysis)
 {
-    /*
-     * Let in_name be "PICKLE__A__" (_ indicate blanks).
-     * First we clean out out_name, so that it is "0000000000000".
-     * Then we copy over the first part, so that out_name is "PICKLE__00000"
-     * now. We place a dot and the extension at the end of it: "PICKLE.A__000"
-     * Last, we remove trailing whitespace: "PICKLE.A0_000".
-     */
+    struct fat_info *fs_info = analysis->fs_info;
+    enum fat_type type = analysis->geometry.type;
+    u_int32_t bad_mark = type == FAT12 ? 0xff7
+                         : type == FAT16 ? 0xfff7 : 0x0ffffff7;
+    u_int32_t end = analysis->geometry.cluster_cnt + 2;
+
+    u_int64_t *has_predecessor = calloc((end + 63) / 64, sizeof(u_int64_t));
+    if (has_predecessor == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster bitset");
+    }
 
-    // Clean the output name
-    memset(out_name, 0, NAME_BYTES);
+    u_int32_t run_length = 0;
+    for (u_int32_t cluster_nr = 2; cluster_nr <= end; ++cluster_nr) {
+        u_int32_t entry = cluster_nr < end
+                          ? fat_next_cluster(fs_info, cluster_nr) : 1;
+            // The sentinel after the last cluster ends the last run
 
-    // Copy the first part of the FAT name into the ouput
-    strncpy(out_name, in_name, 8);
+        if (entry == 0) {
+            ++(analysis->free_cnt);
+            ++run_length;
+            continue;
+        }
+        if (run_length > 0) {
+            int bin = 31 - __builtin_clz(run_length);
+            ++(analysis->free_runs[bin]);
+            analysis->free_run_clusters[bin] += run_length;
+            run_length = 0;
+        }
+        if (cluster_nr == end) {
+            break;
+        }
 
-    // Locate the end of the first part
-    char *first_end = strpbrk(out_name, "\x20\x00");
+        if (entry == bad_mark) {
+            ++(analysis->bad_cnt);
+        }
+        else if (!test_bit(analysis->owned, cluster_nr)) {
+            ++(analysis->lost_cnt);
+            if (entry >= 2 && entry < end) {
+                set_bit(has_predecessor, entry);
+            }
+        }
+    }
 
-    // Place a dot there and the extension (if there is one)
-    if (*(in_name + 8) != 0x20) {
-        *first_end = '.';
-        strncpy(first_end + 1, in_name + 8, 3);
+    /*
+     * Now that all links into the lost clusters are known, follow the lost
+     * chains from their starts, marking the clusters reached. The first pass
+     * takes the clusters without a predecessor. Whatever is left after it
+     * can only be part of loops, and the second pass counts each of them as
+     * a chain, starting anywhere in it.
+     */
+    u_int64_t *reached = calloc((end + 63) / 64, sizeof(u_int64_t));
+    if (reached == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster bitset");
     }
+    for (int pass = 0; pass < 2; ++pass) {
+        for (u_int32_t cluster_nr = 2; cluster_nr < end; ++cluster_nr) {
+            if (test_bit(reached, cluster_nr)
+                    || (pass == 0 && test_bit(has_predecessor, cluster_nr))
+                    || !is_lost(analysis, cluster_nr)) {
+                continue;
+            }
 
-    // Remove possible whitespace
-    char *end = strchr(out_name, 0x20);
-    if (end != NULL) {
-        *end = '\0';
+            ++(analysis->lost_chain_cnt);
+            u_int32_t next_nr = cluster_nr;
+            while (next_nr >= 2 && next_nr < end
+                    && !test_bit(reached, next_nr)
+                    && is_lost(analysis, next_nr)) {
+                set_bit(reached, next_nr);
+                next_nr = fat_next_cluster(fs_info, next_nr);
+            }
+        }
     }
+
+    free(reached);
+    free(has_predecessor);
 }
 
-// Compare a FAT format directory entry name with a name in *.* format for
-// equality.
-int name_equals(char *fat_name, char *normal_name)
+// Return whether the specified cluster is allocated, but owned by no file or
+// directory
+int is_lost(struct analysis *analysis, u_int32_t cluster_nr)
 {
-    char normalised_fat_name[NAME_BYTES + 1];
-    sprint_filename(normalised_fat_name, fat_name);
+    enum fat_type type = analysis->geometry.type;
+    u_int32_t bad_mark = type == FAT12 ? 0xff7
+                         : type == FAT16 ? 0xfff7 : 0x0ffffff7;
+    u_int32_t entry = fat_next_cluster(analysis->fs_info, cluster_nr);
 
-    return strcmp(normalised_fat_name, normal_name) == 0;
+    return entry != 0 && entry != bad_mark
+           && !test_bit(analysis->owned, cluster_nr);
 }
 
-// Return the number of the cluster in the specified cluster in the chain
-u_int16_t get_next_cluster_nr(struct fat_info fs_info, u_int16_t cluster_nr)
+// Return the bit for cluster_nr in the specified bitset
+int test_bit(const u_int64_t *bits, u_int32_t cluster_nr)
 {
-    // Calculate the location of the entry for cluster_nr in the FAT
-    u_int32_t fat_offset = cluster_nr * 2;
-    u_int32_t fat_sec_num
-        = fs_info.RsvdSecCnt + (fat_offset / fs_info.BytsPerSec);
-    u_int16_t fat_ent_offset = fat_offset % fs_info.BytsPerSec;
-
-    return read_16(
-               fs_info.fs_img,
-               sec_to_offset(fs_info, fat_sec_num) + fat_ent_offset
-           );
+    return (bits[cluster_nr / 64] >> (cluster_nr % 64)) & 1;
 }
 
-// Check whether the specified FAT entry is an EOC mark
-int is_eoc(u_int16_t fat_entry)
+// Set the bit for cluster_nr in the specified bitset
+void set_bit(u_int64_t *bits, u_int32_t cluster_nr)
 {
-    if (fat_entry >= 0xfff8) {
-        return 1;
-    }
-
-    return 0;
+    bits[cluster_nr / 64] |= (u_int64_t) 1 << (cluster_nr % 64);
 }
 
-// Return the directory entry at the specified byte offset
-struct fat_dir_info read_dir_entry(FILE *file, long offset)
+/*
+ * Scan the image_cnt images with a pool of job_cnt threads and print a record
+ * for every file and directory in them, as one line of tab-separated fields:
+ *     image  path  size  first cluster  attributes
+ * The path is relative to the root directory, the size and the first cluster
+ * are decimal and the attributes hexadecimal. Tabs, newlines and backslashes
+ * in the image and the path are written as \t, \n and \\. The records of an
+ * image are in the order of -R, but those of different images are mixed.
+ * Images that can't be read are skipped. Returns the status of the first of
+ * them that failed, or 0 if all could be read.
+ */
+int scan_batch(char **images, size_t image_cnt, int job_cnt)
 {
-    // Store the current offset
-    long old_offset = ftell(file);
-    if (old_offset == -1) {
-        err(INPUT_ERR, "Unable to get position in file");
+    /*
+     * Each worker takes the next image, reads its tree in its own thread and
+     * collects the records in its buffer, which it writes out with a single
+     * write once it is full. So scanning an image costs no more than opening
+     * it and reading its directories, and the workers hardly wait for each
+     * other.
+     */
+    struct batch batch;
+    batch.images        = images;
+    batch.image_cnt     = image_cnt;
+    batch.next_image_nr = 0;
+    batch.status        = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_mutex_init(&batch.output_lock, NULL);
+
+    // There's no use for more workers than images
+    if ((size_t) job_cnt > image_cnt) {
+        job_cnt = image_cnt > 0 ? image_cnt : 1;
     }
-
-    // Move to the specified offset
-    if (fseek(file, offset, SEEK_SET) == -1) {
-        err(INPUT_ERR, "Unable to move poisition in file");
+    struct batch_worker *workers = calloc(job_cnt,
+                                          sizeof(struct batch_worker));
+    if (workers == NULL) {
+        err(INPUT_ERR, "Cannot allocate worker threads");
+    }
+    for (int i = 0; i < job_cnt; ++i) {
+        workers[i].batch = &batch;
+        errno = pthread_create(&workers[i].thread, NULL, batch_worker,
+                               &workers[i]);
+        if (errno != 0) {
+            err(INPUT_ERR, "Cannot start worker thread");
+        }
     }
+    for (int i = 0; i < job_cnt; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].records.data);
+        free(workers[i].image.data);
+        free(workers[i].path.data);
+    }
+
+    pthread_mutex_destroy(&batch.output_lock);
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    return batch.status;
+}
 
-    // Read the entry name
-    struct fat_dir_info dir_info;
-    if (fgets(dir_info.name, NAME_BYTES, file) == NULL) {
-        err(INPUT_ERR, "Error reading");
+// Scan images until there are no more and write out the remaining records
+void *batch_worker(void *arg)
+{
+    struct batch_worker *worker = arg;
+    struct batch *batch = worker->batch;
+
+    size_t image_nr;
+    while ((image_nr = __atomic_fetch_add(&batch->next_image_nr, 1,
+                                          __ATOMIC_RELAXED))
+            < batch->image_cnt) {
+        int status = scan_image(worker, batch->images[image_nr]);
+        if (status != 0) {
+            pthread_mutex_lock(&batch->lock);
+            if (batch->status == 0) {
+                batch->status = status;
+            }
+            pthread_mutex_unlock(&batch->lock);
+        }
     }
+    flush_records(worker);
+
+    return NULL;
+}
 
-    // Go back to the old position
-    if (fseek(file, old_offset, SEEK_SET) == -1) {
-        err(INPUT_ERR, "Cannot return to old position in file");
+// Add the records of all entries of the image at image_path to the buffer of
+// worker. Returns 0 on success and INPUT_ERR if the image can't be read.
+int scan_image(struct batch_worker *worker, const char *image_path)
+{
+    struct fat_info *fs_info = fat_open(image_path);
+    if (fs_info == NULL) {
+        return INPUT_ERR;
     }
+    struct fat_geometry geometry;
+    fat_get_geometry(fs_info, &geometry);
 
-    // Read the attributes for the entry
-    dir_info.Attr = read_8(file, offset + 11);
+    // A single job reads the tree without starting a thread
+    struct tree_node root;
+    fat_read_tree(fs_info, geometry.root_cluster_nr, 1, &root);
 
-    // Read the cluster number the entry points to
-    dir_info.FstClusLO = read_16(file, offset + 26);
+    worker->image.length = 0;
+    append_escaped(&worker->image, image_path);
+    worker->path.length = 0;
+    add_records(worker, fs_info, &root);
 
-    return dir_info;
+    fat_free_tree(&root);
+    fat_close(fs_info);
+    return 0;
 }
 
-// Determines whether the specified directory entry belongs to a directory or
-// not
-int is_directory(struct fat_dir_info dir_info)
+// Add the records of the subtree below node, whose escaped path is in the
+// path of worker, to the buffer of worker
+void add_records(struct batch_worker *worker, const struct fat_info *fs_info,
+                 const struct tree_node *node)
 {
-    return (dir_info.Attr & 0x10) != 0;
+    size_t path_length = worker->path.length;
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        const struct tree_node *child = &node->children[i];
+
+        // Append "/name" to the path, leaving out the slash at the root
+        worker->path.length = path_length;
+        if (path_length > 0) {
+            append_text(&worker->path, "/", 1);
+        }
+        append_escaped(&worker->path, child->name);
+
+        char numbers[64];
+        int numbers_length
+            = snprintf(numbers, sizeof(numbers), "\t%lu\t%lu\t%02x\n",
+                       (unsigned long) child->entry.FileSize,
+                       (unsigned long) fat_first_cluster(fs_info,
+                                                         child->entry),
+                       (unsigned int) child->entry.Attr);
+        append_text(&worker->records, worker->image.data,
+                    worker->image.length);
+        append_text(&worker->records, "\t", 1);
+        append_text(&worker->records, worker->path.data, worker->path.length);
+        append_text(&worker->records, numbers, numbers_length);
+        if (worker->records.length >= RECORD_BUFFER_BYTES) {
+            flush_records(worker);
+        }
+
+        if (fat_is_directory(child->entry)) {
+            add_records(worker, fs_info, child);
+        }
+    }
+    worker->path.length = path_length;
 }
 
-// Return the 8-bit number at the specified offset in the specified file
-u_int8_t read_8(FILE *file, long offset)
+// Write the records in the buffer of worker to stdout at once, so that they
+// don't get mixed up with those of other workers
+void flush_records(struct batch_worker *worker)
 {
-    // Store the current offset
-    long old_offset = ftell(file);
-    if (old_offset == -1) {
-        err(INPUT_ERR, "Unable to get position in file");
+    const char *data = worker->records.data;
+    size_t left = worker->records.length;
+
+    pthread_mutex_lock(&worker->batch->output_lock);
+    while (left > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, left);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err(OUTPUT_ERR, "Cannot write to stdout");
+        }
+        data += written;
+        left -= written;
     }
+    pthread_mutex_unlock(&worker->batch->output_lock);
 
-    // Move to the specified offset
-    if (fseek(file, offset, SEEK_SET) == -1) {
-        err(INPUT_ERR, "Unable to move poisition in file");
-    }
+    worker->records.length = 0;
+}
 
-    // Read the byte at that position
-    int res = fgetc(file);
-    if (res == EOF) {
-        err(INPUT_ERR, "Error reading");
-    }
+// Read the paths of images from in, one per line, and store their number in
+// *image_cnt. Empty lines are skipped.
+char **read_image_list(FILE *in, size_t *image_cnt)
+{
+    char **images = NULL;
+    size_t capacity = 0;
+    *image_cnt = 0;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, in)) != -1) {
+        if (line_length > 0 && line[line_length - 1] == '\n') {
+            line[--line_length] = '\0';
+        }
+        if (line_length == 0) {
+            continue;
+        }
 
-    // Go back to the old position
-    if (fseek(file, old_offset, SEEK_SET) == -1) {
-        err(INPUT_ERR, "Cannot return to old position in file");
+        if (*image_cnt == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            images = realloc(images, capacity * sizeof(char *));
+            if (images == NULL) {
+                err(INPUT_ERR, "Cannot allocate image list");
+            }
+        }
+        images[*image_cnt] = strdup(line);
+        if (images[*image_cnt] == NULL) {
+            err(INPUT_ERR, "Cannot allocate image list");
+        }
+        ++(*image_cnt);
+    }
+    if (ferror(in)) {
+        err(INPUT_ERR, "Cannot read image list");
     }
 
-    return (u_int8_t) res;
+    free(line);
+    return images;
 }
 
-// Return the 16-bit number at the specified offset in the specified file
-u_int16_t read_16(FILE *file, long offset)
+// Append the length bytes at data to text
+void append_text(struct text *text, const char *data, size_t length)
 {
-    // Read the 8-bit number at the specified offset and the number after it
-    u_int16_t lower_byte = (u_int16_t) read_8(file, offset);
-    u_int16_t upper_byte = (u_int16_t) read_8(file, offset + 1);
-        // This is elegant, but rather unefficient.
+    if (text->length + length > text->capacity) {
+        text->capacity = 2 * (text->length + length);
+        if (text->capacity < RECORD_BUFFER_BYTES) {
+            text->capacity = RECORD_BUFFER_BYTES;
+        }
+        text->data = realloc(text->data, text->capacity);
+        if (text->data == NULL) {
+            err(INPUT_ERR, "Cannot allocate record buffer");
+        }
+    }
 
-    // Return their combination into a 16-bit number
-    return (upper_byte << 8) + lower_byte;
+    memcpy(text->data + text->length, data, length);
+    text->length += length;
 }
 
-// Return the 32-bit number at the specified offset in the specified file
-u_int32_t read_32(FILE *file, long offset)
+// Append string to text with tabs, newlines and backslashes escaped, so that
+// it can be a field of a record
+void append_escaped(struct text *text, const char *string)
 {
-    // Read the 8-bit number at the specified offset and the number after it
-    u_int32_t lower_word = (u_int32_t) read_16(file, offset);
-    u_int32_t upper_word = (u_int32_t) read_16(file, offset + 1);
-        // This is elegant, but rather unefficient.
-
-    // Return their combination into a 16-bit number
-    return (upper_word << 16) + lower_word;
+    while (*string != '\0') {
+        size_t plain = strcspn(string, "\t\n\\");
+        append_text(text, string, plain);
+        string += plain;
+
+        switch (*string) {
+        case '\t':
+            append_text(text, "\\t", 2);
+            break;
+        case '\n':
+            append_text(text, "\\n", 2);
+            break;
+        case '\\':
+            append_text(text, "\\\\", 2);
+            break;
+        default:
+            return;
+        }
+        ++string;
+    }
 }
@@ -1,3 +1,5 @@
 #define ARG_ERR 1
 #define INPUT_ERR 2
 #define NOT_FOUND_ERR 3
+#define OUTPUT_ERR 4
+#define INCONSISTENT_ERR 5
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "libfat.h"
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFAULT_OPEN_CNT 1000
+#define MAX_JOBS 256
+
+// The paths of all files of an image
+struct path_list {
+    char   **paths;
+    size_t cnt;
+    size_t capacity;
+};
+
+void bench_open(const char *, long);
+void bench_list(const char *, int);
+void bench_lookup(const char *, struct path_list *, int);
+void bench_extract(const char *, struct path_list *, int, const char *);
+void check_contents(const char *, struct path_list *);
+int file_number(const char *, u_int32_t *);
+void collect_paths(struct tree_node *, char *, size_t, struct path_list *);
+void shuffle_paths(struct path_list *);
+u_int64_t count_nodes(const struct tree_node *);
+struct fat_info *open_or_die(const char *);
+void print_result(const char *, int, u_int64_t, double, u_int64_t);
+double now_sec(void);
+
+/*
+ * Measures how fast libfat opens the given image, lists its whole tree,
+ * looks up every file by its path and extracts every file. Listing is
+ * measured with one thread and with jobs threads, lookups with empty and with
+ * filled caches, and extraction into /dev/null and into a regular file.
+ * Finally, the files named like those of mkfatimg are extracted once more and
+ * compared with what mkfatimg wrote into them. Options:
+ *     -j jobs   threads for the parallel listing (default: one per processor)
+ *     -o count  how often the image is opened and closed (default: 1000)
+ */
+int main(int argc, char *argv[])
+{
+    // Parse options
+    long job_cnt  = sysconf(_SC_NPROCESSORS_ONLN);
+    long open_cnt = DEFAULT_OPEN_CNT;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+        switch (opt) {
+        case 'j':
+            job_cnt = atol(optarg);
+            if (job_cnt < 1 || job_cnt > MAX_JOBS) {
+                errx(ARG_ERR, "Invalid number of jobs: %s", optarg);
+            }
+            break;
+        case 'o':
+            open_cnt = atol(optarg);
+            if (open_cnt < 1) {
+                errx(ARG_ERR, "Invalid number of opens: %s", optarg);
+            }
+            break;
+        default:
+            errx(ARG_ERR, "Usage: fat-bench [-j jobs] [-o count] image");
+        }
+    }
+    if (optind != argc - 1) {
+        errx(ARG_ERR, "Usage: fat-bench [-j jobs] [-o count] image");
+    }
+    const char *path = argv[optind];
+    if (job_cnt < 1) {
+        job_cnt = 1;
+    }
+    else if (job_cnt > MAX_JOBS) {
+        job_cnt = MAX_JOBS;
+    }
+
+    // Collect the paths of all files for lookups and extraction, in random
+    // order so that the caches don't get them directory by directory
+    struct fat_info *fs_info = open_or_die(path);
+    struct fat_geometry geometry;
+    fat_get_geometry(fs_info, &geometry);
+    struct tree_node root;
+    fat_read_tree(fs_info, geometry.root_cluster_nr, job_cnt, &root);
+    struct path_list files = { NULL, 0, 0 };
+    char path_buffer[4096];
+    collect_paths(&root, path_buffer, 0, &files);
+    shuffle_paths(&files);
+    fat_free_tree(&root);
+    fat_close(fs_info);
+
+    printf("%s: FAT%d, %u clusters of %u bytes, %zu files\n", path,
+           geometry.type, geometry.cluster_cnt, geometry.cluster_bytes,
+           files.cnt);
+    printf("%-16s %5s %10s %10s %12s %10s\n",
+           "operation", "jobs", "items", "seconds", "items/s", "MB/s");
+    fflush(stdout);
+
+    bench_open(path, open_cnt);
+    bench_list(path, 1);
+    if (job_cnt > 1) {
+        bench_list(path, job_cnt);
+    }
+    bench_lookup(path, &files, 0);
+    bench_lookup(path, &files, 1);
+    bench_extract(path, &files, open("/dev/null", O_WRONLY), "extract null");
+
+    // A temporary file that is emptied after every extracted file
+    char temp_path[] = "/tmp/fat-bench.XXXXXX";
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd == -1) {
+        err(OUTPUT_ERR, "Cannot create temporary file");
+    }
+    unlink(temp_path);
+    bench_extract(path, &files, temp_fd, "extract file");
+    check_contents(path, &files);
+
+    for (size_t i = 0; i < files.cnt; ++i) {
+        free(files.paths[i]);
+    }
+    free(files.paths);
+    return 0;
+}
+
+// Open and close the image open_cnt times, which is the cost of setting up
+// an image before anything is read from it
+void bench_open(const char *path, long open_cnt)
+{
+    double start_sec = now_sec();
+    for (long i = 0; i < open_cnt; ++i) {
+        fat_close(open_or_die(path));
+    }
+    print_result("open+close", 1, open_cnt, now_sec() - start_sec, 0);
+}
+
+// Read the whole tree with job_cnt threads, starting with empty caches
+void bench_list(const char *path, int job_cnt)
+{
+    struct fat_info *fs_info = open_or_die(path);
+    struct fat_geometry geometry;
+    fat_get_geometry(fs_info, &geometry);
+
+    struct tree_node root;
+    double start_sec = now_sec();
+    fat_read_tree(fs_info, geometry.root_cluster_nr, job_cnt, &root);
+    double elapsed = now_sec() - start_sec;
+    print_result("list", job_cnt, count_nodes(&root) - 1, elapsed, 0);
+
+    fat_free_tree(&root);
+    fat_close(fs_info);
+}
+
+// Look up every file by its path. With warm set, every path has been looked
+// up once before, so its directory is in the cache of resolved paths.
+void bench_lookup(const char *path, struct path_list *files, int warm)
+{
+    struct fat_info *fs_info = open_or_die(path);
+    struct fat_dir_info entry;
+    for (size_t i = 0; warm && i < files->cnt; ++i) {
+        fat_find_file(fs_info, files->paths[i], &entry);
+    }
+
+    double start_sec = now_sec();
+    for (size_t i = 0; i < files->cnt; ++i) {
+        if (fat_find_file(fs_info, files->paths[i], &entry) != 0) {
+            errx(NOT_FOUND_ERR, "Lookup of %s failed", files->paths[i]);
+        }
+    }
+    print_result(warm ? "lookup warm" : "lookup cold", 1, files->cnt,
+                 now_sec() - start_sec, 0);
+
+    fat_close(fs_info);
+}
+
+// Extract every file into out_fd, which is emptied again after each file if
+// it is a regular file, and close it
+void bench_extract(const char *path, struct path_list *files, int out_fd,
+                   const char *name)
+{
+    if (out_fd == -1) {
+        err(OUTPUT_ERR, "Cannot open output for %s", name);
+    }
+    struct fat_info *fs_info = open_or_die(path);
+
+    u_int64_t bytes = 0;
+    double start_sec = now_sec();
+    for (size_t i = 0; i < files->cnt; ++i) {
+        struct fat_dir_info entry;
+        if (fat_find_file(fs_info, files->paths[i], &entry) != 0
+                || fat_extract(fs_info, entry, out_fd, files->paths[i]) != 0) {
+            errx(INPUT_ERR, "Extraction of %s failed", files->paths[i]);
+        }
+        bytes += entry.FileSize;
+
+        // Errors here only mean that out_fd isn't a regular file
+        if (ftruncate(out_fd, 0) == 0) {
+            lseek(out_fd, 0, SEEK_SET);
+        }
+    }
+    print_result(name, 1, files->cnt, now_sec() - start_sec, bytes);
+
+    fat_close(fs_info);
+    close(out_fd);
+}
+
+/*
+ * Extract every file whose name is one mkfatimg gives, F0000017.DAT or a long
+ * name starting with "File 0000017", into a temporary file and check that
+ * byte i is (n + i) % 251 for file n. Terminates at the first difference.
+ */
+void check_contents(const char *path, struct path_list *files)
+{
+    char temp_path[] = "/tmp/fat-bench.XXXXXX";
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd == -1) {
+        err(OUTPUT_ERR, "Cannot create temporary file");
+    }
+    unlink(temp_path);
+    struct fat_info *fs_info = open_or_die(path);
+
+    unsigned char *contents = NULL;
+    size_t capacity = 0;
+    u_int64_t checked_cnt = 0, bytes = 0;
+    double start_sec = now_sec();
+    for (size_t i = 0; i < files->cnt; ++i) {
+        u_int32_t file_nr;
+        if (!file_number(files->paths[i], &file_nr)) {
+            continue;
+        }
+
+        // Extract the file and read it back
+        struct fat_dir_info entry;
+        if (ftruncate(temp_fd, 0) == -1 || lseek(temp_fd, 0, SEEK_SET) == -1) {
+            err(OUTPUT_ERR, "Cannot empty temporary file");
+        }
+        if (fat_find_file(fs_info, files->paths[i], &entry) != 0
+                || fat_extract(fs_info, entry, temp_fd,
+                               files->paths[i]) != 0) {
+            errx(INPUT_ERR, "Extraction of %s failed", files->paths[i]);
+        }
+        if (entry.FileSize > capacity) {
+            capacity = entry.FileSize;
+            contents = realloc(contents, capacity);
+            if (contents == NULL) {
+                err(INPUT_ERR, "Cannot allocate buffer");
+            }
+        }
+        if (pread(temp_fd, contents, entry.FileSize, 0)
+                != (ssize_t) entry.FileSize) {
+            errx(INCONSISTENT_ERR, "%s was not extracted completely",
+                 files->paths[i]);
+        }
+
+        for (u_int32_t j = 0; j < entry.FileSize; ++j) {
+            if (contents[j] != (file_nr + j) % 251) {
+                errx(INCONSISTENT_ERR, "Byte %u of %s is %u instead of %u", j,
+                     files->paths[i], contents[j], (file_nr + j) % 251);
+            }
+        }
+        ++checked_cnt;
+        bytes += entry.FileSize;
+    }
+    print_result("check", 1, checked_cnt, now_sec() - start_sec, bytes);
+
+    free(contents);
+    fat_close(fs_info);
+    close(temp_fd);
+}
+
+// Store the number of the file at path in *file_nr if its name is one that
+// mkfatimg gives. Returns 1 if it is and 0 otherwise.
+int file_number(const char *path, u_int32_t *file_nr)
+{
+    const char *name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    if (strncmp(name, "File ", 5) == 0) {
+        name += 5;
+    }
+    else if (name[0] == 'F') {
+        name += 1;
+    }
+    else {
+        return 0;
+    }
+
+    *file_nr = 0;
+    for (int i = 0; i < 7; ++i) {
+        if (name[i] < '0' || name[i] > '9') {
+            return 0;
+        }
+        *file_nr = 10 * *file_nr + name[i] - '0';
+    }
+
+    return strcmp(name + 7, ".DAT") == 0 || name[7] == ' '
+           || strcmp(name + 7, ".dat") == 0;
+}
+
+// Add the paths of all files below node to list. The path of node, length
+// bytes long, is at the start of buffer.
+void collect_paths(struct tree_node *node, char *buffer, size_t length,
+                   struct path_list *list)
+{
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        struct tree_node *child = &node->children[i];
+        int child_length = snprintf(buffer + length, 4096 - length, "%s%s",
+                                    length > 0 ? "/" : "", child->name);
+        if (child_length < 0 || length + child_length >= 4096) {
+            errx(INPUT_ERR, "Path too long below %.*s", (int) length, buffer);
+        }
+
+        if (fat_is_directory(child->entry)) {
+            collect_paths(child, buffer, length + child_length, list);
+            continue;
+        }
+        if (list->cnt == list->capacity) {
+            list->capacity = list->capacity == 0 ? 1024 : 2 * list->capacity;
+            list->paths = realloc(list->paths,
+                                  list->capacity * sizeof(char *));
+            if (list->paths == NULL) {
+                err(INPUT_ERR, "Cannot allocate path list");
+            }
+        }
+        list->paths[list->cnt] = strdup(buffer);
+        if (list->paths[list->cnt] == NULL) {
+            err(INPUT_ERR, "Cannot allocate path list");
+        }
+        ++(list->cnt);
+    }
+}
+
+// Put the paths into a random order that is the same in every run
+void shuffle_paths(struct path_list *list)
+{
+    u_int64_t state = 88172645463325252ULL;
+    for (size_t i = list->cnt; i > 1; --i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t j = state % i;
+
+        char *swapped = list->paths[i - 1];
+        list->paths[i - 1] = list->paths[j];
+        list->paths[j] = swapped;
+    }
+}
+
+// Return the number of nodes in the tree at node, including node
+u_int64_t count_nodes(const struct tree_node *node)
+{
+    u_int64_t cnt = 1;
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        cnt += count_nodes(&node->children[i]);
+    }
+
+    return cnt;
+}
+
+// Open the image at path, terminating if it can't be opened
+struct fat_info *open_or_die(const char *path)
+{
+    struct fat_info *fs_info = fat_open(path);
+    if (fs_info == NULL) {
+        exit(INPUT_ERR);
+    }
+
+    return fs_info;
+}
+
+// Print a line of the results; bytes is 0 if throughput doesn't apply
+void print_result(const char *name, int job_cnt, u_int64_t item_cnt,
+                  double elapsed, u_int64_t bytes)
+{
+    printf("%-16s %5d %10llu %10.4f %12.0f ", name, job_cnt,
+           (unsigned long long) item_cnt, elapsed,
+           elapsed > 0 ? item_cnt / elapsed : 0.0);
+    if (bytes > 0) {
+        printf("%10.1f\n", elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+    }
+    else {
+        printf("%10s\n", "-");
+    }
+    fflush(stdout);
+}
+
+// Return the time of the monotonic clock in seconds
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
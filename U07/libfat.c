@@ -0,0 +1,2024 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include "errors.h"
+#include "libfat.h"
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PATH_DELIM '/'
+#define DIR_ENT_BYTES 32
+#define NO_SUCH_ENTRY 0xffffffff
+#define NO_MORE_ENTRIES_ATTR 0x00
+#define NO_MORE_ENTRIES_FCL 0
+    // Note that these values shouldn't be negative
+#define BOOT_SECTOR_BYTES 512
+#define LFN_ATTR 0x0f
+#define LFN_LAST 0x40
+#define LFN_UNITS_PER_ENTRY 13
+#define MAX_LFN_ENTRIES 20
+#define LONG_NAME_BYTES (MAX_LFN_ENTRIES * LFN_UNITS_PER_ENTRY * 3 + 1)
+    // UTF-8 needs at most three bytes for a UTF-16 unit
+#define MAX_EXTENT_CLUSTERS 0xffff
+    // Longer runs of clusters are split, so that entry counts fit 32 bits
+#define INITIAL_CHAIN_BUCKETS 64
+#define COPY_CHUNK (1 << 30)
+    // Upper limit for bytes moved by one copy_file_range/write
+#define INITIAL_DIR_BUCKETS 64
+#define FNV_BASIS 2166136261u
+
+// A run of consecutive clusters in a chain
+struct chain_extent {
+    u_int32_t first_cluster_nr;
+    u_int32_t cluster_cnt;
+};
+
+// A whole cluster chain, stored as its runs of consecutive clusters
+struct cluster_chain {
+    u_int32_t first_cluster_nr;
+    u_int32_t cluster_cnt;
+    u_int32_t extent_cnt;
+    struct chain_extent *extents;
+
+    // The next chain in the same bucket of the cache
+    struct cluster_chain *next;
+};
+
+// Hash table of the chains walked so far, keyed by their first cluster. The
+// lock makes it usable from several threads.
+struct chain_cache {
+    struct cluster_chain **buckets;
+    u_int32_t bucket_cnt;
+    u_int32_t chain_cnt;
+    pthread_mutex_t lock;
+};
+
+// An open image. Nothing in it changes after fat_open except for the caches,
+// which have their own locks.
+struct fat_info {
+    u_int16_t BytsPerSec;
+    u_int8_t  SecPerClus;
+    u_int16_t RsvdSecCnt;
+    u_int8_t  NumFATs;
+    u_int16_t RootEntCnt;
+    u_int32_t fat_size;
+    u_int32_t first_root_dir_sec_num;
+    u_int32_t first_data_sector;
+    u_int16_t dir_ents_per_cluster;
+    enum fat_type type;
+    u_int32_t cluster_cnt;
+
+    // The first cluster of the root directory (0 if the root directory has a
+    // fixed region, that is on FAT12 and FAT16)
+    u_int32_t root_cluster_nr;
+
+    // The whole image, mapped read-only, and a descriptor for it to copy
+    // from with copy_file_range
+    const unsigned char *image;
+    u_int64_t image_size;
+    int image_fd;
+    long page_size;
+
+    // The byte offset of the first FAT
+    u_int64_t fat_offset;
+
+    // The chains walked and directories indexed so far
+    struct chain_cache *chains;
+    struct dir_cache *dirs;
+};
+
+/*
+ * The entries of a directory, hashed by their normalised names. slots is an
+ * open-addressing table of entry numbers plus one, where 0 marks a free slot.
+ * The names are stored one after the other in names.
+ */
+struct dir_index {
+    u_int32_t cluster_nr;
+    u_int32_t entry_cnt;
+    struct indexed_entry *entries;
+    u_int32_t *slots;
+    u_int32_t slot_cnt;
+    char *names;
+
+    // The next index in the same bucket of the cache
+    struct dir_index *next;
+};
+
+struct indexed_entry {
+    u_int32_t hash;
+    u_int32_t name_offset;
+    struct fat_dir_info entry;
+};
+
+// A path that has been resolved before, normalised and with a trailing slash
+struct dentry {
+    char *path;
+    u_int32_t hash;
+    u_int32_t cluster_nr;
+    struct dentry *next;
+};
+
+/*
+ * The directories indexed so far, keyed by their first cluster, and the
+ * paths resolved so far, keyed by themselves. Both are hash tables with
+ * chained buckets.
+ */
+struct dir_cache {
+    struct dir_index **dirs;
+    u_int32_t dir_bucket_cnt;
+    u_int32_t dir_cnt;
+    struct dentry **dentries;
+    u_int32_t dentry_bucket_cnt;
+    u_int32_t dentry_cnt;
+    pthread_mutex_t lock;
+};
+
+struct dir_entry_iterator_state {
+    // Indicates whether we're traversing the fixed root directory region of
+    // FAT12/FAT16 or not
+    u_int8_t is_root_dir;
+
+    // The chain of the directory (NULL for the fixed root directory region)
+    const struct cluster_chain *chain;
+
+    // The number of the current extent in the chain
+    u_int32_t extent_nr;
+
+    // The maximum number of directory entries in this extent (or root dir)
+    u_int32_t max_entry_cnt;
+
+    // The number of the first cluster of the current extent (or 0 for the
+    // root directory)
+    u_int32_t cluster_nr;
+
+    // The byte offset of the start of the current extent (or root directory)
+    u_int64_t cluster_offset;
+
+    // The number of the entry examined last in the extent
+    u_int32_t entry_nr;
+
+    // The contents of the current extent (or the whole root directory)
+    const unsigned char *entries;
+
+    // The entry at entry_nr
+    struct fat_dir_info cur_entry;
+
+    // The UTF-16 units of the long name entries seen so far. lfn_next is the
+    // sequence number of the long name entry expected next, counting down to
+    // 0 for the short entry the long name belongs to, or -1 if there is no
+    // long name in progress. lfn_entry_cnt is the number of entries of the
+    // long name in progress, so units beyond them are left over from a longer
+    // one. All entries of a long name have to carry the checksum of the short
+    // name.
+    u_int16_t lfn_units[MAX_LFN_ENTRIES * LFN_UNITS_PER_ENTRY];
+    int       lfn_next;
+    int       lfn_entry_cnt;
+    u_int8_t  lfn_checksum;
+
+    // The long name of the entry returned last
+    char long_name[LONG_NAME_BYTES];
+};
+
+/*
+ * The directories of one worker, a growing ring buffer. The worker itself
+ * takes from the back, so it goes deep into the tree first, while other
+ * workers steal from the front, where the larger subtrees are.
+ */
+struct task_deque {
+    struct tree_node **tasks;
+    size_t           head;
+    size_t           tail;
+    size_t           capacity;
+    pthread_mutex_t  lock;
+};
+
+/*
+ * What the worker threads of a recursive listing share. queued counts the
+ * directories in all deques, unfinished those that are queued or being read;
+ * when it reaches zero, the whole tree is known. visited has a bit for every
+ * cluster that starts a directory seen so far, so that a corrupt image can't
+ * send the walk around in a loop.
+ */
+struct list_pool {
+    const struct fat_info *fs_info;
+    struct task_deque *deques;
+    int               worker_cnt;
+    size_t            queued;
+    size_t            unfinished;
+    u_int64_t         *visited;
+    pthread_mutex_t   lock;
+    pthread_cond_t    work_available;
+};
+
+// What a worker thread gets to know at its start
+struct list_worker {
+    struct list_pool *pool;
+    int              nr;
+    pthread_t        thread;
+};
+
+static int parse_boot_sector(struct fat_info *, const char *);
+static const struct dir_index *get_dir_index(const struct fat_info *,
+                                             u_int32_t);
+static struct dir_index *build_dir_index(const struct fat_info *, u_int32_t);
+static const struct fat_dir_info *lookup_name(const struct dir_index *,
+                                              const char *, u_int32_t);
+static int find_dentry(struct dir_cache *, const char *, u_int32_t,
+                       u_int32_t *);
+static void add_dentry(struct dir_cache *, const char *, u_int32_t, u_int32_t);
+static struct dir_cache *new_dir_cache(void);
+static void free_dir_cache(struct dir_cache *);
+static size_t normalise_name(char *, const char *, size_t);
+static u_int32_t hash_name(u_int32_t, const char *, size_t);
+static u_int32_t hash_cluster(u_int32_t, u_int32_t);
+static int copy_run(const struct fat_info *, u_int64_t, u_int64_t, int, int *);
+static int write_all(int, const unsigned char *, u_int64_t);
+static void *list_worker(void *);
+static struct tree_node *take_task(struct list_pool *, int);
+static void push_task(struct list_pool *, int, struct tree_node *);
+static void finish_task(struct list_pool *);
+static void read_tree_dir(struct list_pool *, int, struct tree_node *);
+static int mark_visited(struct list_pool *, u_int32_t);
+static int compare_nodes(const void *, const void *);
+static struct dir_entry_iterator_state new_dir_entry_iterator(
+        const struct fat_info *, u_int32_t);
+static struct fat_dir_info next_dir_entry(const struct fat_info *,
+        struct dir_entry_iterator_state *);
+static void load_extent(const struct fat_info *,
+                        struct dir_entry_iterator_state *);
+static void prefetch(const struct fat_info *, u_int64_t, u_int64_t);
+static u_int32_t cluster_to_sec(const struct fat_info *, u_int32_t);
+static u_int64_t sec_to_offset(const struct fat_info *, u_int32_t);
+static int is_no_more_entries(struct fat_dir_info);
+static struct fat_dir_info no_more_entries();
+static const struct cluster_chain *get_chain(const struct fat_info *,
+                                             u_int32_t);
+static struct cluster_chain *walk_chain(const struct fat_info *, u_int32_t);
+static void grow_chain_cache(struct chain_cache *);
+static void free_chain_cache(struct chain_cache *);
+static struct fat_dir_info read_dir_entry(const unsigned char *);
+static void add_lfn_entry(struct dir_entry_iterator_state *,
+                          const unsigned char *);
+static const char *finish_long_name(struct dir_entry_iterator_state *,
+                                    const unsigned char *);
+static u_int8_t lfn_checksum(const unsigned char *);
+static size_t utf16_to_utf8(char *, const u_int16_t *, size_t);
+static void sprint_filename(char *, char *);
+static int map_image(struct fat_info *, const char *);
+static const unsigned char *image_bytes(const struct fat_info *, u_int64_t,
+                                        u_int64_t);
+static u_int8_t image_8(const struct fat_info *, u_int64_t);
+static u_int16_t image_16(const struct fat_info *, u_int64_t);
+static u_int32_t image_32(const struct fat_info *, u_int64_t);
+static u_int16_t get_16(const unsigned char *);
+static u_int32_t get_32(const unsigned char *);
+
+/*
+ * Open the image at path and read its boot sector. Returns NULL if it can't be
+ * opened or doesn't contain a FAT filesystem. The image has to be closed with
+ * fat_close.
+ */
+struct fat_info *fat_open(const char *path)
+{
+    struct fat_info *fs_info = calloc(1, sizeof(struct fat_info));
+    if (fs_info == NULL) {
+        err(INPUT_ERR, "Cannot allocate image handle");
+    }
+
+    // Map the filesystem image into memory and find out its layout
+    if (map_image(fs_info, path) != 0) {
+        free(fs_info);
+        return NULL;
+    }
+    if (parse_boot_sector(fs_info, path) != 0) {
+        munmap((void *) fs_info->image, fs_info->image_size);
+        close(fs_info->image_fd);
+        free(fs_info);
+        return NULL;
+    }
+
+    // Have the kernel read in the first FAT, since following chains jumps
+    // around in it
+    prefetch(fs_info, fs_info->fat_offset,
+             (u_int64_t) fs_info->fat_size * fs_info->BytsPerSec);
+
+    // Start with empty caches
+    fs_info->chains = calloc(1, sizeof(struct chain_cache));
+    if (fs_info->chains == NULL) {
+        err(INPUT_ERR, "Cannot allocate chain cache");
+    }
+    grow_chain_cache(fs_info->chains);
+    pthread_mutex_init(&fs_info->chains->lock, NULL);
+    fs_info->dirs = new_dir_cache();
+
+    return fs_info;
+}
+
+// Release everything belonging to the image
+void fat_close(struct fat_info *fs_info)
+{
+    free_dir_cache(fs_info->dirs);
+    pthread_mutex_destroy(&fs_info->chains->lock);
+    free_chain_cache(fs_info->chains);
+    munmap((void *) fs_info->image, fs_info->image_size);
+    close(fs_info->image_fd);
+    free(fs_info);
+}
+
+/*
+ * Read the necessary filesystem information from the boot sector of the
+ * image at path, which is mapped already. Returns 0 on success and INPUT_ERR
+ * if the image doesn't hold a FAT filesystem or is too small for it.
+ */
+static int parse_boot_sector(struct fat_info *fs_info, const char *path)
+{
+    fs_info->BytsPerSec = image_16(fs_info, 11);
+    fs_info->SecPerClus = image_8( fs_info, 13);
+    fs_info->RsvdSecCnt = image_16(fs_info, 14);
+    fs_info->NumFATs    = image_8( fs_info, 16);
+    fs_info->RootEntCnt = image_16(fs_info, 17);
+    if (fs_info->BytsPerSec == 0 || fs_info->SecPerClus == 0) {
+        warnx("%s doesn't contain a FAT filesystem", path);
+        return INPUT_ERR;
+    }
+
+    // Determine the size of one FAT
+    u_int16_t fatsz_16 = image_16(fs_info, 22);
+    if (fatsz_16 != 0) {
+        fs_info->fat_size = (u_int32_t) fatsz_16;
+    }
+    else {
+        fs_info->fat_size = image_32(fs_info, 36);
+    }
+
+    // Determine the total number of sectors
+    u_int32_t tot_sec = image_16(fs_info, 19);
+    if (tot_sec == 0) {
+        tot_sec = image_32(fs_info, 32);
+    }
+
+    // Calculate the number of the first sector of the root directory
+    int root_dir_sectors = (
+                             (fs_info->RootEntCnt * 32)
+                             + (fs_info->BytsPerSec - 1)
+                           ) / fs_info->BytsPerSec;
+    fs_info->first_root_dir_sec_num
+        = fs_info->RsvdSecCnt + (fs_info->NumFATs * fs_info->fat_size);
+
+    // Calculate the number of the first data sector
+    fs_info->first_data_sector
+        = fs_info->first_root_dir_sec_num + root_dir_sectors;
+
+    // Calculate the maximum number of directory entries per cluster
+    fs_info->dir_ents_per_cluster
+        = fs_info->BytsPerSec * fs_info->SecPerClus / DIR_ENT_BYTES;
+
+    // Determine the FAT type from the number of data clusters
+    if (tot_sec <= fs_info->first_data_sector) {
+        warnx("%s has no data region", path);
+        return INPUT_ERR;
+    }
+    fs_info->cluster_cnt
+        = (tot_sec - fs_info->first_data_sector) / fs_info->SecPerClus;
+    if (fs_info->cluster_cnt < 4085) {
+        fs_info->type = FAT12;
+    }
+    else if (fs_info->cluster_cnt < 65525) {
+        fs_info->type = FAT16;
+    }
+    else {
+        fs_info->type = FAT32;
+    }
+
+    // FAT32 keeps the root directory in a cluster chain, too
+    if (fs_info->type == FAT32) {
+        fs_info->root_cluster_nr = image_32(fs_info, 44);
+        if (fs_info->root_cluster_nr < 2
+                || fs_info->root_cluster_nr >= fs_info->cluster_cnt + 2) {
+            warnx("The root directory of %s starts at cluster %u, which "
+                  "doesn't exist", path, fs_info->root_cluster_nr);
+            return INPUT_ERR;
+        }
+    }
+    else {
+        fs_info->root_cluster_nr = 0;
+    }
+
+    // Locate the first FAT
+    fs_info->fat_offset = sec_to_offset(fs_info, fs_info->RsvdSecCnt);
+    u_int64_t fat_bytes = (u_int64_t) fs_info->fat_size * fs_info->BytsPerSec;
+    if (fat_bytes * 8 / fs_info->type < fs_info->cluster_cnt + 2) {
+        warnx("The FAT of %s is too small for its clusters", path);
+        return INPUT_ERR;
+    }
+
+    // Everything after this only reads the FAT, the root directory and the
+    // clusters, so checking once that they are inside of the image is enough
+    u_int64_t data_end = sec_to_offset(fs_info, fs_info->first_data_sector)
+                         + (u_int64_t) fs_info->cluster_cnt
+                           * fs_info->SecPerClus * fs_info->BytsPerSec;
+    if (fs_info->fat_offset + fat_bytes > fs_info->image_size
+            || data_end > fs_info->image_size) {
+        warnx("%s is smaller than the filesystem in it", path);
+        return INPUT_ERR;
+    }
+
+    return 0;
+}
+
+// Store the layout of the image in *geometry
+void fat_get_geometry(const struct fat_info *fs_info,
+                      struct fat_geometry *geometry)
+{
+    geometry->type            = fs_info->type;
+    geometry->cluster_cnt     = fs_info->cluster_cnt;
+    geometry->cluster_bytes   = fs_info->SecPerClus * fs_info->BytsPerSec;
+    geometry->root_cluster_nr = fs_info->root_cluster_nr;
+}
+
+/*
+ * Call fn with every entry of the directory at cluster_nr, in the order they
+ * are stored, and arg. The long name of an entry is only valid during the
+ * call. Returns the first value other than 0 that fn returns, and 0 if there
+ * is none.
+ */
+int fat_read_dir(struct fat_info *fs_info, u_int32_t cluster_nr,
+                 fat_entry_fn fn, void *arg)
+{
+    // Initialise the iterator for directory entries
+    struct dir_entry_iterator_state dit_state
+        = new_dir_entry_iterator(fs_info, cluster_nr);
+
+    // Go through the directory entries
+    while (1) {
+        struct fat_dir_info entry = next_dir_entry(fs_info, &dit_state);
+        if (is_no_more_entries(entry)) {
+            return 0;
+        }
+
+        int status = fn(&entry, arg);
+        if (status != 0) {
+            return status;
+        }
+    }
+}
+
+/*
+ * Store the first cluster of the directory at the specified path, which is
+ * relative to the root directory, in *dir_cluster_nr. Returns 0 on success and
+ * NOT_FOUND_ERR if there is no such directory.
+ */
+int fat_find_dir(struct fat_info *fs_info, const char *path,
+                 u_int32_t *dir_cluster_nr)
+{
+    /*
+     * The path is resolved one component after the other, each in the index
+     * of the directory it's in. Every prefix of the path resolved on the way
+     * is remembered as a dentry, so asking for BLA1/BLA2/BLA3/ and then
+     * BLA1/BLA2/BLA4/ only looks up BLA4 in the index of BLA2. The hash of a
+     * prefix is continued for the next one instead of being started anew.
+     */
+    size_t path_length = strlen(path);
+    char *normalised = malloc(path_length + 2);
+    if (normalised == NULL) {
+        err(INPUT_ERR, "Cannot allocate path buffer");
+    }
+    size_t normalised_length = 0;
+    u_int32_t hash = FNV_BASIS;
+
+    u_int32_t cluster_nr = fs_info->root_cluster_nr;
+    const char *component = path;
+    while (1) {
+        // Find the next component, skipping any number of delimiters
+        while (*component == PATH_DELIM) {
+            ++component;
+        }
+        if (*component == '\0') {
+            break;
+        }
+        size_t component_length = strcspn(component, "/");
+
+        // Add it to the normalised path, which is the key for the dentries
+        char *name = normalised + normalised_length;
+        size_t name_length = normalise_name(name, component,
+                                            component_length);
+        normalised_length += name_length;
+        normalised[normalised_length++] = PATH_DELIM;
+        normalised[normalised_length]   = '\0';
+        hash = hash_name(hash, name, name_length + 1);
+
+        // Look it up as a whole first and in its directory otherwise
+        if (!find_dentry(fs_info->dirs, normalised, hash, &cluster_nr)) {
+            const struct fat_dir_info *entry
+                = lookup_name(get_dir_index(fs_info, cluster_nr), name,
+                              name_length);
+            if (entry == NULL || !fat_is_directory(*entry)) {
+                warnx("There is no directory with name %.*s",
+                      (int) component_length, component);
+                free(normalised);
+                return NOT_FOUND_ERR;
+            }
+
+            // ".." entries contain 0 when they lead to the root directory
+            cluster_nr = fat_first_cluster(fs_info, *entry);
+            if (cluster_nr == 0) {
+                cluster_nr = fs_info->root_cluster_nr;
+            }
+            add_dentry(fs_info->dirs, normalised, hash, cluster_nr);
+        }
+
+        component += component_length;
+    }
+
+    free(normalised);
+    *dir_cluster_nr = cluster_nr;
+    return 0;
+}
+
+// Store the entry of the file at the specified path, which is relative to the
+// root directory, in *file_entry. Returns 0 on success and NOT_FOUND_ERR if
+// there is no such file.
+int fat_find_file(struct fat_info *fs_info, const char *path,
+                  struct fat_dir_info *file_entry)
+{
+    // Split the path into the directory and the name in it
+    char *dir_path = strdup(path);
+    if (dir_path == NULL) {
+        err(INPUT_ERR, "Cannot allocate path buffer");
+    }
+    size_t length = strlen(dir_path);
+    while (length > 0 && dir_path[length - 1] == PATH_DELIM) {
+        dir_path[--length] = '\0';
+    }
+    char *name = strrchr(dir_path, PATH_DELIM);
+    if (name == NULL) {
+        name = dir_path;
+    }
+    else {
+        *name++ = '\0';
+    }
+
+    // Look the name up in the directory's index
+    char *normalised = malloc(strlen(name) + 1);
+    if (normalised == NULL) {
+        err(INPUT_ERR, "Cannot allocate path buffer");
+    }
+    size_t name_length = normalise_name(normalised, name, strlen(name));
+    const struct fat_dir_info *entry = NULL;
+    u_int32_t cluster_nr;
+    int status = 0;
+    if (name_length > 0) {
+        status = fat_find_dir(fs_info, name == dir_path ? "" : dir_path,
+                              &cluster_nr);
+        if (status == 0) {
+            entry = lookup_name(get_dir_index(fs_info, cluster_nr),
+                                normalised, name_length);
+        }
+    }
+    if (status == 0 && entry == NULL) {
+        warnx("There is no file with name %s", path);
+        status = NOT_FOUND_ERR;
+    }
+    else if (status == 0 && fat_is_directory(*entry)) {
+        warnx("%s is a directory", path);
+        status = NOT_FOUND_ERR;
+    }
+    if (status == 0) {
+        *file_entry = *entry;
+    }
+
+    free(normalised);
+    free(dir_path);
+    return status;
+}
+
+/*
+ * Write the contents of the file with the specified entry, which was found at
+ * path, to out_fd. The clusters of the file are copied run by run, where
+ * consecutive extents of the chain are merged into one run, so a file that
+ * isn't fragmented costs a single copy_file_range (or write, if the kernel
+ * can't copy to out_fd). Returns 0 on success, INPUT_ERR if the chain is too
+ * short for the file and OUTPUT_ERR if writing fails.
+ */
+int fat_extract(struct fat_info *fs_info, struct fat_dir_info entry,
+                int out_fd, const char *path)
+{
+    u_int64_t cluster_bytes = (u_int64_t) fs_info->SecPerClus
+                              * fs_info->BytsPerSec;
+    u_int64_t left = entry.FileSize;
+    if (left == 0) {
+        return 0;
+    }
+
+    // Only a regular file is guaranteed to work as target of copy_file_range
+    struct stat out_stat;
+    int copy_range = fstat(out_fd, &out_stat) == 0
+                     && S_ISREG(out_stat.st_mode);
+
+    const struct cluster_chain *chain
+        = get_chain(fs_info, fat_first_cluster(fs_info, entry));
+    u_int32_t extent_nr = 0;
+    while (left > 0) {
+        if (extent_nr == chain->extent_cnt) {
+            warnx("The cluster chain of %s ends before the end of the file",
+                  path);
+            return INPUT_ERR;
+        }
+
+        // Merge the extents that follow each other on disk
+        u_int32_t run_first = chain->extents[extent_nr].first_cluster_nr;
+        u_int64_t run_cluster_cnt = 0;
+        do {
+            run_cluster_cnt += chain->extents[extent_nr].cluster_cnt;
+            ++extent_nr;
+        } while (extent_nr < chain->extent_cnt
+                 && chain->extents[extent_nr].first_cluster_nr
+                    == run_first + run_cluster_cnt
+                 && run_cluster_cnt * cluster_bytes < left);
+
+        // Copy them, or the part of them the file still covers
+        u_int64_t run_bytes = run_cluster_cnt * cluster_bytes;
+        if (run_bytes > left) {
+            run_bytes = left;
+        }
+        u_int64_t offset = sec_to_offset(fs_info,
+                                         cluster_to_sec(fs_info, run_first));
+        image_bytes(fs_info, offset, run_bytes);
+        int status = copy_run(fs_info, offset, run_bytes, out_fd,
+                              &copy_range);
+        if (status != 0) {
+            return status;
+        }
+        left -= run_bytes;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the length bytes at offset in the image to out_fd. Lets the kernel
+ * copy if *copy_range is set and writes from the mapping otherwise; clears
+ * *copy_range if copy_file_range can't be used for the next run either.
+ * Returns 0 on success and INPUT_ERR or OUTPUT_ERR if reading or writing
+ * fails.
+ */
+static int copy_run(const struct fat_info *fs_info, u_int64_t offset,
+                    u_int64_t length, int out_fd, int *copy_range)
+{
+    loff_t in_offset = offset;
+    while (*copy_range && length > 0) {
+        ssize_t copied = copy_file_range(fs_info->image_fd, &in_offset,
+                                         out_fd, NULL,
+                                         length < COPY_CHUNK ? length
+                                                             : COPY_CHUNK,
+                                         0);
+        if (copied == -1) {
+            switch (errno) {
+            case EINVAL:        // e.g. out_fd opened with O_APPEND
+            case EXDEV:         // Across filesystems on old kernels
+            case ENOSYS:        // System call not available at all
+            case EOPNOTSUPP:    // Filesystem doesn't implement it
+            case EBADF:
+                *copy_range = 0;
+                break;
+            default:
+                warn("Cannot write file contents");
+                return OUTPUT_ERR;
+            }
+        }
+        else if (copied == 0) {
+            warnx("Image ends before offset %llu",
+                  (unsigned long long) in_offset);
+            return INPUT_ERR;
+        }
+        else {
+            length -= copied;
+        }
+    }
+
+    // Write what is left from the mapping, telling the kernel to read ahead
+    if (length > 0) {
+        prefetch(fs_info, in_offset, length);
+        return write_all(out_fd, fs_info->image + in_offset, length);
+    }
+
+    return 0;
+}
+
+// Write all of the length bytes at data to fd. Returns 0 on success and
+// OUTPUT_ERR if writing fails.
+static int write_all(int fd, const unsigned char *data, u_int64_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data,
+                                length < COPY_CHUNK ? length : COPY_CHUNK);
+        if (written == -1) {
+            warn("Cannot write file contents");
+            return OUTPUT_ERR;
+        }
+
+        data   += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Return the index of the directory at cluster_nr, building it the first
+// time it is asked for
+static const struct dir_index *get_dir_index(const struct fat_info *fs_info,
+                                             u_int32_t cluster_nr)
+{
+    struct dir_cache *cache = fs_info->dirs;
+    pthread_mutex_lock(&cache->lock);
+
+    // Look for the index in the cache
+    u_int32_t bucket_nr = hash_cluster(cluster_nr, cache->dir_bucket_cnt);
+    struct dir_index *index;
+    for (index = cache->dirs[bucket_nr]; index != NULL; index = index->next) {
+        if (index->cluster_nr == cluster_nr) {
+            pthread_mutex_unlock(&cache->lock);
+            return index;
+        }
+    }
+
+    // Build it and remember it otherwise. The lock is held all the while,
+    // since building the same index twice would be wasted work.
+    index = build_dir_index(fs_info, cluster_nr);
+    if (cache->dir_cnt == cache->dir_bucket_cnt) {
+        u_int32_t bucket_cnt = 2 * cache->dir_bucket_cnt;
+        struct dir_index **buckets = calloc(bucket_cnt,
+                                            sizeof(struct dir_index *));
+        if (buckets == NULL) {
+            err(INPUT_ERR, "Cannot allocate directory cache");
+        }
+        for (u_int32_t i = 0; i < cache->dir_bucket_cnt; ++i) {
+            struct dir_index *moved = cache->dirs[i];
+            while (moved != NULL) {
+                struct dir_index *next = moved->next;
+                u_int32_t nr = hash_cluster(moved->cluster_nr, bucket_cnt);
+                moved->next = buckets[nr];
+                buckets[nr] = moved;
+                moved = next;
+            }
+        }
+        free(cache->dirs);
+        cache->dirs           = buckets;
+        cache->dir_bucket_cnt = bucket_cnt;
+        bucket_nr = hash_cluster(cluster_nr, bucket_cnt);
+    }
+    index->next = cache->dirs[bucket_nr];
+    cache->dirs[bucket_nr] = index;
+    ++(cache->dir_cnt);
+
+    pthread_mutex_unlock(&cache->lock);
+    return index;
+}
+
+// Read the directory at cluster_nr once and hash all of its entries by their
+// normalised names
+static struct dir_index *build_dir_index(const struct fat_info *fs_info,
+                                         u_int32_t cluster_nr)
+{
+    struct dir_index *index = calloc(1, sizeof(struct dir_index));
+    if (index == NULL) {
+        err(INPUT_ERR, "Cannot allocate directory index");
+    }
+    index->cluster_nr = cluster_nr;
+
+    // Collect the entries and their names
+    u_int32_t capacity = 0;
+    size_t names_length = 0, names_capacity = 0;
+    struct dir_entry_iterator_state dit_state
+        = new_dir_entry_iterator(fs_info, cluster_nr);
+    struct fat_dir_info entry;
+    while (! is_no_more_entries(entry = next_dir_entry(fs_info, &dit_state))) {
+        if (index->entry_cnt == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            index->entries = realloc(index->entries,
+                                     capacity * sizeof(struct indexed_entry));
+            if (index->entries == NULL) {
+                err(INPUT_ERR, "Cannot allocate directory index");
+            }
+        }
+        if (names_length + LONG_NAME_BYTES + FAT_NAME_BYTES + 2
+                > names_capacity) {
+            names_capacity = names_capacity == 0 ? 4096 : 2 * names_capacity;
+            index->names = realloc(index->names, names_capacity);
+            if (index->names == NULL) {
+                err(INPUT_ERR, "Cannot allocate directory index");
+            }
+        }
+
+        // Index the entry under its short name and, if it has one, under its
+        // long name. Both are stored after each other, so the name of an
+        // entry can be told from its offset.
+        char pretty_name[FAT_NAME_BYTES + 1];
+        sprint_filename(pretty_name, entry.name);
+        const char *long_name = entry.long_name;
+        entry.long_name = NULL;  // Points into the iterator
+
+        const char *names[2] = {pretty_name, long_name};
+        for (int i = 0; i < 2 && names[i] != NULL; ++i) {
+            if (i == 1 && index->entry_cnt == capacity) {
+                capacity *= 2;
+                index->entries = realloc(index->entries, capacity
+                                         * sizeof(struct indexed_entry));
+                if (index->entries == NULL) {
+                    err(INPUT_ERR, "Cannot allocate directory index");
+                }
+            }
+
+            char *name = index->names + names_length;
+            size_t name_length = normalise_name(name, names[i],
+                                                strlen(names[i]));
+            name[name_length] = '\0';
+
+            struct indexed_entry *indexed = &index->entries[index->entry_cnt];
+            indexed->hash        = hash_name(FNV_BASIS, name, name_length);
+            indexed->name_offset = names_length;
+            indexed->entry       = entry;
+            ++(index->entry_cnt);
+            names_length += name_length + 1;
+        }
+    }
+
+    // Hash them into a table that is at most half full. The first of several
+    // entries with the same name wins.
+    index->slot_cnt = 8;
+    while (index->slot_cnt < 2 * index->entry_cnt) {
+        index->slot_cnt *= 2;
+    }
+    index->slots = calloc(index->slot_cnt, sizeof(u_int32_t));
+    if (index->slots == NULL) {
+        err(INPUT_ERR, "Cannot allocate directory index");
+    }
+    for (u_int32_t i = 0; i < index->entry_cnt; ++i) {
+        const char *name = index->names + index->entries[i].name_offset;
+        if (lookup_name(index, name, strlen(name)) != NULL) {
+            continue;
+        }
+        u_int32_t slot = index->entries[i].hash & (index->slot_cnt - 1);
+        while (index->slots[slot] != 0) {
+            slot = (slot + 1) & (index->slot_cnt - 1);
+        }
+        index->slots[slot] = i + 1;
+    }
+
+    return index;
+}
+
+// Return the entry with the specified normalised name in the index, or NULL if
+// there is none
+static const struct fat_dir_info *lookup_name(const struct dir_index *index,
+                                              const char *name,
+                                              u_int32_t length)
+{
+    u_int32_t hash = hash_name(FNV_BASIS, name, length);
+    u_int32_t slot = hash & (index->slot_cnt - 1);
+    while (index->slots[slot] != 0) {
+        const struct indexed_entry *indexed
+            = &index->entries[index->slots[slot] - 1];
+        const char *indexed_name = index->names + indexed->name_offset;
+        if (indexed->hash == hash && strncmp(indexed_name, name, length) == 0
+                && indexed_name[length] == '\0') {
+            return &indexed->entry;
+        }
+        slot = (slot + 1) & (index->slot_cnt - 1);
+    }
+
+    return NULL;
+}
+
+// Look up the normalised path with the specified hash among the dentries and
+// store its cluster in *cluster_nr. Returns 1 if it was found and 0 otherwise.
+static int find_dentry(struct dir_cache *cache, const char *path,
+                       u_int32_t hash, u_int32_t *cluster_nr)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct dentry *dentry = cache->dentries[hash
+                                            & (cache->dentry_bucket_cnt - 1)];
+    while (dentry != NULL
+            && (dentry->hash != hash || strcmp(dentry->path, path) != 0)) {
+        dentry = dentry->next;
+    }
+    if (dentry != NULL) {
+        *cluster_nr = dentry->cluster_nr;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return dentry != NULL;
+}
+
+// Remember that the normalised path with the specified hash leads to the
+// directory at cluster_nr
+static void add_dentry(struct dir_cache *cache, const char *path,
+                       u_int32_t hash, u_int32_t cluster_nr)
+{
+    struct dentry *dentry = malloc(sizeof(struct dentry));
+    if (dentry == NULL || (dentry->path = strdup(path)) == NULL) {
+        err(INPUT_ERR, "Cannot allocate dentry");
+    }
+    dentry->hash       = hash;
+    dentry->cluster_nr = cluster_nr;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->dentry_cnt == cache->dentry_bucket_cnt) {
+        u_int32_t bucket_cnt = 2 * cache->dentry_bucket_cnt;
+        struct dentry **buckets = calloc(bucket_cnt, sizeof(struct dentry *));
+        if (buckets == NULL) {
+            err(INPUT_ERR, "Cannot allocate dentry cache");
+        }
+        for (u_int32_t i = 0; i < cache->dentry_bucket_cnt; ++i) {
+            struct dentry *moved = cache->dentries[i];
+            while (moved != NULL) {
+                struct dentry *next = moved->next;
+                moved->next = buckets[moved->hash & (bucket_cnt - 1)];
+                buckets[moved->hash & (bucket_cnt - 1)] = moved;
+                moved = next;
+            }
+        }
+        free(cache->dentries);
+        cache->dentries          = buckets;
+        cache->dentry_bucket_cnt = bucket_cnt;
+    }
+    u_int32_t bucket_nr = hash & (cache->dentry_bucket_cnt - 1);
+    dentry->next = cache->dentries[bucket_nr];
+    cache->dentries[bucket_nr] = dentry;
+    ++(cache->dentry_cnt);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Create an empty directory cache
+static struct dir_cache *new_dir_cache(void)
+{
+    struct dir_cache *cache = calloc(1, sizeof(struct dir_cache));
+    if (cache == NULL) {
+        err(INPUT_ERR, "Cannot allocate directory cache");
+    }
+    cache->dir_bucket_cnt    = INITIAL_DIR_BUCKETS;
+    cache->dentry_bucket_cnt = INITIAL_DIR_BUCKETS;
+    cache->dirs     = calloc(INITIAL_DIR_BUCKETS, sizeof(struct dir_index *));
+    cache->dentries = calloc(INITIAL_DIR_BUCKETS, sizeof(struct dentry *));
+    if (cache->dirs == NULL || cache->dentries == NULL) {
+        err(INPUT_ERR, "Cannot allocate directory cache");
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+// Release the cache with all indexes and dentries in it
+static void free_dir_cache(struct dir_cache *cache)
+{
+    for (u_int32_t i = 0; i < cache->dir_bucket_cnt; ++i) {
+        struct dir_index *index = cache->dirs[i];
+        while (index != NULL) {
+            struct dir_index *next = index->next;
+            free(index->entries);
+            free(index->slots);
+            free(index->names);
+            free(index);
+            index = next;
+        }
+    }
+    for (u_int32_t i = 0; i < cache->dentry_bucket_cnt; ++i) {
+        struct dentry *dentry = cache->dentries[i];
+        while (dentry != NULL) {
+            struct dentry *next = dentry->next;
+            free(dentry->path);
+            free(dentry);
+            dentry = next;
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->dirs);
+    free(cache->dentries);
+    free(cache);
+}
+
+// Write the length characters of name to out as they are compared in lookups,
+// that is in upper case, and return their number
+static size_t normalise_name(char *out, const char *name, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        out[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A'
+                                                      : name[i];
+    }
+
+    return length;
+}
+
+// Return the bucket for cluster_nr in a hash table with bucket_cnt buckets,
+// which must be a power of two
+static u_int32_t hash_cluster(u_int32_t cluster_nr, u_int32_t bucket_cnt)
+{
+    // Multiplicative hashing spreads the consecutive numbers of clusters
+    return (cluster_nr * 2654435761u) & (bucket_cnt - 1);
+}
+
+// Continue the FNV-1a hash value hash over the length bytes at name
+static u_int32_t hash_name(u_int32_t hash, const char *name, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Read the whole tree below the directory at cluster_nr into root with
+// job_cnt threads. The tree has to be released with fat_free_tree.
+void fat_read_tree(struct fat_info *fs_info, u_int32_t cluster_nr, int job_cnt,
+                   struct tree_node *root)
+{
+    /*
+     * Every directory is a task. Reading a directory creates a task for each
+     * of its subdirectories, which the worker puts into its own deque; idle
+     * workers steal from the others.
+     */
+    struct list_pool pool;
+    pool.fs_info    = fs_info;
+    pool.worker_cnt = job_cnt;
+    pool.queued     = 0;
+    pool.unfinished = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_available, NULL);
+
+    pool.visited = calloc((fs_info->cluster_cnt + 2 + 63) / 64,
+                          sizeof(u_int64_t));
+    pool.deques  = calloc(job_cnt, sizeof(struct task_deque));
+    if (pool.visited == NULL || pool.deques == NULL) {
+        err(INPUT_ERR, "Cannot allocate work queues");
+    }
+    for (int i = 0; i < job_cnt; ++i) {
+        pool.deques[i].capacity = 64;
+        pool.deques[i].tasks    = malloc(64 * sizeof(struct tree_node *));
+        if (pool.deques[i].tasks == NULL) {
+            err(INPUT_ERR, "Cannot allocate work queues");
+        }
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    // The directory itself is the first task
+    memset(root, 0, sizeof(struct tree_node));
+    root->name = ".";
+    root->entry.Attr      = FAT_ATTR_DIRECTORY;
+    root->entry.FstClusHI = cluster_nr >> 16;
+    root->entry.FstClusLO = cluster_nr & 0xffff;
+
+    // A broken start cluster leaves nothing to read, so then there is no
+    // task at all and the workers stop right away
+    if ((cluster_nr == 0 && fs_info->type != FAT32)
+            || !fat_is_eoc(fs_info, cluster_nr)) {
+        mark_visited(&pool, cluster_nr);
+        push_task(&pool, 0, root);
+    }
+
+    // Start the workers and wait until they have read the whole tree. A
+    // single worker runs in the calling thread, which saves creating a
+    // thread for every small image when many are read at once.
+    struct list_worker *workers = calloc(job_cnt, sizeof(struct list_worker));
+    if (workers == NULL) {
+        err(INPUT_ERR, "Cannot allocate worker threads");
+    }
+    for (int i = 0; i < job_cnt; ++i) {
+        workers[i].pool = &pool;
+        workers[i].nr   = i;
+    }
+    if (job_cnt == 1) {
+        list_worker(&workers[0]);
+    }
+    else {
+        for (int i = 0; i < job_cnt; ++i) {
+            errno = pthread_create(&workers[i].thread, NULL, list_worker,
+                                   &workers[i]);
+            if (errno != 0) {
+                err(INPUT_ERR, "Cannot start worker thread");
+            }
+        }
+        for (int i = 0; i < job_cnt; ++i) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    for (int i = 0; i < job_cnt; ++i) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+
+    // Clean up
+    pthread_cond_destroy(&pool.work_available);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.deques);
+    free(pool.visited);
+}
+
+// Read directories until the whole tree is known
+static void *list_worker(void *arg)
+{
+    struct list_worker *worker = arg;
+
+    struct tree_node *node;
+    while ((node = take_task(worker->pool, worker->nr)) != NULL) {
+        read_tree_dir(worker->pool, worker->nr, node);
+        finish_task(worker->pool);
+    }
+
+    return NULL;
+}
+
+// Take the next directory of worker nr, or steal one. Returns NULL when all
+// work is done.
+static struct tree_node *take_task(struct list_pool *pool, int nr)
+{
+    while (1) {
+        // Own tasks from the back
+        struct task_deque *own = &pool->deques[nr];
+        struct tree_node *node = NULL;
+        pthread_mutex_lock(&own->lock);
+        if (own->tail > own->head) {
+            node = own->tasks[--own->tail % own->capacity];
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        // Others' tasks from the front
+        for (int i = 1; node == NULL && i < pool->worker_cnt; ++i) {
+            struct task_deque *other
+                = &pool->deques[(nr + i) % pool->worker_cnt];
+            pthread_mutex_lock(&other->lock);
+            if (other->tail > other->head) {
+                node = other->tasks[other->head++ % other->capacity];
+            }
+            pthread_mutex_unlock(&other->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (node != NULL) {
+            --pool->queued;
+            pthread_mutex_unlock(&pool->lock);
+            return node;
+        }
+
+        // Wait until someone has work to steal or everything is done
+        while (pool->queued == 0 && pool->unfinished > 0) {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+        int all_done = pool->unfinished == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (all_done) {
+            return NULL;
+        }
+    }
+}
+
+// Put node at the back of the deque of worker nr
+static void push_task(struct list_pool *pool, int nr, struct tree_node *node)
+{
+    // Count the task before it can be stolen, so that queued can't drop
+    // below zero and unfinished can't reach zero while it's being pushed
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    ++pool->unfinished;
+    pthread_mutex_unlock(&pool->lock);
+
+    struct task_deque *deque = &pool->deques[nr];
+    pthread_mutex_lock(&deque->lock);
+
+    // Grow the ring, moving its contents to the same positions modulo the
+    // new capacity
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t new_capacity = 2 * deque->capacity;
+        struct tree_node **tasks = malloc(new_capacity
+                                          * sizeof(struct tree_node *));
+        if (tasks == NULL) {
+            err(INPUT_ERR, "Cannot allocate work queues");
+        }
+        for (size_t i = deque->head; i < deque->tail; ++i) {
+            tasks[i % new_capacity] = deque->tasks[i % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks    = tasks;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[deque->tail++ % deque->capacity] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Count a directory as read and wake everyone up if it was the last one
+static void finish_task(struct list_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->unfinished == 0) {
+        pthread_cond_broadcast(&pool->work_available);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Read the entries of the directory at node into its sorted children and hand
+// the subdirectories to worker nr
+static void read_tree_dir(struct list_pool *pool, int nr,
+                          struct tree_node *node)
+{
+    const struct fat_info *fs_info = pool->fs_info;
+    u_int32_t capacity = 0;
+    size_t names_length = 0, names_capacity = 0;
+
+    struct dir_entry_iterator_state dit_state
+        = new_dir_entry_iterator(fs_info,
+                                 fat_first_cluster(fs_info, node->entry));
+    struct fat_dir_info entry;
+    while (! is_no_more_entries(entry = next_dir_entry(fs_info, &dit_state))) {
+        // Skip "." and "..", which would lead back up
+        if (entry.name[0] == '.') {
+            continue;
+        }
+
+        if (node->child_cnt == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            node->children = realloc(node->children,
+                                     capacity * sizeof(struct tree_node));
+            if (node->children == NULL) {
+                err(INPUT_ERR, "Cannot allocate directory tree");
+            }
+        }
+        struct tree_node *child = &node->children[node->child_cnt++];
+        memset(child, 0, sizeof(struct tree_node));
+
+        // Keep the name with the others
+        char pretty_name[FAT_NAME_BYTES + 1];
+        const char *name = fat_display_name(entry, pretty_name);
+        size_t name_bytes = strlen(name) + 1;
+        if (names_length + name_bytes > names_capacity) {
+            names_capacity = 2 * (names_length + name_bytes);
+            node->names = realloc(node->names, names_capacity);
+            if (node->names == NULL) {
+                err(INPUT_ERR, "Cannot allocate directory tree");
+            }
+        }
+        memcpy(node->names + names_length, name, name_bytes);
+        names_length += name_bytes;
+
+        child->entry = entry;
+        child->entry.long_name = NULL;  // Points into the iterator
+    }
+
+    // The names have stopped moving, so the children can point to them
+    char *name = node->names;
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        node->children[i].name = name;
+        name += strlen(name) + 1;
+    }
+    if (node->child_cnt > 1) {
+        qsort(node->children, node->child_cnt, sizeof(struct tree_node),
+              compare_nodes);
+    }
+
+    // The children don't move anymore, so the subdirectories can be handed
+    // out now. Each directory is only entered once.
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        struct tree_node *child = &node->children[i];
+        if (!fat_is_directory(child->entry)) {
+            continue;
+        }
+        u_int32_t child_cluster_nr = fat_first_cluster(fs_info, child->entry);
+        if (fat_is_eoc(fs_info, child_cluster_nr)) {
+            continue;  // Broken, so there's nothing to read
+        }
+        if (mark_visited(pool, child_cluster_nr)) {
+            push_task(pool, nr, child);
+        }
+        else {
+            warnx("Directory %s starts at cluster %u, which belongs to "
+                  "another directory; not descending", child->name,
+                  child_cluster_nr);
+        }
+    }
+}
+
+// Set the visited bit of the specified cluster. Returns 1 if it wasn't set
+// before and 0 otherwise.
+static int mark_visited(struct list_pool *pool, u_int32_t cluster_nr)
+{
+    u_int64_t bit = (u_int64_t) 1 << (cluster_nr % 64);
+    u_int64_t old = __atomic_fetch_or(&pool->visited[cluster_nr / 64], bit,
+                                      __ATOMIC_RELAXED);
+    return (old & bit) == 0;
+}
+
+// Compare two tree nodes by name for qsort
+static int compare_nodes(const void *a, const void *b)
+{
+    return strcmp(((const struct tree_node *) a)->name,
+                  ((const struct tree_node *) b)->name);
+}
+
+// Release the children below node
+void fat_free_tree(struct tree_node *node)
+{
+    for (u_int32_t i = 0; i < node->child_cnt; ++i) {
+        fat_free_tree(&node->children[i]);
+    }
+    free(node->children);
+    free(node->names);
+}
+
+// Construct an iterator for traversing the directory starting at cluster
+// cluster_nr, where 0 stands for the fixed root directory region of
+// FAT12/FAT16
+static struct dir_entry_iterator_state new_dir_entry_iterator(
+        const struct fat_info *fs_info, u_int32_t cluster_nr)
+{
+    struct dir_entry_iterator_state dit_state;
+
+    // Set some values depending on whether we're in the root directory or not
+    if (cluster_nr == 0 && fs_info->type != FAT32) {
+        dit_state.is_root_dir = 1;
+        dit_state.chain       = NULL;
+    }
+    else {
+        dit_state.is_root_dir = 0;
+        dit_state.chain       = get_chain(fs_info, cluster_nr);
+    }
+    dit_state.extent_nr     = 0;
+    dit_state.lfn_next      = -1;
+    dit_state.lfn_entry_cnt = 0;
+    load_extent(fs_info, &dit_state);
+        // See above for descriptions of the struct's fields
+
+    return dit_state;
+}
+
+// Look whether there are more entries in the traversed directory.
+static struct fat_dir_info next_dir_entry(
+        const struct fat_info *fs_info,
+        struct dir_entry_iterator_state *dit_state)
+{
+    while (1) {
+        // Increment entry number
+        ++(dit_state->entry_nr);
+
+        // Check whether we're at the end of an extent
+        if (dit_state->entry_nr == dit_state->max_entry_cnt) {
+            // We have no more entries if we're at the end of the root
+            // directory or the last extent of the chain
+            if (dit_state->is_root_dir
+                    || dit_state->extent_nr + 1
+                       >= dit_state->chain->extent_cnt) {
+                --(dit_state->entry_nr);
+                    // So that we're at the same entry in the next call
+                return no_more_entries();
+            }
+
+            // Otherwise go to the next extent in the chain
+            ++(dit_state->extent_nr);
+            load_extent(fs_info, dit_state);
+            dit_state->entry_nr = 0;
+        }
+
+        // Locate the current entry in the extent
+        const unsigned char *raw_entry
+            = dit_state->entries + dit_state->entry_nr * DIR_ENT_BYTES;
+
+        // Stop if we are at a last directory entry
+        if (raw_entry[0] == 0x00) {
+            --(dit_state->entry_nr);
+                // So that we're at the same entry in the next call
+            return no_more_entries();
+        }
+
+        // Skip the entry if it is empty, which also breaks a long name
+        if (raw_entry[0] == 0xe5) {
+            dit_state->lfn_next = -1;
+            continue;
+        }
+
+        // Collect the parts of a long name
+        if ((raw_entry[11] & 0x3f) == LFN_ATTR) {
+            add_lfn_entry(dit_state, raw_entry);
+            continue;
+        }
+
+        // Skip the VOLUME_ID entry
+        if ((raw_entry[11] & 0x08) != 0) {
+            dit_state->lfn_next = -1;
+            continue;
+        }
+
+        // Decode the current directory entry together with its long name
+        struct fat_dir_info entry = read_dir_entry(raw_entry);
+        entry.long_name = finish_long_name(dit_state, raw_entry);
+        return entry;
+    }
+}
+
+// Point the iterator at the entries of its current extent (or of the whole
+// root directory) and ask the kernel to read ahead the extent after it
+static void load_extent(const struct fat_info *fs_info,
+                        struct dir_entry_iterator_state *dit_state)
+{
+    u_int64_t extent_bytes;
+    if (dit_state->is_root_dir) {
+        dit_state->max_entry_cnt  = fs_info->RootEntCnt;
+        dit_state->cluster_nr     = 0;
+        dit_state->cluster_offset = sec_to_offset(
+                                        fs_info,
+                                        fs_info->first_root_dir_sec_num
+                                    );
+    }
+    else if (dit_state->extent_nr < dit_state->chain->extent_cnt) {
+        const struct chain_extent *extent
+            = &dit_state->chain->extents[dit_state->extent_nr];
+        dit_state->max_entry_cnt  = extent->cluster_cnt
+                                    * fs_info->dir_ents_per_cluster;
+        dit_state->cluster_nr     = extent->first_cluster_nr;
+        dit_state->cluster_offset
+            = sec_to_offset(fs_info,
+                            cluster_to_sec(fs_info, dit_state->cluster_nr));
+    }
+    else {
+        // An empty or broken chain
+        dit_state->max_entry_cnt  = 0;
+        dit_state->cluster_nr     = 0;
+        dit_state->cluster_offset = 0;
+    }
+
+    extent_bytes = (u_int64_t) dit_state->max_entry_cnt * DIR_ENT_BYTES;
+    dit_state->entries = image_bytes(fs_info, dit_state->cluster_offset,
+                                     extent_bytes);
+    dit_state->entry_nr = -1;
+
+    if (!dit_state->is_root_dir
+            && dit_state->extent_nr + 1 < dit_state->chain->extent_cnt) {
+        const struct chain_extent *next
+            = &dit_state->chain->extents[dit_state->extent_nr + 1];
+        u_int32_t next_sec = cluster_to_sec(fs_info, next->first_cluster_nr);
+        prefetch(fs_info, sec_to_offset(fs_info, next_sec),
+                 (u_int64_t) next->cluster_cnt * fs_info->SecPerClus
+                 * fs_info->BytsPerSec);
+    }
+}
+
+// Tell the kernel that the length bytes at offset in the image will be needed
+// soon. This is only a hint, so failure doesn't matter.
+static void prefetch(const struct fat_info *fs_info, u_int64_t offset,
+                     u_int64_t length)
+{
+    // madvise wants a page-aligned start
+    u_int64_t skew = offset % fs_info->page_size;
+
+    if (offset < fs_info->image_size) {
+        if (length > fs_info->image_size - offset) {
+            length = fs_info->image_size - offset;
+        }
+        madvise((void *) (fs_info->image + offset - skew), length + skew,
+                MADV_WILLNEED);
+    }
+}
+
+// Return the number of the first sector of the specified cluster number
+static u_int32_t cluster_to_sec(const struct fat_info *fs_info,
+                                u_int32_t cluster_nr)
+{
+    // Cluster number 0 indicates root directory
+    if (cluster_nr == 0) {
+        return fs_info->first_root_dir_sec_num;
+    }
+
+    return (cluster_nr - 2) * fs_info->SecPerClus + fs_info->first_data_sector;
+}
+
+// Return the byte offset of the specified sector number
+static u_int64_t sec_to_offset(const struct fat_info *fs_info,
+                               u_int32_t sec_nr)
+{
+    return (u_int64_t) sec_nr * fs_info->BytsPerSec;
+}
+
+// Generate return value for exhausted directory iterator
+static struct fat_dir_info no_more_entries()
+{
+    struct fat_dir_info nme;
+    nme.long_name = NULL;
+    nme.Attr      = NO_MORE_ENTRIES_ATTR;
+    nme.FstClusHI = NO_MORE_ENTRIES_FCL;
+    nme.FstClusLO = NO_MORE_ENTRIES_FCL;
+    return nme;
+}
+
+// Check whether the specified entry indicates an exhausted iterator
+static int is_no_more_entries(struct fat_dir_info dir_info)
+{
+    if (dir_info.Attr == NO_MORE_ENTRIES_ATTR
+            && dir_info.FstClusHI == NO_MORE_ENTRIES_FCL
+            && dir_info.FstClusLO == NO_MORE_ENTRIES_FCL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Convert a filename from the FAT format to a *.* format
+static void sprint_filename(char *out_name, char *in_name)
+{
+    /*
+     * Let in_name be "PICKLE__A__" (_ indicate blanks).
+     * First we clean out out_name, so that it is "0000000000000".
+     * Then we copy over the first part, so that out_name is "PICKLE__00000"
+     * now. We place a dot and the extension at the end of it: "PICKLE.A__000"
+     * Last, we remove trailing whitespace: "PICKLE.A0_000".
+     */
+
+    // Clean the output name
+    memset(out_name, 0, FAT_NAME_BYTES + 1);
+
+    // Copy the first part of the FAT name into the ouput
+    strncpy(out_name, in_name, 8);
+
+    // Locate the end of the first part (which has no blank if it is eight
+    // characters long)
+    char *first_end = out_name + strcspn(out_name, "\x20");
+
+    // Place a dot there and the extension (if there is one)
+    if (*(in_name + 8) != 0x20) {
+        *first_end = '.';
+        strncpy(first_end + 1, in_name + 8, 3);
+    }
+
+    // Remove possible whitespace
+    char *end = strchr(out_name, 0x20);
+    if (end != NULL) {
+        *end = '\0';
+    }
+}
+
+// Return the name of entry as it is shown: the long name if there is one and
+// the short name in *.* format, written to pretty_name, otherwise
+const char *fat_display_name(struct fat_dir_info entry, char *pretty_name)
+{
+    if (entry.long_name != NULL) {
+        return entry.long_name;
+    }
+
+    sprint_filename(pretty_name, entry.name);
+    return pretty_name;
+}
+
+// Return the FAT entry of the specified cluster, that is the number of the
+// cluster after it in the chain
+u_int32_t fat_next_cluster(const struct fat_info *fs_info,
+                           u_int32_t cluster_nr)
+{
+    // A chain leading outside of the data region is broken, so end it there
+    if (cluster_nr < 2 || cluster_nr >= fs_info->cluster_cnt + 2) {
+        return 0x0fffffff;
+    }
+
+    switch (fs_info->type) {
+    case FAT12: {
+        // Two entries share three bytes
+        u_int16_t entry = image_16(fs_info, fs_info->fat_offset + cluster_nr
+                                            + cluster_nr / 2);
+        return (cluster_nr & 1) ? entry >> 4 : entry & 0x0fff;
+    }
+    case FAT16:
+        return image_16(fs_info,
+                        fs_info->fat_offset + 2 * (u_int64_t) cluster_nr);
+    default:
+        // The upper four bits are reserved
+        return image_32(fs_info,
+                        fs_info->fat_offset + 4 * (u_int64_t) cluster_nr)
+               & 0x0fffffff;
+    }
+}
+
+// Check whether the specified FAT entry ends a chain. Besides the EOC marks
+// (0xff8, 0xfff8 and 0x0ffffff8 upwards), this holds for free, bad and
+// reserved entries, which all lie outside of the range of cluster numbers.
+int fat_is_eoc(const struct fat_info *fs_info, u_int32_t fat_entry)
+{
+    if (fat_entry < 2 || fat_entry >= fs_info->cluster_cnt + 2) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Return the chain starting at the specified cluster, walking it through the
+// FAT only the first time it is asked for
+static const struct cluster_chain *get_chain(const struct fat_info *fs_info,
+                                             u_int32_t first_cluster_nr)
+{
+    struct chain_cache *cache = fs_info->chains;
+    struct cluster_chain *chain;
+
+    // Look for the chain in the cache
+    pthread_mutex_lock(&cache->lock);
+    u_int32_t bucket_nr = hash_cluster(first_cluster_nr, cache->bucket_cnt);
+    for (chain = cache->buckets[bucket_nr]; chain != NULL;
+            chain = chain->next) {
+        if (chain->first_cluster_nr == first_cluster_nr) {
+            pthread_mutex_unlock(&cache->lock);
+            return chain;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Walk it otherwise, without holding up the other threads
+    struct cluster_chain *new_chain = walk_chain(fs_info, first_cluster_nr);
+
+    // Remember it, unless another thread was faster
+    pthread_mutex_lock(&cache->lock);
+    bucket_nr = hash_cluster(first_cluster_nr, cache->bucket_cnt);
+    for (chain = cache->buckets[bucket_nr]; chain != NULL;
+            chain = chain->next) {
+        if (chain->first_cluster_nr == first_cluster_nr) {
+            break;
+        }
+    }
+    if (chain == NULL) {
+        if (cache->chain_cnt == cache->bucket_cnt) {
+            grow_chain_cache(cache);
+            bucket_nr = hash_cluster(first_cluster_nr, cache->bucket_cnt);
+        }
+        chain = new_chain;
+        new_chain = NULL;
+        chain->next = cache->buckets[bucket_nr];
+        cache->buckets[bucket_nr] = chain;
+        ++(cache->chain_cnt);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (new_chain != NULL) {
+        free(new_chain->extents);
+        free(new_chain);
+    }
+    return chain;
+}
+
+// Follow the chain starting at the specified cluster through the FAT and
+// collect its runs of consecutive clusters
+static struct cluster_chain *walk_chain(const struct fat_info *fs_info,
+                                        u_int32_t first_cluster_nr)
+{
+    struct cluster_chain *chain = malloc(sizeof(struct cluster_chain));
+    if (chain == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster chain");
+    }
+    chain->first_cluster_nr = first_cluster_nr;
+    chain->cluster_cnt      = 0;
+    chain->extent_cnt       = 0;
+    chain->extents          = NULL;
+    u_int32_t capacity = 0;
+
+    // A chain can't start with a value that would end it
+    if (fat_is_eoc(fs_info, first_cluster_nr)) {
+        return chain;
+    }
+
+    u_int32_t cluster_nr = first_cluster_nr;
+    while (1) {
+        // A chain longer than the number of clusters has to contain a loop.
+        // Nothing in it can be trusted, so it counts as empty.
+        if (chain->cluster_cnt == fs_info->cluster_cnt) {
+            warnx("The chain starting at cluster %u contains a loop",
+                  first_cluster_nr);
+            chain->cluster_cnt = 0;
+            chain->extent_cnt  = 0;
+            return chain;
+        }
+        ++(chain->cluster_cnt);
+
+        // Extend the last extent or start a new one
+        struct chain_extent *last = NULL;
+        if (chain->extent_cnt > 0) {
+            last = &chain->extents[chain->extent_cnt - 1];
+        }
+        if (last != NULL
+                && last->first_cluster_nr + last->cluster_cnt == cluster_nr
+                && last->cluster_cnt < MAX_EXTENT_CLUSTERS) {
+            ++(last->cluster_cnt);
+        }
+        else {
+            if (chain->extent_cnt == capacity) {
+                capacity = capacity == 0 ? 4 : 2 * capacity;
+                chain->extents = realloc(
+                                     chain->extents,
+                                     capacity * sizeof(struct chain_extent)
+                                 );
+                if (chain->extents == NULL) {
+                    err(INPUT_ERR, "Cannot allocate cluster chain");
+                }
+            }
+            chain->extents[chain->extent_cnt].first_cluster_nr = cluster_nr;
+            chain->extents[chain->extent_cnt].cluster_cnt      = 1;
+            ++(chain->extent_cnt);
+        }
+
+        // Go to the next cluster
+        cluster_nr = fat_next_cluster(fs_info, cluster_nr);
+        if (fat_is_eoc(fs_info, cluster_nr)) {
+            return chain;
+        }
+    }
+}
+
+// Double the number of buckets of the cache (or create the first ones) and
+// redistribute the chains
+static void grow_chain_cache(struct chain_cache *cache)
+{
+    u_int32_t bucket_cnt = cache->bucket_cnt == 0 ? INITIAL_CHAIN_BUCKETS
+                                                  : 2 * cache->bucket_cnt;
+    struct cluster_chain **buckets
+        = calloc(bucket_cnt, sizeof(struct cluster_chain *));
+    if (buckets == NULL) {
+        err(INPUT_ERR, "Cannot allocate chain cache");
+    }
+
+    for (u_int32_t i = 0; i < cache->bucket_cnt; ++i) {
+        struct cluster_chain *chain = cache->buckets[i];
+        while (chain != NULL) {
+            struct cluster_chain *next = chain->next;
+            u_int32_t bucket_nr = hash_cluster(chain->first_cluster_nr,
+                                               bucket_cnt);
+            chain->next = buckets[bucket_nr];
+            buckets[bucket_nr] = chain;
+            chain = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets    = buckets;
+    cache->bucket_cnt = bucket_cnt;
+}
+
+// Release the cache and all chains in it
+static void free_chain_cache(struct chain_cache *cache)
+{
+    for (u_int32_t i = 0; i < cache->bucket_cnt; ++i) {
+        struct cluster_chain *chain = cache->buckets[i];
+        while (chain != NULL) {
+            struct cluster_chain *next = chain->next;
+            free(chain->extents);
+            free(chain);
+            chain = next;
+        }
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+// Return the number of the first cluster of the specified entry. FAT12 and
+// FAT16 use the upper half for other purposes.
+u_int32_t fat_first_cluster(const struct fat_info *fs_info,
+                            struct fat_dir_info entry)
+{
+    if (fs_info->type == FAT32) {
+        return (u_int32_t) entry.FstClusHI << 16 | entry.FstClusLO;
+    }
+
+    return entry.FstClusLO;
+}
+
+// Decode the directory entry stored in the 32 bytes at raw_entry
+static struct fat_dir_info read_dir_entry(const unsigned char *raw_entry)
+{
+    // Copy the entry name
+    struct fat_dir_info dir_info;
+    memcpy(dir_info.name, raw_entry, FAT_NAME_BYTES - 1);
+    dir_info.name[FAT_NAME_BYTES - 1] = '\0';
+    dir_info.long_name = NULL;
+
+    // Read the attributes for the entry
+    dir_info.Attr = raw_entry[11];
+
+    // Read the cluster number the entry points to
+    dir_info.FstClusHI = get_16(raw_entry + 20);
+    dir_info.FstClusLO = get_16(raw_entry + 26);
+
+    // Read the size of the file
+    dir_info.FileSize = get_32(raw_entry + 28);
+
+    return dir_info;
+}
+
+/*
+ * Store the characters of the long name entry raw_entry in the iterator. The
+ * entries of a long name come before its short entry, the last part first:
+ *     0x43 "me.txt"           (sequence number 3 | LFN_LAST)
+ *     0x02 "s a rather long"
+ *     0x01 "This i"
+ *     short entry THISIS~1TXT
+ * Anything out of this order makes the long name invalid.
+ */
+static void add_lfn_entry(struct dir_entry_iterator_state *dit_state,
+                          const unsigned char *raw_entry)
+{
+    int seq_nr = raw_entry[0] & ~LFN_LAST;
+    if ((raw_entry[0] & LFN_LAST) != 0) {
+        // A new long name starts
+        dit_state->lfn_next      = seq_nr;
+        dit_state->lfn_entry_cnt = seq_nr;
+        dit_state->lfn_checksum  = raw_entry[13];
+    }
+    if (seq_nr < 1 || seq_nr > MAX_LFN_ENTRIES
+            || seq_nr != dit_state->lfn_next
+            || raw_entry[13] != dit_state->lfn_checksum) {
+        dit_state->lfn_next = -1;
+        return;
+    }
+
+    // The 13 units are spread over three fields of the entry
+    static const u_int8_t unit_offsets[LFN_UNITS_PER_ENTRY]
+        = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    u_int16_t *units
+        = dit_state->lfn_units + (seq_nr - 1) * LFN_UNITS_PER_ENTRY;
+    for (int i = 0; i < LFN_UNITS_PER_ENTRY; ++i) {
+        units[i] = get_16(raw_entry + unit_offsets[i]);
+    }
+    dit_state->lfn_next = seq_nr - 1;
+}
+
+// Return the long name collected for the short entry raw_entry in UTF-8, or
+// NULL if there is no valid one. Starts over for the next entry.
+static const char *finish_long_name(struct dir_entry_iterator_state *dit_state,
+                                    const unsigned char *raw_entry)
+{
+    int complete = dit_state->lfn_next == 0
+                   && dit_state->lfn_checksum == lfn_checksum(raw_entry);
+    dit_state->lfn_next = -1;
+    if (!complete) {
+        return NULL;
+    }
+
+    // The name ends with a 0 unit, unless it fills its last entry exactly
+    size_t unit_cnt = 0;
+    while (unit_cnt < (size_t) dit_state->lfn_entry_cnt * LFN_UNITS_PER_ENTRY
+            && dit_state->lfn_units[unit_cnt] != 0) {
+        ++unit_cnt;
+    }
+    if (unit_cnt == 0) {
+        return NULL;
+    }
+
+    utf16_to_utf8(dit_state->long_name, dit_state->lfn_units, unit_cnt);
+    return dit_state->long_name;
+}
+
+// Return the checksum of the 11 byte short name at raw_entry, which every
+// long name entry belonging to it repeats
+static u_int8_t lfn_checksum(const unsigned char *raw_entry)
+{
+    u_int8_t sum = 0;
+    for (int i = 0; i < 11; ++i) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + raw_entry[i];
+    }
+
+    return sum;
+}
+
+// Convert unit_cnt UTF-16 units to a NUL-terminated UTF-8 string at out,
+// which must have room for three bytes per unit and the NUL. Unpaired
+// surrogates become U+FFFD. Returns the length of the string.
+static size_t utf16_to_utf8(char *out, const u_int16_t *units, size_t unit_cnt)
+{
+    unsigned char *next = (unsigned char *) out;
+    for (size_t i = 0; i < unit_cnt; ++i) {
+        u_int32_t code_point = units[i];
+        if (code_point >= 0xd800 && code_point <= 0xdfff) {
+            if (code_point <= 0xdbff && i + 1 < unit_cnt
+                    && units[i + 1] >= 0xdc00 && units[i + 1] <= 0xdfff) {
+                code_point = 0x10000 + ((code_point - 0xd800) << 10)
+                             + (units[i + 1] - 0xdc00);
+                ++i;
+            }
+            else {
+                code_point = 0xfffd;
+            }
+        }
+
+        if (code_point < 0x80) {
+            *next++ = code_point;
+        }
+        else if (code_point < 0x800) {
+            *next++ = 0xc0 | code_point >> 6;
+            *next++ = 0x80 | (code_point & 0x3f);
+        }
+        else if (code_point < 0x10000) {
+            *next++ = 0xe0 | code_point >> 12;
+            *next++ = 0x80 | (code_point >> 6 & 0x3f);
+            *next++ = 0x80 | (code_point & 0x3f);
+        }
+        else {
+            // Two units make these four bytes
+            *next++ = 0xf0 | code_point >> 18;
+            *next++ = 0x80 | (code_point >> 12 & 0x3f);
+            *next++ = 0x80 | (code_point >> 6 & 0x3f);
+            *next++ = 0x80 | (code_point & 0x3f);
+        }
+    }
+    *next = '\0';
+
+    return next - (unsigned char *) out;
+}
+
+// Determines whether the specified directory entry belongs to a directory or
+// not
+int fat_is_directory(struct fat_dir_info dir_info)
+{
+    return (dir_info.Attr & FAT_ATTR_DIRECTORY) != 0;
+}
+
+// Map the image at path read-only into memory and store the mapping in
+// fs_info. Returns 0 on success and INPUT_ERR otherwise.
+static int map_image(struct fat_info *fs_info, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        warn("Cannot open %s for reading", path);
+        return INPUT_ERR;
+    }
+
+    struct stat img_stat;
+    if (fstat(fd, &img_stat) == -1) {
+        warn("Cannot get the size of %s", path);
+        close(fd);
+        return INPUT_ERR;
+    }
+    if (img_stat.st_size < BOOT_SECTOR_BYTES) {
+        warnx("%s is too small for a FAT filesystem", path);
+        close(fd);
+        return INPUT_ERR;
+    }
+
+    void *image = mmap(NULL, img_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        warn("Cannot map %s into memory", path);
+        close(fd);
+        return INPUT_ERR;
+    }
+    fs_info->image_fd   = fd;
+
+    fs_info->image      = image;
+    fs_info->image_size = img_stat.st_size;
+    fs_info->page_size  = sysconf(_SC_PAGESIZE);
+    return 0;
+}
+
+// Return a pointer to the length bytes at the specified offset in the image,
+// terminating if they are not all inside of it. fat_open has checked that the
+// boot sector, the FATs and all clusters are, so this can't happen for them.
+static const unsigned char *image_bytes(const struct fat_info *fs_info,
+                                        u_int64_t offset, u_int64_t length)
+{
+    if (offset > fs_info->image_size
+            || length > fs_info->image_size - offset) {
+        errx(INPUT_ERR, "Image ends before offset %llu",
+             (unsigned long long) (offset + length));
+    }
+
+    return fs_info->image + offset;
+}
+
+// Return the 8-bit number at the specified offset in the image
+static u_int8_t image_8(const struct fat_info *fs_info, u_int64_t offset)
+{
+    return *image_bytes(fs_info, offset, 1);
+}
+
+// Return the little-endian 16-bit number at the specified offset in the image
+static u_int16_t image_16(const struct fat_info *fs_info, u_int64_t offset)
+{
+    return get_16(image_bytes(fs_info, offset, 2));
+}
+
+// Return the little-endian 32-bit number at the specified offset in the image
+static u_int32_t image_32(const struct fat_info *fs_info, u_int64_t offset)
+{
+    return get_32(image_bytes(fs_info, offset, 4));
+}
+
+// Return the little-endian 16-bit number stored at bytes
+static u_int16_t get_16(const unsigned char *bytes)
+{
+    return (u_int16_t) (bytes[0] | bytes[1] << 8);
+}
+
+// Return the little-endian 32-bit number stored at bytes
+static u_int32_t get_32(const unsigned char *bytes)
+{
+    return (u_int32_t) bytes[0]       | (u_int32_t) bytes[1] << 8
+           | (u_int32_t) bytes[2] << 16 | (u_int32_t) bytes[3] << 24;
+}
+
@@ -0,0 +1,92 @@
+#ifndef LIBFAT_H
+#define LIBFAT_H
+
+#include <sys/types.h>
+
+/*
+ * Read-only access to FAT12, FAT16 and FAT32 images.
+ *
+ * An image is opened with fat_open and used through the struct fat_info it
+ * returns, whose contents are private to the library. Any number of images
+ * can be open at the same time, and all functions may be called on the same
+ * image from several threads at once.
+ *
+ * Problems with an image or a path are reported on stderr with warnx and
+ * returned as one of the exit statuses from errors.h, so that a program can
+ * go on with the next image. Only running out of memory terminates.
+ */
+
+#define FAT_DEFAULT_IMAGE "drive.img"
+#define FAT_NAME_BYTES 12
+#define FAT_ATTR_DIRECTORY 0x10
+
+// The type is determined by the number of clusters alone
+enum fat_type {
+    FAT12 = 12,
+    FAT16 = 16,
+    FAT32 = 32
+};
+
+struct fat_info;
+
+// What a program needs to know about the layout of an image
+struct fat_geometry {
+    enum fat_type type;
+    u_int32_t     cluster_cnt;
+    u_int32_t     cluster_bytes;
+
+    // The first cluster of the root directory (0 if the root directory has a
+    // fixed region, that is on FAT12 and FAT16)
+    u_int32_t     root_cluster_nr;
+};
+
+struct fat_dir_info {
+    char      name[FAT_NAME_BYTES];
+
+    // The VFAT long name in UTF-8, or NULL if there is none. It points into
+    // the iterator that returned the entry and is only valid until the
+    // iterator's next step.
+    const char *long_name;
+
+    u_int8_t  Attr;
+    u_int16_t FstClusHI;
+    u_int16_t FstClusLO;
+    u_int32_t FileSize;
+};
+
+/*
+ * A file or directory in a directory tree. The children of a directory are
+ * sorted by name. total is left for the program, e.g. for the size of a file
+ * or the sum of the sizes of all files below a directory.
+ */
+struct tree_node {
+    struct fat_dir_info entry;
+    const char          *name;
+    u_int64_t           total;
+    struct tree_node    *children;
+    u_int32_t           child_cnt;
+
+    // The names of the children, one after the other
+    char                *names;
+};
+
+// Called for every entry of a directory; a return value other than 0 stops
+// the walk
+typedef int (*fat_entry_fn)(const struct fat_dir_info *, void *);
+
+struct fat_info *fat_open(const char *);
+void fat_close(struct fat_info *);
+void fat_get_geometry(const struct fat_info *, struct fat_geometry *);
+int fat_read_dir(struct fat_info *, u_int32_t, fat_entry_fn, void *);
+int fat_find_dir(struct fat_info *, const char *, u_int32_t *);
+int fat_find_file(struct fat_info *, const char *, struct fat_dir_info *);
+int fat_extract(struct fat_info *, struct fat_dir_info, int, const char *);
+void fat_read_tree(struct fat_info *, u_int32_t, int, struct tree_node *);
+void fat_free_tree(struct tree_node *);
+u_int32_t fat_first_cluster(const struct fat_info *, struct fat_dir_info);
+u_int32_t fat_next_cluster(const struct fat_info *, u_int32_t);
+int fat_is_eoc(const struct fat_info *, u_int32_t);
+int fat_is_directory(struct fat_dir_info);
+const char *fat_display_name(struct fat_dir_info, char *);
+
+#endif
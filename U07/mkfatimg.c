@@ -0,0 +1,768 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include "errors.h"
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SECTOR_BYTES 512
+#define DIR_ENT_BYTES 32
+#define MAX_RUN_CLUSTERS 8
+    // Runs of free clusters that fragmentation moves around are 1 to 8 long
+#define MAX_DIRS 1000000
+#define MAX_FILES 10000000
+    // File names have seven digits
+#define MIN_FAT16_CLUSTERS 4085
+#define MIN_FAT32_CLUSTERS 65525
+#define MAX_FAT32_CLUSTERS 0x0ffffff5
+#define LFN_UNITS_PER_ENTRY 13
+#define MAX_LONG_NAME 255
+
+/*
+ * A directory of the generated tree. Its subdirectories are numbered
+ * first_child to first_child + child_cnt - 1. Directory i holds file_cnt
+ * files numbered i, i + dir_cnt, i + 2 * dir_cnt and so on, where dir_cnt is
+ * the number of all directories. entry_cnt counts all of its entries,
+ * including those of long names. cluster_cnt is 0 for the fixed root
+ * directory region of FAT16.
+ */
+struct gen_dir {
+    u_int32_t parent;
+    u_int32_t first_child;
+    u_int32_t child_cnt;
+    u_int32_t depth;
+    u_int32_t file_cnt;
+    u_int32_t entry_cnt;
+    u_int32_t first_cluster_nr;
+    u_int32_t cluster_cnt;
+};
+
+// Everything that has to be known to lay out and write the image
+struct image_layout {
+    int       type;
+    u_int32_t sec_per_clus;
+    u_int32_t cluster_bytes;
+    u_int32_t rsvd_sec_cnt;
+    u_int32_t root_ent_cnt;
+    u_int32_t fat_size;
+    u_int32_t cluster_cnt;
+    u_int32_t first_data_sector;
+    u_int64_t total_sectors;
+    u_int64_t image_bytes;
+};
+
+void build_tree(struct gen_dir **, u_int32_t *, u_int32_t, u_int32_t);
+u_int32_t *cluster_order(u_int32_t, double);
+void plan_layout(struct image_layout *, u_int64_t);
+u_int32_t allocate(unsigned char *, const struct image_layout *,
+                   const u_int32_t *, u_int32_t *, u_int32_t);
+void write_boot_sector(unsigned char *, const struct image_layout *,
+                       u_int32_t);
+void write_dir_entry(unsigned char *, const char *, u_int8_t, u_int32_t,
+                     u_int32_t);
+size_t long_name(u_int32_t, double, char *);
+unsigned char *write_lfn_entries(unsigned char *, const char *, size_t,
+                                 const char *);
+u_int8_t lfn_checksum(const char *);
+void set_fat_entry(unsigned char *, int, u_int32_t, u_int32_t);
+u_int32_t get_fat_entry(const unsigned char *, int, u_int32_t);
+double random_fraction(void);
+unsigned char *cluster_bytes(unsigned char *, const struct image_layout *,
+                             u_int32_t);
+u_int32_t file_size(u_int32_t, u_int32_t);
+u_int64_t random_u64(void);
+void put_16(unsigned char *, u_int16_t);
+void put_32(unsigned char *, u_int32_t);
+long parse_number(const char *, const char *, long, long);
+
+// State of the xorshift generator; the same seed always gives the same image
+u_int64_t random_state = 88172645463325252ULL;
+
+/*
+ * Writes a synthetic FAT16 or FAT32 image to the given path, for trying out
+ * and benchmarking drive-ls and libfat. Options:
+ *     -t type   16 or 32 (default: 16)
+ *     -n files  number of files (default: 1000)
+ *     -d depth  depth of the directory tree; 0 puts everything into the root
+ *               directory (default: 2)
+ *     -w width  subdirectories of each directory above the bottom level
+ *               (default: 4)
+ *     -s size   largest file size in bytes; sizes are spread evenly from 0
+ *               (default: 4096)
+ *     -c count  sectors per cluster (default: 1)
+ *     -f frac   fraction of the runs of clusters that are swapped with a
+ *               random other run, from 0 (no fragmentation) to 1 (default: 0)
+ *     -r seed   seed for sizes and fragmentation (default: 1)
+ *     -l frac   fraction of the files that also get a VFAT long name, from 0
+ *               to 1 (default: 0)
+ * The files are named F0000000.DAT upwards and spread round-robin over all
+ * directories, which are named D0000000 upwards within their parents. A long
+ * name of file n starts with "File n" (n with seven digits) and is between 16
+ * and 255 characters long; many of them fill their last entry exactly. Byte
+ * i of file n is (n + i) % 251, so extracted files can be checked.
+ */
+int main(int argc, char *argv[])
+{
+    // Parse options
+    int       type         = 16;
+    u_int32_t file_cnt     = 1000;
+    u_int32_t depth        = 2;
+    u_int32_t width        = 4;
+    u_int32_t max_size     = 4096;
+    u_int32_t sec_per_clus = 1;
+    double    fragmentation = 0;
+    double    long_names    = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:d:w:s:c:f:r:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            type = parse_number(optarg, "FAT type", 16, 32);
+            if (type != 16 && type != 32) {
+                errx(ARG_ERR, "Invalid FAT type: %s", optarg);
+            }
+            break;
+        case 'n':
+            file_cnt = parse_number(optarg, "number of files", 0, MAX_FILES);
+            break;
+        case 'd':
+            depth = parse_number(optarg, "depth", 0, 64);
+            break;
+        case 'w':
+            width = parse_number(optarg, "width", 1, MAX_DIRS);
+            break;
+        case 's':
+            max_size = parse_number(optarg, "file size", 0, 1 << 30);
+            break;
+        case 'c':
+            sec_per_clus = parse_number(optarg, "sectors per cluster", 1, 128);
+            if ((sec_per_clus & (sec_per_clus - 1)) != 0) {
+                errx(ARG_ERR, "Sectors per cluster must be a power of two");
+            }
+            break;
+        case 'f': {
+            char *end;
+            fragmentation = strtod(optarg, &end);
+            if (*optarg == '\0' || *end != '\0' || fragmentation < 0
+                    || fragmentation > 1) {
+                errx(ARG_ERR, "Invalid fragmentation: %s", optarg);
+            }
+            break;
+        }
+        case 'l': {
+            char *end;
+            long_names = strtod(optarg, &end);
+            if (*optarg == '\0' || *end != '\0' || long_names < 0
+                    || long_names > 1) {
+                errx(ARG_ERR, "Invalid fraction of long names: %s", optarg);
+            }
+            break;
+        }
+        case 'r':
+            random_state += parse_number(optarg, "seed", 0, 0x7fffffff);
+            break;
+        default:
+            errx(ARG_ERR, "Usage: mkfatimg [-t 16|32] [-n files] [-d depth] "
+                          "[-w width] [-s size] [-c count] [-f frac] "
+                          "[-r seed] [-l frac] image");
+        }
+    }
+    if (optind != argc - 1) {
+        errx(ARG_ERR, "Usage: mkfatimg [-t 16|32] [-n files] [-d depth] "
+                      "[-w width] [-s size] [-c count] [-f frac] "
+                      "[-r seed] [-l frac] image");
+    }
+    const char *path = argv[optind];
+
+    // Build the tree and hand out the files
+    struct gen_dir *dirs;
+    u_int32_t dir_cnt;
+    build_tree(&dirs, &dir_cnt, depth, width);
+    for (u_int32_t i = 0; i < dir_cnt; ++i) {
+        dirs[i].file_cnt = file_cnt / dir_cnt + (i < file_cnt % dir_cnt);
+    }
+
+    // Count the clusters needed. Directories get a cluster more than their
+    // entries fill, so that there is always an entry marking the end.
+    struct image_layout layout;
+    layout.type          = type;
+    layout.sec_per_clus  = sec_per_clus;
+    layout.cluster_bytes = sec_per_clus * SECTOR_BYTES;
+    u_int64_t needed = 0;
+    u_int64_t data_bytes = 0;
+    for (u_int32_t i = 0; i < dir_cnt; ++i) {
+        u_int64_t entry_cnt = dirs[i].child_cnt + dirs[i].file_cnt
+                              + (i == 0 ? 0 : 2);
+        for (u_int32_t j = 0; j < dirs[i].file_cnt; ++j) {
+            char name[MAX_LONG_NAME + 1];
+            size_t length = long_name(i + j * dir_cnt, long_names, name);
+            entry_cnt += (length + LFN_UNITS_PER_ENTRY - 1)
+                         / LFN_UNITS_PER_ENTRY;
+        }
+        if (entry_cnt > 0xffffffffULL / DIR_ENT_BYTES) {
+            errx(ARG_ERR, "Too many entries in a directory; use a larger "
+                          "depth or width");
+        }
+        dirs[i].entry_cnt = entry_cnt;
+        if (i == 0 && type == 16) {
+            if (entry_cnt > 65520) {
+                errx(ARG_ERR, "Too many entries for the root directory of "
+                              "FAT16; use a larger depth");
+            }
+            layout.root_ent_cnt = (entry_cnt + 1 + 15) / 16 * 16;
+            if (layout.root_ent_cnt < 512) {
+                layout.root_ent_cnt = 512;
+            }
+            dirs[i].cluster_cnt = 0;
+            continue;
+        }
+        dirs[i].cluster_cnt = entry_cnt * DIR_ENT_BYTES / layout.cluster_bytes
+                              + 1;
+        needed += dirs[i].cluster_cnt;
+    }
+    if (type == 32) {
+        layout.root_ent_cnt = 0;
+    }
+    for (u_int32_t i = 0; i < file_cnt; ++i) {
+        u_int32_t size = file_size(i, max_size);
+        needed += (size + layout.cluster_bytes - 1) / layout.cluster_bytes;
+        data_bytes += size;
+    }
+
+    // Lay out the image with an eighth of its clusters left free
+    plan_layout(&layout, needed + needed / 8);
+    u_int32_t *order = cluster_order(layout.cluster_cnt, fragmentation);
+
+    // Create the image, which starts out as zeros
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        err(OUTPUT_ERR, "Cannot create %s", path);
+    }
+    if (ftruncate(fd, layout.image_bytes) == -1) {
+        err(OUTPUT_ERR, "Cannot make %s %llu bytes long", path,
+            (unsigned long long) layout.image_bytes);
+    }
+    unsigned char *image = mmap(NULL, layout.image_bytes,
+                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        err(OUTPUT_ERR, "Cannot map %s into memory", path);
+    }
+
+    // Allocate the chains, each directory before its files, in the order of
+    // the directories
+    u_int32_t next = 0;
+    u_int32_t *file_clusters = malloc((file_cnt + 1) * sizeof(u_int32_t));
+    if (file_clusters == NULL) {
+        err(INPUT_ERR, "Cannot allocate file table");
+    }
+    for (u_int32_t i = 0; i < dir_cnt; ++i) {
+        dirs[i].first_cluster_nr = allocate(image, &layout, order, &next,
+                                            dirs[i].cluster_cnt);
+        for (u_int32_t j = 0; j < dirs[i].file_cnt; ++j) {
+            u_int32_t file_nr = i + j * dir_cnt;
+            u_int32_t size = file_size(file_nr, max_size);
+            file_clusters[file_nr] = allocate(
+                                         image, &layout, order, &next,
+                                         (size + layout.cluster_bytes - 1)
+                                         / layout.cluster_bytes
+                                     );
+        }
+    }
+    write_boot_sector(image, &layout, dirs[0].first_cluster_nr);
+
+    // Write the directories and the contents of the files, following the
+    // chains through the first FAT
+    unsigned char *fat = image + (u_int64_t) layout.rsvd_sec_cnt
+                                 * SECTOR_BYTES;
+    for (u_int32_t i = 0; i < dir_cnt; ++i) {
+        // Collect the entries of the directory
+        u_int32_t entry_cnt = dirs[i].entry_cnt;
+        unsigned char *entries = calloc(entry_cnt + 1, DIR_ENT_BYTES);
+        if (entries == NULL) {
+            err(INPUT_ERR, "Cannot allocate directory");
+        }
+        unsigned char *entry = entries;
+        if (i != 0) {
+            u_int32_t parent_cluster_nr = dirs[i].parent == 0 ? 0
+                                          : dirs[dirs[i].parent]
+                                            .first_cluster_nr;
+            write_dir_entry(entry, ".          ", 0x10,
+                            dirs[i].first_cluster_nr, 0);
+            write_dir_entry(entry + DIR_ENT_BYTES, "..         ", 0x10,
+                            parent_cluster_nr, 0);
+            entry += 2 * DIR_ENT_BYTES;
+        }
+        for (u_int32_t j = 0; j < dirs[i].child_cnt; ++j) {
+            char name[16];
+            snprintf(name, sizeof(name), "D%07u   ", j);
+            write_dir_entry(entry, name, 0x10,
+                            dirs[dirs[i].first_child + j].first_cluster_nr, 0);
+            entry += DIR_ENT_BYTES;
+        }
+        for (u_int32_t j = 0; j < dirs[i].file_cnt; ++j) {
+            u_int32_t file_nr = i + j * dir_cnt;
+            char name[16];
+            snprintf(name, sizeof(name), "F%07uDAT", file_nr);
+            char long_name_buffer[MAX_LONG_NAME + 1];
+            size_t length = long_name(file_nr, long_names, long_name_buffer);
+            if (length > 0) {
+                entry = write_lfn_entries(entry, long_name_buffer, length,
+                                          name);
+            }
+            write_dir_entry(entry, name, 0x20, file_clusters[file_nr],
+                            file_size(file_nr, max_size));
+            entry += DIR_ENT_BYTES;
+        }
+
+        // Copy them into the fixed root directory region or the chain
+        u_int64_t left = (u_int64_t) entry_cnt * DIR_ENT_BYTES;
+        entry = entries;
+        if (dirs[i].cluster_cnt == 0) {
+            memcpy(image + (u_int64_t) (layout.rsvd_sec_cnt
+                                        + 2 * layout.fat_size) * SECTOR_BYTES,
+                   entry, left);
+            left = 0;
+        }
+        u_int32_t cluster_nr = dirs[i].first_cluster_nr;
+        while (left > 0) {
+            u_int64_t chunk = left < layout.cluster_bytes
+                              ? left : layout.cluster_bytes;
+            memcpy(cluster_bytes(image, &layout, cluster_nr), entry, chunk);
+            entry += chunk;
+            left  -= chunk;
+            cluster_nr = get_fat_entry(fat, type, cluster_nr);
+        }
+        free(entries);
+    }
+    for (u_int32_t file_nr = 0; file_nr < file_cnt; ++file_nr) {
+        u_int32_t left = file_size(file_nr, max_size);
+        u_int64_t offset = 0;
+        u_int32_t cluster_nr = file_clusters[file_nr];
+        while (left > 0) {
+            u_int32_t chunk = left < layout.cluster_bytes
+                              ? left : layout.cluster_bytes;
+            unsigned char *data = cluster_bytes(image, &layout, cluster_nr);
+            for (u_int32_t k = 0; k < chunk; ++k) {
+                data[k] = (file_nr + offset + k) % 251;
+            }
+            offset += chunk;
+            left   -= chunk;
+            cluster_nr = get_fat_entry(fat, type, cluster_nr);
+        }
+    }
+
+    // The second FAT is a copy of the first
+    u_int64_t fat_bytes = (u_int64_t) layout.fat_size * SECTOR_BYTES;
+    memcpy(fat + fat_bytes, fat, fat_bytes);
+
+    if (munmap(image, layout.image_bytes) == -1 || close(fd) == -1) {
+        err(OUTPUT_ERR, "Cannot write %s", path);
+    }
+    printf("%s: FAT%d, %u clusters of %u bytes, %u directories, %u files, "
+           "%llu bytes of data\n", path, type, layout.cluster_cnt,
+           layout.cluster_bytes, dir_cnt, file_cnt,
+           (unsigned long long) data_bytes);
+
+    free(file_clusters);
+    free(order);
+    free(dirs);
+    return 0;
+}
+
+// Create the directories of a tree of the specified depth, in which every
+// directory above the bottom level has width subdirectories, breadth first
+void build_tree(struct gen_dir **dirs, u_int32_t *dir_cnt, u_int32_t depth,
+                u_int32_t width)
+{
+    // Count them first
+    u_int64_t total = 1, level = 1;
+    for (u_int32_t i = 0; i < depth; ++i) {
+        level *= width;
+        total += level;
+        if (total > MAX_DIRS) {
+            errx(ARG_ERR, "More than %d directories", MAX_DIRS);
+        }
+    }
+
+    *dirs = calloc(total, sizeof(struct gen_dir));
+    if (*dirs == NULL) {
+        err(INPUT_ERR, "Cannot allocate directory tree");
+    }
+    *dir_cnt = total;
+
+    // Each directory's children come right after everything created before
+    u_int32_t created = 1;
+    for (u_int32_t i = 0; i < total; ++i) {
+        if ((*dirs)[i].depth == depth) {
+            continue;
+        }
+        (*dirs)[i].first_child = created;
+        (*dirs)[i].child_cnt   = width;
+        for (u_int32_t j = 0; j < width; ++j) {
+            (*dirs)[created].parent = i;
+            (*dirs)[created].depth  = (*dirs)[i].depth + 1;
+            ++created;
+        }
+    }
+}
+
+/*
+ * Return the order in which the cluster_cnt clusters are handed out. The
+ * clusters are cut into runs of 1 to MAX_RUN_CLUSTERS, and each run is
+ * swapped with a random other one with probability fragmentation.
+ */
+u_int32_t *cluster_order(u_int32_t cluster_cnt, double fragmentation)
+{
+    // Cut the clusters into runs, stored as their first clusters
+    u_int32_t *run_starts = malloc((cluster_cnt + 1) * sizeof(u_int32_t));
+    u_int32_t *order      = malloc(cluster_cnt * sizeof(u_int32_t));
+    if (run_starts == NULL || order == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster order");
+    }
+    u_int32_t run_cnt = 0;
+    for (u_int32_t start = 0; start < cluster_cnt;
+            start += 1 + random_u64() % MAX_RUN_CLUSTERS) {
+        run_starts[run_cnt++] = start;
+    }
+    run_starts[run_cnt] = cluster_cnt;
+
+    // Swap runs around, as lengths (end - start) travel with their starts
+    u_int32_t *runs = malloc(run_cnt * sizeof(u_int32_t));
+    if (runs == NULL) {
+        err(INPUT_ERR, "Cannot allocate cluster order");
+    }
+    for (u_int32_t i = 0; i < run_cnt; ++i) {
+        runs[i] = i;
+    }
+    for (u_int32_t i = 0; i < run_cnt && fragmentation > 0; ++i) {
+        if (random_fraction() < fragmentation) {
+            u_int32_t j = random_u64() % run_cnt;
+            u_int32_t swapped = runs[i];
+            runs[i] = runs[j];
+            runs[j] = swapped;
+        }
+    }
+
+    // Hand out the clusters run after run. Cluster numbers start at 2.
+    u_int32_t next = 0;
+    for (u_int32_t i = 0; i < run_cnt; ++i) {
+        for (u_int32_t c = run_starts[runs[i]]; c < run_starts[runs[i] + 1];
+                ++c) {
+            order[next++] = c + 2;
+        }
+    }
+
+    free(runs);
+    free(run_starts);
+    return order;
+}
+
+// Choose the number of clusters and the sizes of the regions of the image for
+// at least wanted clusters
+void plan_layout(struct image_layout *layout, u_int64_t wanted)
+{
+    // The type follows from the number of clusters, so it may have to be
+    // padded with free ones
+    u_int64_t cluster_cnt = wanted;
+    if (layout->type == 16) {
+        if (cluster_cnt < MIN_FAT16_CLUSTERS) {
+            cluster_cnt = MIN_FAT16_CLUSTERS;
+        }
+        if (cluster_cnt >= MIN_FAT32_CLUSTERS) {
+            errx(ARG_ERR, "%llu clusters are too many for FAT16; use larger "
+                          "clusters or FAT32",
+                 (unsigned long long) cluster_cnt);
+        }
+        layout->rsvd_sec_cnt = 1;
+    }
+    else {
+        if (cluster_cnt < MIN_FAT32_CLUSTERS) {
+            cluster_cnt = MIN_FAT32_CLUSTERS;
+        }
+        if (cluster_cnt > MAX_FAT32_CLUSTERS) {
+            errx(ARG_ERR, "%llu clusters are too many for FAT32",
+                 (unsigned long long) cluster_cnt);
+        }
+        layout->rsvd_sec_cnt = 32;
+    }
+    layout->cluster_cnt = cluster_cnt;
+
+    // Two FATs with an entry for every cluster plus the two reserved ones
+    u_int64_t fat_bytes = (cluster_cnt + 2) * (layout->type / 8);
+    layout->fat_size = (fat_bytes + SECTOR_BYTES - 1) / SECTOR_BYTES;
+    layout->first_data_sector = layout->rsvd_sec_cnt + 2 * layout->fat_size
+                                + layout->root_ent_cnt * DIR_ENT_BYTES
+                                  / SECTOR_BYTES;
+    layout->total_sectors = layout->first_data_sector
+                            + cluster_cnt * layout->sec_per_clus;
+    if (layout->total_sectors > 0xffffffffULL) {
+        errx(ARG_ERR, "The image would be larger than FAT allows");
+    }
+    layout->image_bytes = layout->total_sectors * SECTOR_BYTES;
+}
+
+// Link the next cluster_cnt clusters of order into a chain and return its
+// first cluster, or 0 if cluster_cnt is 0
+u_int32_t allocate(unsigned char *image, const struct image_layout *layout,
+                   const u_int32_t *order, u_int32_t *next,
+                   u_int32_t cluster_cnt)
+{
+    if (cluster_cnt == 0) {
+        return 0;
+    }
+    if (*next + cluster_cnt > layout->cluster_cnt) {
+        errx(INPUT_ERR, "Ran out of clusters");
+    }
+
+    unsigned char *fat = image + (u_int64_t) layout->rsvd_sec_cnt
+                                 * SECTOR_BYTES;
+    u_int32_t eoc = layout->type == 16 ? 0xffff : 0x0fffffff;
+    for (u_int32_t i = 0; i < cluster_cnt; ++i) {
+        u_int32_t cluster_nr = order[*next + i];
+        set_fat_entry(fat, layout->type, cluster_nr,
+                      i + 1 < cluster_cnt ? order[*next + i + 1] : eoc);
+    }
+
+    u_int32_t first = order[*next];
+    *next += cluster_cnt;
+    return first;
+}
+
+// Write the boot sector (and for FAT32 the FSInfo sector) and the reserved
+// entries of the first FAT
+void write_boot_sector(unsigned char *image, const struct image_layout *layout,
+                       u_int32_t root_cluster_nr)
+{
+    memcpy(image, "\xeb\x3c\x90" "MKFATIMG", 11);
+    put_16(image + 11, SECTOR_BYTES);
+    image[13] = layout->sec_per_clus;
+    put_16(image + 14, layout->rsvd_sec_cnt);
+    image[16] = 2;
+    put_16(image + 17, layout->root_ent_cnt);
+    if (layout->total_sectors < 0x10000 && layout->type == 16) {
+        put_16(image + 19, layout->total_sectors);
+    }
+    else {
+        put_32(image + 32, layout->total_sectors);
+    }
+    image[21] = 0xf8;
+    put_16(image + 24, 63);
+    put_16(image + 26, 255);
+
+    // The extended boot record sits after the FAT32 fields
+    unsigned char *ebr = image + 36;
+    if (layout->type == 16) {
+        put_16(image + 22, layout->fat_size);
+        memcpy(ebr + 18, "FAT16   ", 8);
+    }
+    else {
+        put_32(image + 36, layout->fat_size);
+        put_32(image + 44, root_cluster_nr);
+        put_16(image + 48, 1);
+        put_16(image + 50, 6);
+        ebr = image + 64;
+        memcpy(ebr + 18, "FAT32   ", 8);
+
+        // The FSInfo sector leaves the free count to be computed
+        unsigned char *fs_info = image + SECTOR_BYTES;
+        put_32(fs_info,       0x41615252);
+        put_32(fs_info + 484, 0x61417272);
+        put_32(fs_info + 488, 0xffffffff);
+        put_32(fs_info + 492, 0xffffffff);
+        put_32(fs_info + 508, 0xaa550000);
+    }
+    ebr[0] = 0x80;
+    ebr[2] = 0x29;
+    put_32(ebr + 3, 0x20231018);
+    memcpy(ebr + 7, "SYNTHETIC  ", 11);
+    image[510] = 0x55;
+    image[511] = 0xaa;
+
+    unsigned char *fat = image + (u_int64_t) layout->rsvd_sec_cnt
+                                 * SECTOR_BYTES;
+    set_fat_entry(fat, layout->type, 0,
+                  layout->type == 16 ? 0xfff8 : 0x0ffffff8);
+    set_fat_entry(fat, layout->type, 1,
+                  layout->type == 16 ? 0xffff : 0x0fffffff);
+}
+
+// Write a directory entry with the 11 character name in FAT format
+void write_dir_entry(unsigned char *entry, const char *name, u_int8_t attr,
+                     u_int32_t cluster_nr, u_int32_t size)
+{
+    memcpy(entry, name, 11);
+    entry[11] = attr;
+    put_16(entry + 20, cluster_nr >> 16);
+    put_16(entry + 26, cluster_nr & 0xffff);
+    put_32(entry + 28, size);
+}
+
+/*
+ * Write the long name of file_nr to name and return its length, or return 0
+ * if the file gets none. Which files get one is decided by a hash of their
+ * number, so that the same files are chosen every time, in about fraction of
+ * all files. The lengths cycle through multiples of 13, which fill their last
+ * entry without a terminating 0, and other lengths, so that a name filling
+ * its entries often follows a longer one in the same directory.
+ */
+size_t long_name(u_int32_t file_nr, double fraction, char *name)
+{
+    static const size_t lengths[] = {130, 26, 45, 39, 255, 17, 247, 52, 100,
+                                     65, 30, 78};
+    static const char filler[] = " abcdefghijklmnopqrstuvwxyz_0123456789";
+
+    u_int64_t hash = (file_nr + 1) * 0xc2b2ae3d27d4eb4fULL;
+    hash ^= hash >> 31;
+    if ((hash >> 11) / 9007199254740992.0 >= fraction) {
+        return 0;
+    }
+
+    // "File 0000017", then the filler, then ".dat"
+    size_t length = lengths[file_nr % (sizeof(lengths) / sizeof(size_t))];
+    size_t prefix = snprintf(name, MAX_LONG_NAME + 1, "File %07u", file_nr);
+    for (size_t i = prefix; i < length - 4; ++i) {
+        name[i] = filler[(i - prefix) % (sizeof(filler) - 1)];
+    }
+    memcpy(name + length - 4, ".dat", 5);
+
+    return length;
+}
+
+/*
+ * Write the entries of the long name of length characters at name, which
+ * belongs to the short name short_name, to entry and return where the short
+ * entry goes. The last part of the name comes first, and a name that doesn't
+ * fill its last entry is ended with a 0 unit and padded with 0xffff.
+ */
+unsigned char *write_lfn_entries(unsigned char *entry, const char *name,
+                                 size_t length, const char *short_name)
+{
+    static const u_int8_t unit_offsets[LFN_UNITS_PER_ENTRY]
+        = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    u_int8_t checksum = lfn_checksum(short_name);
+    size_t entry_cnt = (length + LFN_UNITS_PER_ENTRY - 1)
+                       / LFN_UNITS_PER_ENTRY;
+
+    for (size_t seq_nr = entry_cnt; seq_nr >= 1; --seq_nr) {
+        memset(entry, 0, DIR_ENT_BYTES);
+        entry[0]  = seq_nr | (seq_nr == entry_cnt ? 0x40 : 0);
+        entry[11] = 0x0f;
+        entry[13] = checksum;
+        for (size_t i = 0; i < LFN_UNITS_PER_ENTRY; ++i) {
+            size_t pos = (seq_nr - 1) * LFN_UNITS_PER_ENTRY + i;
+            u_int16_t unit = pos < length ? (unsigned char) name[pos]
+                             : pos == length ? 0 : 0xffff;
+            put_16(entry + unit_offsets[i], unit);
+        }
+        entry += DIR_ENT_BYTES;
+    }
+
+    return entry;
+}
+
+// Return the checksum of the 11 character short name that each entry of its
+// long name carries
+u_int8_t lfn_checksum(const char *short_name)
+{
+    u_int8_t sum = 0;
+    for (int i = 0; i < 11; ++i) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (u_int8_t) short_name[i];
+    }
+
+    return sum;
+}
+
+// Set the entry of cluster_nr in the FAT at fat to value
+void set_fat_entry(unsigned char *fat, int type, u_int32_t cluster_nr,
+                   u_int32_t value)
+{
+    if (type == 16) {
+        put_16(fat + 2 * (u_int64_t) cluster_nr, value);
+    }
+    else {
+        put_32(fat + 4 * (u_int64_t) cluster_nr, value);
+    }
+}
+
+// Return the entry of cluster_nr in the FAT at fat
+u_int32_t get_fat_entry(const unsigned char *fat, int type,
+                        u_int32_t cluster_nr)
+{
+    if (type == 16) {
+        const unsigned char *bytes = fat + 2 * (u_int64_t) cluster_nr;
+        return bytes[0] | bytes[1] << 8;
+    }
+
+    const unsigned char *bytes = fat + 4 * (u_int64_t) cluster_nr;
+    return ((u_int32_t) bytes[0] | (u_int32_t) bytes[1] << 8
+            | (u_int32_t) bytes[2] << 16 | (u_int32_t) bytes[3] << 24)
+           & 0x0fffffff;
+}
+
+// Return a pointer to the contents of the specified cluster
+unsigned char *cluster_bytes(unsigned char *image,
+                             const struct image_layout *layout,
+                             u_int32_t cluster_nr)
+{
+    return image + ((u_int64_t) layout->first_data_sector
+                    + (u_int64_t) (cluster_nr - 2) * layout->sec_per_clus)
+                   * SECTOR_BYTES;
+}
+
+// Return the size of file number file_nr, which is the same every time it is
+// asked for
+u_int32_t file_size(u_int32_t file_nr, u_int32_t max_size)
+{
+    // A multiplicative hash of the number is spread well enough
+    u_int64_t hash = (file_nr + 1) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+    return hash % ((u_int64_t) max_size + 1);
+}
+
+// Return the next number of the xorshift64 generator
+u_int64_t random_u64(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// Return a random number in [0, 1)
+double random_fraction(void)
+{
+    // The upper 53 bits fill the mantissa of a double
+    return (random_u64() >> 11) / 9007199254740992.0;
+}
+
+// Store value little-endian in the two bytes at bytes
+void put_16(unsigned char *bytes, u_int16_t value)
+{
+    bytes[0] = value & 0xff;
+    bytes[1] = value >> 8;
+}
+
+// Store value little-endian in the four bytes at bytes
+void put_32(unsigned char *bytes, u_int32_t value)
+{
+    bytes[0] = value & 0xff;
+    bytes[1] = value >> 8 & 0xff;
+    bytes[2] = value >> 16 & 0xff;
+    bytes[3] = value >> 24;
+}
+
+// Convert str to a number between min and max, terminating with a message
+// about what if it isn't one
+long parse_number(const char *str, const char *what, long min, long max)
+{
+    char *end;
+    long number = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || number < min || number > max) {
+        errx(ARG_ERR, "Invalid %s: %s", what, str);
+    }
+
+    return number;
+}
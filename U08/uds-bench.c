@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include "errors.h"
+
+#define DEFAULT_MSG_CNT 100000
+#define MAX_TRIAL_BYTES (256L * 1024 * 1024)
+    // Large messages are sent less often so that a trial stays short
+#define MIN_MSG_CNT 1000
+#define MAX_BATCH_SIZE 64
+
+/*
+ * Every message starts with this header. The rest of the message is padding.
+ * Sender and receiver run on the same host, so CLOCK_MONOTONIC timestamps are
+ * comparable between them.
+ */
+struct msg_header {
+    u_int64_t seq_nr;
+    u_int64_t send_ns;
+};
+
+struct sock_mode {
+    const char *name;
+    int        type;
+};
+
+struct trial_result {
+    double    msgs_per_sec;
+    double    bytes_per_sec;
+    u_int64_t p50_ns;
+    u_int64_t p90_ns;
+    u_int64_t p99_ns;
+    u_int64_t p999_ns;
+    u_int64_t max_ns;
+};
+
+static const struct sock_mode modes[] = {
+    { "DGRAM",     SOCK_DGRAM     },
+    { "SEQPACKET", SOCK_SEQPACKET },
+    { "STREAM",    SOCK_STREAM    },
+};
+static const size_t msg_sizes[]   = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+static const int    batch_sizes[] = { 1, 8, 32 };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+struct trial_result run_trial(const char *, struct sock_mode, size_t, int,
+                              long);
+void send_messages(const char *, struct sock_mode, size_t, int, long);
+void receive_messages(int, struct sock_mode, size_t, int, long,
+                      u_int64_t *, u_int64_t *);
+struct sockaddr_un make_address(const char *);
+u_int64_t now_ns(void);
+int compare_u64(const void *, const void *);
+u_int64_t percentile(const u_int64_t *, long, double);
+
+/*
+ * Measures throughput and one-way latency of AF_UNIX sockets the way
+ * uds-client and uds-server use them, for each socket type, message size and
+ * batch size. The socket file is created at the given path and removed after
+ * every trial.
+ */
+int main(int argc, const char *argv[])
+{
+    // Check arguments
+    if (argc != 2 && argc != 3) {
+        errx(ARG_ERROR, "Arguments: <socket file path> [messages per trial]");
+    }
+
+    long msg_cnt = DEFAULT_MSG_CNT;
+    if (argc == 3) {
+        msg_cnt = atol(argv[2]);
+        if (msg_cnt <= 0) {
+            errx(ARG_ERROR, "Invalid number of messages: %s", argv[2]);
+        }
+    }
+
+    printf("%-9s %6s %5s %8s %12s %10s %9s %9s %9s %9s %9s\n",
+           "mode", "size", "batch", "msgs", "msgs/s", "MB/s",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    fflush(stdout);
+
+    // Run every combination of socket type, message size and batch size
+    for (size_t m = 0; m < ARRAY_LEN(modes); ++m) {
+        for (size_t s = 0; s < ARRAY_LEN(msg_sizes); ++s) {
+            for (size_t b = 0; b < ARRAY_LEN(batch_sizes); ++b) {
+                // Cap the amount of data sent in one trial
+                long trial_msg_cnt = msg_cnt;
+                if (trial_msg_cnt * (long) msg_sizes[s] > MAX_TRIAL_BYTES) {
+                    trial_msg_cnt = MAX_TRIAL_BYTES / msg_sizes[s];
+                }
+                if (trial_msg_cnt < MIN_MSG_CNT) {
+                    trial_msg_cnt = MIN_MSG_CNT;
+                }
+
+                struct trial_result res = run_trial(
+                                              argv[1],
+                                              modes[m],
+                                              msg_sizes[s],
+                                              batch_sizes[b],
+                                              trial_msg_cnt
+                                          );
+
+                printf("%-9s %6zu %5d %8ld %12.0f %10.1f "
+                       "%9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                       modes[m].name, msg_sizes[s], batch_sizes[b],
+                       trial_msg_cnt, res.msgs_per_sec,
+                       res.bytes_per_sec / 1e6,
+                       res.p50_ns / 1e3, res.p90_ns / 1e3, res.p99_ns / 1e3,
+                       res.p999_ns / 1e3, res.max_ns / 1e3);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sends msg_cnt messages of msg_size bytes from a child process to this
+ * process in batches of batch_size and returns the measured figures.
+ */
+struct trial_result run_trial(const char *path, struct sock_mode mode,
+                              size_t msg_size, int batch_size, long msg_cnt)
+{
+    // Create a socket for reception, like uds-server does
+    unlink(path);
+    int sock_fd = socket(AF_UNIX, mode.type, 0);
+    if (sock_fd == -1) {
+        err(SOCK_ERROR, "Cannot open socket");
+    }
+
+    struct sockaddr_un mine_addr = make_address(path);
+    if (bind(sock_fd, (struct sockaddr *) &mine_addr,
+             sizeof(struct sockaddr_un)) == -1) {
+        err(SOCK_ERROR, "Cannot bind socket to %s", path);
+    }
+
+    // Connection-oriented sockets must wait for the sender
+    if (mode.type != SOCK_DGRAM && listen(sock_fd, 1) == -1) {
+        err(SOCK_ERROR, "Cannot listen on socket");
+    }
+
+    // Start the sender
+    pid_t sender_pid = fork();
+    if (sender_pid == -1) {
+        err(SOCK_ERROR, "Cannot fork sender");
+    }
+    if (sender_pid == 0) {
+        close(sock_fd);
+        send_messages(path, mode, msg_size, batch_size, msg_cnt);
+        _exit(0);
+            // Don't flush the parent's stdio buffers a second time
+    }
+
+    // Accept the sender's connection if there is one
+    int recv_fd = sock_fd;
+    if (mode.type != SOCK_DGRAM) {
+        recv_fd = accept(sock_fd, NULL, NULL);
+        if (recv_fd == -1) {
+            err(SOCK_ERROR, "Cannot accept connection");
+        }
+    }
+
+    // Receive everything and note the latency of every message
+    u_int64_t *latencies = malloc(msg_cnt * sizeof(u_int64_t));
+    if (latencies == NULL) {
+        err(RECV_ERROR, "Cannot allocate memory for latencies");
+    }
+    u_int64_t elapsed_ns;
+    receive_messages(recv_fd, mode, msg_size, batch_size, msg_cnt,
+                     latencies, &elapsed_ns);
+
+    // Clean up
+    int status;
+    if (waitpid(sender_pid, &status, 0) == -1
+            || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errx(SEND_ERROR, "Sender did not finish properly");
+    }
+    if (recv_fd != sock_fd) {
+        close(recv_fd);
+    }
+    close(sock_fd);
+    unlink(path);
+
+    // Summarise
+    qsort(latencies, msg_cnt, sizeof(u_int64_t), compare_u64);
+
+    struct trial_result res;
+    double elapsed_sec = elapsed_ns > 0 ? elapsed_ns / 1e9 : 1e-9;
+    res.msgs_per_sec  = msg_cnt / elapsed_sec;
+    res.bytes_per_sec = (double) msg_cnt * msg_size / elapsed_sec;
+    res.p50_ns        = percentile(latencies, msg_cnt, 0.50);
+    res.p90_ns        = percentile(latencies, msg_cnt, 0.90);
+    res.p99_ns        = percentile(latencies, msg_cnt, 0.99);
+    res.p999_ns       = percentile(latencies, msg_cnt, 0.999);
+    res.max_ns        = latencies[msg_cnt - 1];
+
+    free(latencies);
+    return res;
+}
+
+/*
+ * Connects to the socket at path and sends msg_cnt numbered, timestamped
+ * messages, batch_size of them per system call.
+ */
+void send_messages(const char *path, struct sock_mode mode, size_t msg_size,
+                   int batch_size, long msg_cnt)
+{
+    // Create a socket for sending, like uds-client does
+    int sock_fd = socket(AF_UNIX, mode.type, 0);
+    if (sock_fd == -1) {
+        err(SOCK_ERROR, "Cannot open socket");
+    }
+
+    struct sockaddr_un thine_addr = make_address(path);
+    if (connect(sock_fd, (struct sockaddr *) &thine_addr,
+                sizeof(struct sockaddr_un)) == -1) {
+        err(SOCK_ERROR, "Cannot connect to %s", path);
+    }
+
+    // Prepare one buffer and one message header per message in a batch
+    char *buffers = calloc(batch_size, msg_size);
+    if (buffers == NULL) {
+        err(SEND_ERROR, "Cannot allocate send buffers");
+    }
+    struct iovec   iovs[MAX_BATCH_SIZE];
+    struct mmsghdr msgs[MAX_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < batch_size; ++i) {
+        iovs[i].iov_base           = buffers + i * msg_size;
+        iovs[i].iov_len            = msg_size;
+        msgs[i].msg_hdr.msg_iov    = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Send the messages batch by batch
+    long seq_nr = 0;
+    while (seq_nr < msg_cnt) {
+        int cur_batch = batch_size;
+        if (msg_cnt - seq_nr < cur_batch) {
+            cur_batch = msg_cnt - seq_nr;
+        }
+
+        // Stamp the messages right before they are handed to the kernel
+        u_int64_t stamp = now_ns();
+        for (int i = 0; i < cur_batch; ++i) {
+            struct msg_header hdr = { seq_nr + i, stamp };
+            memcpy(buffers + i * msg_size, &hdr, sizeof(hdr));
+        }
+
+        // A batch may go out in several calls if the receiver is slow
+        int sent = 0;
+        while (sent < cur_batch) {
+            int ret = sendmmsg(sock_fd, msgs + sent, cur_batch - sent, 0);
+            if (ret == -1) {
+                err(SEND_ERROR, "Cannot send to %s", path);
+            }
+            sent += ret;
+        }
+
+        seq_nr += cur_batch;
+    }
+
+    free(buffers);
+    close(sock_fd);
+}
+
+/*
+ * Receives msg_cnt messages of msg_size bytes from sock_fd and stores the
+ * one-way latency of each in latencies. *elapsed_ns is set to the time between
+ * sending the first and receiving the last message.
+ */
+void receive_messages(int sock_fd, struct sock_mode mode, size_t msg_size,
+                      int batch_size, long msg_cnt, u_int64_t *latencies,
+                      u_int64_t *elapsed_ns)
+{
+    char *buffer = malloc(batch_size * msg_size);
+    if (buffer == NULL) {
+        err(RECV_ERROR, "Cannot allocate receive buffer");
+    }
+
+    u_int64_t first_send_ns = 0;
+    u_int64_t last_recv_ns  = 0;
+    long recvd_cnt = 0;
+
+    if (mode.type == SOCK_STREAM) {
+        // A stream has no message boundaries, so cut it into msg_size frames
+        size_t buffered = 0;
+        size_t capacity = batch_size * msg_size;
+        while (recvd_cnt < msg_cnt) {
+            ssize_t ret = recv(sock_fd, buffer + buffered,
+                               capacity - buffered, 0);
+            if (ret <= 0) {
+                err(RECV_ERROR, "Error in reception");
+            }
+            last_recv_ns = now_ns();
+            buffered += ret;
+
+            // Handle every complete frame
+            size_t frame_start = 0;
+            while (buffered - frame_start >= msg_size) {
+                struct msg_header hdr;
+                memcpy(&hdr, buffer + frame_start, sizeof(hdr));
+                if (recvd_cnt == 0) {
+                    first_send_ns = hdr.send_ns;
+                }
+                latencies[recvd_cnt++] = last_recv_ns - hdr.send_ns;
+                frame_start += msg_size;
+            }
+
+            // Keep the beginning of an incomplete frame for the next round
+            memmove(buffer, buffer + frame_start, buffered - frame_start);
+            buffered -= frame_start;
+        }
+    }
+    else {
+        // Datagrams and packets keep their boundaries
+        struct iovec   iovs[MAX_BATCH_SIZE];
+        struct mmsghdr msgs[MAX_BATCH_SIZE];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < batch_size; ++i) {
+            iovs[i].iov_base           = buffer + i * msg_size;
+            iovs[i].iov_len            = msg_size;
+            msgs[i].msg_hdr.msg_iov    = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (recvd_cnt < msg_cnt) {
+            int ret = recvmmsg(sock_fd, msgs, batch_size, MSG_WAITFORONE,
+                               NULL);
+            if (ret <= 0) {
+                err(RECV_ERROR, "Error in reception");
+            }
+            last_recv_ns = now_ns();
+
+            for (int i = 0; i < ret && recvd_cnt < msg_cnt; ++i) {
+                if (msgs[i].msg_len != msg_size) {
+                    errx(RECV_ERROR, "Received message of wrong size");
+                }
+
+                struct msg_header hdr;
+                memcpy(&hdr, iovs[i].iov_base, sizeof(hdr));
+                if (recvd_cnt == 0) {
+                    first_send_ns = hdr.send_ns;
+                }
+                latencies[recvd_cnt++] = last_recv_ns - hdr.send_ns;
+            }
+        }
+    }
+
+    *elapsed_ns = last_recv_ns - first_send_ns;
+    free(buffer);
+}
+
+// Return a socket address for the socket file at path
+struct sockaddr_un make_address(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    return addr;
+}
+
+// Return the current time of the monotonic clock in nanoseconds
+u_int64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        err(SOCK_ERROR, "Cannot read clock");
+    }
+
+    return (u_int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Compare two u_int64_t for qsort
+int compare_u64(const void *a, const void *b)
+{
+    u_int64_t x = *(const u_int64_t *) a;
+    u_int64_t y = *(const u_int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Return the value below which the fraction q of the sorted values lie
+u_int64_t percentile(const u_int64_t *sorted, long cnt, double q)
+{
+    long idx = (long) (q * cnt);
+    if (idx >= cnt) {
+        idx = cnt - 1;
+    }
+
+    return sorted[idx];
+}